@@ -0,0 +1,503 @@
+// Copyright (C) 2017 Kaan Kara - Systems Group, ETH Zurich
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//*************************************************************************
+
+#include "iFPGA.h"
+
+using namespace std;
+
+#define PARTIAL_DOT_STRIDE 16 // One cache line per thread
+
+// convert_float_to_signed23 in RTL/floatFSGD.vhd: truncating shift of the
+// mantissa into a 32-bit register, negated afterwards.
+static inline int32_t float_to_signed23(float f) {
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(float));
+	uint32_t exponent = (bits >> 23) & 0xFF;
+	uint32_t temp = 0x00800000 | (bits & 0x007FFFFF);
+	if (exponent >= 127)
+		temp = (exponent-127 >= 32) ? 0 : temp << (exponent-127);
+	else
+		temp = (127-exponent >= 32) ? 0 : temp >> (127-exponent);
+	if (bits & 0x80000000)
+		temp = 0-temp;
+	return (int32_t)temp;
+}
+
+// my_float_converter23: fixed point with 23 fractional bits to float, rounded to nearest
+static inline float signed23_to_float(int32_t v) {
+	return (float)v * (1.0f/8388608.0f);
+}
+
+static inline float bits_to_float(uint32_t bits) {
+	float f;
+	memcpy(&f, &bits, sizeof(float));
+	return f;
+}
+
+// Multiplier of RTL/qfixed_dot_product.vhd and qfixed_scalar_vector_mult.vhd
+static inline int32_t qmult(uint32_t q, int32_t x, int quantizationBits, char normalizedToMinus1_1) {
+	if (quantizationBits == 1) {
+		return q ? x : 0;
+	}
+	else if (quantizationBits == 2) {
+		if (normalizedToMinus1_1 == 0) {
+			if (q == 0)
+				return 0;
+			else if (q == 1)
+				return x >> 1;
+			else
+				return x;
+		}
+		else {
+			if (q == 1)
+				return x;
+			else if (q == 3)
+				return (int32_t)(0-(uint32_t)x);
+			else
+				return 0;
+		}
+	}
+	else if (quantizationBits == 4) {
+		int64_t v = (q == 0x8) ? 8 : (int64_t)((int32_t)(q << 28) >> 28);
+		return (int32_t)(uint32_t)((v*x) >> (normalizedToMinus1_1 ? 2 : 3));
+	}
+	else {
+		int64_t v = (q == 0x80) ? 128 : (int64_t)((int32_t)(q << 24) >> 24);
+		return (int32_t)(uint32_t)((v*x) >> (normalizedToMinus1_1 ? 6 : 7));
+	}
+}
+
+AFUEmulator::AFUEmulator(uint32_t _page_size_in_cache_lines, uint32_t _numThreads) {
+	page_size_in_cache_lines = _page_size_in_cache_lines;
+	page_bits = 0;
+	while ((1u << page_bits) < page_size_in_cache_lines)
+		page_bits++;
+
+	if (_numThreads == 0)
+		numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	else
+		numThreads = _numThreads;
+
+	numAllocations = 0;
+	nextPhys = 0x100000;
+
+	design = AFU_DESIGN_FLOATFSGD;
+	quantizationBits = 0;
+
+	ctl = 0;
+	addr_reset = 0;
+	read_offset = 0;
+	write_offset = 0;
+	num_lines = 0;
+	for (uint32_t i = 0; i < 6; i++)
+		config[i] = 0;
+	dsm_base = 0;
+	src_count = 0;
+	dst_count = 0;
+
+	running = 0;
+	busy.store(0);
+	numLiveWrites = 0;
+	x = NULL;
+	x_loading = NULL;
+	partial_dot = NULL;
+	for (uint32_t k = 0; k < 16; k++)
+		zero_line[k] = 0;
+}
+
+AFUEmulator::~AFUEmulator() {
+	join();
+	for (uint32_t i = 0; i < numAllocations; i++)
+		free(allocations[i].virt);
+}
+
+btVirtAddr AFUEmulator::WorkspaceAllocate(btWSSize size, btPhysAddr* phys) {
+	if (numAllocations == AFU_EMULATOR_MAX_ALLOCATIONS) {
+		ERR("Too many workspaces");
+		return NULL;
+	}
+	void* virt = NULL;
+	if (posix_memalign(&virt, 4096, size) != 0) {
+		ERR("Workspace allocation of " << size << " bytes failed");
+		return NULL;
+	}
+	memset(virt, 0, size);
+
+	// Hand out IO addresses from a private range, so that cache line
+	// addresses fit into the 32-bit page table entries like on the device.
+	allocations[numAllocations].virt = (btVirtAddr)virt;
+	allocations[numAllocations].phys = nextPhys;
+	allocations[numAllocations].size = size;
+	numAllocations++;
+
+	*phys = nextPhys;
+	nextPhys += (size + 4095) & ~(btWSSize)4095;
+	return (btVirtAddr)virt;
+}
+
+void AFUEmulator::WorkspaceFree(btVirtAddr virt) {
+	for (uint32_t i = 0; i < numAllocations; i++) {
+		if (allocations[i].virt == virt) {
+			free(virt);
+			allocations[i] = allocations[numAllocations-1];
+			numAllocations--;
+			return;
+		}
+	}
+}
+
+btVirtAddr AFUEmulator::translate(btPhysAddr phys) {
+	for (uint32_t i = 0; i < numAllocations; i++) {
+		if (phys >= allocations[i].phys && phys < allocations[i].phys + allocations[i].size)
+			return allocations[i].virt + (phys - allocations[i].phys);
+	}
+	return NULL;
+}
+
+void AFUEmulator::CSRWrite(uint32_t address, uint32_t value) {
+	if (busy.load(std::memory_order_acquire) == 1) {
+		ERR("CSR " << address << " written while a job runs");
+		numLiveWrites++;
+	}
+	switch (address) {
+		case CSR_CTL:
+			if ((value & 0x2) == 0)
+				join();
+			else if ((ctl & 0x2) == 0) {
+				running = 1;
+				busy.store(1, std::memory_order_release);
+				pthread_create(&run_thread, NULL, run, this);
+			}
+			ctl = value;
+			break;
+		case CSR_ADDR_RESET:
+			addr_reset = value;
+			if (value == 0) {
+				src_count = 0;
+				dst_count = 0;
+			}
+			break;
+		case CSR_SRC_ADDR:
+			if (addr_reset == 1 && value != 0 && src_count < 2048)
+				src_pages[src_count++] = translate((btPhysAddr)value << 6);
+			break;
+		case CSR_DST_ADDR:
+			if (addr_reset == 2 && value != 0 && dst_count < 2048)
+				dst_pages[dst_count++] = translate((btPhysAddr)value << 6);
+			break;
+		case CSR_READ_OFFSET:	read_offset = value;	break;
+		case CSR_WRITE_OFFSET:	write_offset = value;	break;
+		case CSR_NUM_LINES:		num_lines = value;		break;
+		case CSR_MY_CONFIG1:	config[1] = value;		break;
+		case CSR_MY_CONFIG2:	config[2] = value;		break;
+		case CSR_MY_CONFIG3:	config[3] = value;		break;
+		case CSR_MY_CONFIG4:	config[4] = value;		break;
+		case CSR_MY_CONFIG5:	config[5] = value;		break;
+		default: break;
+	}
+}
+
+void AFUEmulator::CSRWrite64(uint32_t address, uint64_t value) {
+	if (address == CSR_AFU_DSM_BASEL)
+		dsm_base = value;
+	else
+		CSRWrite(address, (uint32_t)value);
+}
+
+void AFUEmulator::loadDesign(char _design, int _quantizationBits) {
+	if (busy.load(std::memory_order_acquire) == 1) {
+		ERR("Design loaded while a job runs");
+		numLiveWrites++;
+	}
+	join();
+	design = _design;
+	quantizationBits = _quantizationBits;
+}
+
+void AFUEmulator::join() {
+	if (running == 1) {
+		pthread_join(run_thread, NULL);
+		running = 0;
+	}
+}
+
+uint32_t* AFUEmulator::sourceLine(uint32_t address) {
+	address += read_offset;
+	uint32_t page = address >> page_bits;
+	if (page >= src_count || src_pages[page] == NULL)
+		return zero_line;
+	return (uint32_t*)(src_pages[page] + CL(address & (page_size_in_cache_lines-1)));
+}
+
+uint32_t* AFUEmulator::destinationLine(uint32_t address) {
+	address += write_offset;
+	uint32_t page = address >> page_bits;
+	if (page >= dst_count || dst_pages[page] == NULL)
+		return NULL;
+	return (uint32_t*)(dst_pages[page] + CL(address & (page_size_in_cache_lines-1)));
+}
+
+void AFUEmulator::barrier() {
+	uint32_t generation = barrier_generation.load(std::memory_order_acquire);
+	if (barrier_count.fetch_add(1, std::memory_order_acq_rel) + 1 == active_threads) {
+		barrier_count.store(0, std::memory_order_relaxed);
+		barrier_generation.fetch_add(1, std::memory_order_release);
+	}
+	else {
+		uint32_t spins = 0;
+		while (barrier_generation.load(std::memory_order_acquire) == generation) {
+			if (++spins > 1000)
+				sched_yield();
+		}
+	}
+}
+
+void* AFUEmulator::run(void* arg) {
+	AFUEmulator* afu = (AFUEmulator*)arg;
+
+	uint32_t dimension = afu->config[3] & 0x3FFFF;
+	if (afu->design == AFU_DESIGN_FLOATFSGD) {
+		afu->units = dimension; // accumulation_count
+		afu->elements = 16;
+		afu->lines_per_row = afu->units;
+	}
+	else if (afu->design == AFU_DESIGN_QFSGD_Q1) {
+		afu->elements = 128;
+		afu->units = 2*((dimension >> 8) + ((dimension & 0xFF) > 0));
+		afu->lines_per_row = afu->units/2;
+	}
+	else {
+		afu->elements = 256/afu->quantizationBits;
+		afu->units = dimension/afu->elements + (dimension%afu->elements > 0);
+		afu->lines_per_row = afu->units;
+	}
+
+	uint32_t numSamples = afu->config[4];
+	if (afu->units == 0 || (uint64_t)numSamples*afu->lines_per_row > afu->num_lines) {
+		ERR("CSR_NUM_LINES (" << afu->num_lines << ") does not cover " << numSamples << " samples of " << afu->lines_per_row << " cache lines");
+	}
+	else {
+		afu->active_threads = afu->units/AFU_EMULATOR_MIN_CLS_PER_THREAD;
+		if (afu->active_threads > afu->numThreads)
+			afu->active_threads = afu->numThreads;
+		if (afu->active_threads == 0)
+			afu->active_threads = 1;
+
+		afu->x = (int32_t*)calloc(afu->units*afu->elements, sizeof(int32_t));
+		afu->x_loading = (int32_t*)calloc(afu->units*afu->elements, sizeof(int32_t));
+		afu->partial_dot = (int32_t*)calloc(2*afu->active_threads*PARTIAL_DOT_STRIDE, sizeof(int32_t));
+		afu->barrier_count.store(0);
+		afu->barrier_generation.store(0);
+
+		worker* workers = (worker*)malloc(afu->active_threads*sizeof(worker));
+		pthread_t* threads = (pthread_t*)malloc(afu->active_threads*sizeof(pthread_t));
+		for (uint32_t t = 0; t < afu->active_threads; t++) {
+			workers[t].afu = afu;
+			workers[t].id = t;
+			workers[t].firstUnit = (uint32_t)(((uint64_t)afu->units*t)/afu->active_threads);
+			workers[t].lastUnit = (uint32_t)(((uint64_t)afu->units*(t+1))/afu->active_threads);
+		}
+		for (uint32_t t = 1; t < afu->active_threads; t++)
+			pthread_create(&threads[t], NULL, runWorker, &workers[t]);
+		runWorker(&workers[0]);
+		for (uint32_t t = 1; t < afu->active_threads; t++)
+			pthread_join(threads[t], NULL);
+
+		free(workers);
+		free(threads);
+		free(afu->x);
+		free(afu->x_loading);
+		free(afu->partial_dot);
+		afu->x = NULL;
+		afu->x_loading = NULL;
+		afu->partial_dot = NULL;
+	}
+
+	// Signal completion in the DSM
+	afu->busy.store(0, std::memory_order_release);
+	btVirtAddr dsm = afu->translate(afu->dsm_base);
+	if (dsm != NULL)
+		__atomic_store_n((bt32bitCSR*)(dsm + DSM_STATUS_TEST_COMPLETE), 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+void* AFUEmulator::runWorker(void* arg) {
+	worker* w = (worker*)arg;
+	if (w->afu->design == AFU_DESIGN_FLOATFSGD)
+		w->afu->floatFSGD(w);
+	else
+		w->afu->qFSGD(w);
+	return NULL;
+}
+
+// RTL/floatFSGD.vhd
+void AFUEmulator::floatFSGD(worker* w) {
+	uint32_t numSamples = config[4];
+	uint32_t numEpochs = config[3] >> 18;
+	uint32_t minibatchSize = (config[2] >> 10) & 0xFFFF;
+	char binarize_b = (config[2] >> 1) & 0x1;
+	float stepSize = bits_to_float(config[1]);
+
+	for (uint32_t epoch = 0; epoch < numEpochs; epoch++) {
+		for (uint32_t i = 0; i < numSamples; i++) {
+			uint32_t rowAddress = i*lines_per_row;
+
+			uint32_t partial = 0;
+			for (uint32_t u = w->firstUnit; u < w->lastUnit; u++) {
+				uint32_t* line = sourceLine(rowAddress + u);
+				int32_t* x_here = x + 16*u;
+				uint32_t valuesInLine = (u == units-1) ? 15 : 16; // Label is not a feature
+				for (uint32_t k = 0; k < valuesInLine; k++) {
+					partial += (uint32_t)float_to_signed23( bits_to_float(line[k])*signed23_to_float(x_here[k]) );
+				}
+			}
+
+			uint32_t dot = partial;
+			if (active_threads > 1) {
+				int32_t* partials = partial_dot + (i&1)*active_threads*PARTIAL_DOT_STRIDE;
+				partials[w->id*PARTIAL_DOT_STRIDE] = (int32_t)partial;
+				barrier();
+				dot = 0;
+				for (uint32_t t = 0; t < active_threads; t++)
+					dot += (uint32_t)partials[t*PARTIAL_DOT_STRIDE];
+			}
+
+			uint32_t label = sourceLine(rowAddress + units-1)[15];
+			float b_to_subtract;
+			if (binarize_b == 0)
+				b_to_subtract = bits_to_float(label);
+			else
+				b_to_subtract = (label == config[5]) ? 1.0f : 0.0f;
+
+			float minus_b_times_alpha = stepSize*(signed23_to_float((int32_t)dot) - b_to_subtract);
+
+			for (uint32_t u = w->firstUnit; u < w->lastUnit; u++) {
+				uint32_t* line = sourceLine(rowAddress + u);
+				int32_t* x_here = x_loading + 16*u;
+				uint32_t valuesInLine = (u == units-1) ? 15 : 16;
+				for (uint32_t k = 0; k < valuesInLine; k++) {
+					x_here[k] = (int32_t)((uint32_t)x_here[k] - (uint32_t)float_to_signed23(minus_b_times_alpha*bits_to_float(line[k])));
+				}
+			}
+
+			if (((i & 0xFFFF) & minibatchSize) == minibatchSize || i == numSamples-1)
+				memcpy(x + 16*w->firstUnit, x_loading + 16*w->firstUnit, 16*(w->lastUnit - w->firstUnit)*sizeof(int32_t));
+		}
+
+		for (uint32_t u = w->firstUnit; u < w->lastUnit; u++) {
+			uint32_t* line = destinationLine(epoch*units + u);
+			if (line != NULL)
+				memcpy(line, x + 16*u, CL(1));
+		}
+	}
+}
+
+// RTL/qFSGD.vhd and RTL/qFSGD_Q1.vhd
+void AFUEmulator::qFSGD(worker* w) {
+	uint32_t numSamples = config[4];
+	uint32_t numEpochs = config[3] >> 18;
+	uint32_t minibatchSize = (config[2] >> 10) & 0xFFFF;
+	uint32_t numberOfIndices = (config[2] >> 2) & 0xFF;
+	char binarize_b = (config[2] >> 1) & 0x1;
+	char normalizedToMinus1_1 = config[2] & 0x1;
+	uint32_t stepSizeShifter = config[1] & 0x3F;
+	uint32_t stepSizeDeclineInterval = (config[1] >> 6) & 0x3FFF;
+
+	char halfLines = (design == AFU_DESIGN_QFSGD_Q1);
+	int bits = halfLines ? 1 : quantizationBits;
+	uint32_t mask = (1u << bits)-1;
+	if (halfLines)
+		normalizedToMinus1_1 = 0;
+	// Elements of the last unit that share a line with the label
+	uint32_t elementsInLastUnit = halfLines ? 96 : 240/bits;
+	uint32_t linesPerEpochForX = elements/16;
+	if (numberOfIndices == 0)
+		numberOfIndices = 256;
+
+	uint32_t index = 0;
+	for (uint32_t epoch = 0; epoch < numEpochs; epoch++) {
+		uint32_t indexAddress = index*num_lines;
+		uint32_t shifter = stepSizeShifter > 31 ? 31 : stepSizeShifter;
+
+		for (uint32_t i = 0; i < numSamples; i++) {
+			uint32_t rowAddress = indexAddress + i*lines_per_row;
+
+			uint32_t partial = 0;
+			for (uint32_t u = w->firstUnit; u < w->lastUnit; u++) {
+				uint32_t* line = sourceLine(rowAddress + (halfLines ? u/2 : u));
+				uint32_t bitOffset = halfLines ? 256*(u&1) : 0;
+				uint32_t numElements = (u == units-1) ? elementsInLastUnit : elements;
+				int32_t* x_here = x + elements*u;
+				for (uint32_t k = 0; k < numElements; k++) {
+					uint32_t position = bitOffset + 2*bits*k;
+					uint32_t q1 = (line[position >> 5] >> (position & 31)) & mask;
+					partial += (uint32_t)qmult(q1, x_here[k], bits, normalizedToMinus1_1);
+				}
+			}
+
+			uint32_t dot = partial;
+			if (active_threads > 1) {
+				int32_t* partials = partial_dot + (i&1)*active_threads*PARTIAL_DOT_STRIDE;
+				partials[w->id*PARTIAL_DOT_STRIDE] = (int32_t)partial;
+				barrier();
+				dot = 0;
+				for (uint32_t t = 0; t < active_threads; t++)
+					dot += (uint32_t)partials[t*PARTIAL_DOT_STRIDE];
+			}
+
+			uint32_t label = sourceLine(rowAddress + lines_per_row-1)[15];
+			uint32_t b_to_subtract;
+			if (binarize_b == 0)
+				b_to_subtract = label;
+			else if (halfLines)
+				b_to_subtract = (label == config[5]) ? 0x3f800000 : 0xbf800000;
+			else
+				b_to_subtract = (label == config[5]) ? 0x00800000 : 0x00000000;
+
+			int32_t minus_b_times_alpha = ((int32_t)(dot - b_to_subtract)) >> shifter;
+
+			for (uint32_t u = w->firstUnit; u < w->lastUnit; u++) {
+				uint32_t* line = sourceLine(rowAddress + (halfLines ? u/2 : u));
+				uint32_t bitOffset = halfLines ? 256*(u&1) : 0;
+				uint32_t numElements = (u == units-1) ? elementsInLastUnit : elements;
+				int32_t* x_here = x_loading + elements*u;
+				for (uint32_t k = 0; k < numElements; k++) {
+					uint32_t position = bitOffset + 2*bits*k + bits;
+					uint32_t q2 = (line[position >> 5] >> (position & 31)) & mask;
+					x_here[k] = (int32_t)((uint32_t)x_here[k] - (uint32_t)qmult(q2, minus_b_times_alpha, bits, normalizedToMinus1_1));
+				}
+			}
+
+			if (((i & 0xFFFF) & minibatchSize) == minibatchSize || i == numSamples-1)
+				memcpy(x + elements*w->firstUnit, x_loading + elements*w->firstUnit, elements*(w->lastUnit - w->firstUnit)*sizeof(int32_t));
+		}
+
+		for (uint32_t u = w->firstUnit; u < w->lastUnit; u++) {
+			for (uint32_t l = 0; l < linesPerEpochForX; l++) {
+				uint32_t* line = destinationLine((epoch*units + u)*linesPerEpochForX + l);
+				if (line != NULL)
+					memcpy(line, x + elements*u + 16*l, CL(1));
+			}
+		}
+
+		index = (index+1 == numberOfIndices) ? 0 : index+1;
+		if ((epoch & stepSizeDeclineInterval) == stepSizeDeclineInterval) {
+			stepSizeShifter = (stepSizeShifter+1) & 0x3F;
+			if (stepSizeShifter == 0)
+				stepSizeShifter = config[1] & 0x3F;
+		}
+	}
+}
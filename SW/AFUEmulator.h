@@ -0,0 +1,166 @@
+// Copyright (C) 2017 Kaan Kara - Systems Group, ETH Zurich
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//*************************************************************************
+
+#ifndef AFU_EMULATOR
+#define AFU_EMULATOR
+
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <atomic>
+
+// Stand-ins for the AAL types and helpers that iFPGA uses, so that the
+// host code builds without the AAL SDK when the AFU is emulated (-D SWAFU).
+typedef uint8_t*	btVirtAddr;
+typedef uint64_t	btPhysAddr;
+typedef uint64_t	btWSSize;
+typedef uint32_t	bt32bitCSR;
+typedef bool		btBool;
+typedef int			btInt;
+
+#define CACHELINE_ALIGNED_ADDR(p) ((p) >> 6)
+
+#ifdef MSG
+# undef MSG
+#endif // MSG
+#define MSG(x) std::cout << __FILE__ << ':' << __LINE__ << ':' << __func__ << "() : " << x << std::endl
+#ifdef ERR
+# undef ERR
+#endif // ERR
+#define ERR(x) std::cerr << __FILE__ << ':' << __LINE__ << ':' << __func__ << "() **Error : " << x << std::endl
+
+static inline void SleepNano(uint64_t ns) {
+	struct timespec t;
+	t.tv_sec = ns/1000000000;
+	t.tv_nsec = ns%1000000000;
+	nanosleep(&t, NULL);
+}
+
+static inline void SleepSec(uint64_t s) {
+	sleep(s);
+}
+
+// Which bitstream the emulated FPGA is programmed with
+#define AFU_DESIGN_FLOATFSGD	0
+#define AFU_DESIGN_QFSGD		1
+#define AFU_DESIGN_QFSGD_Q1		2
+
+#define AFU_EMULATOR_MAX_ALLOCATIONS	(2*2048+1)
+#define AFU_EMULATOR_MIN_CLS_PER_THREAD	4
+
+/// @brief   Software model of the AFU in RTL/top.vhd, driven through the same
+///          CSR writes and shared workspaces the host uses on the real device.
+///
+/// Page tables are populated through CSR_ADDR_RESET/CSR_SRC_ADDR/CSR_DST_ADDR,
+/// CSR_CTL = 3 starts the loaded design and completion is signalled in the DSM
+/// at DSM_STATUS_TEST_COMPLETE. The datapaths of floatFSGD, qFSGD and qFSGD_Q1
+/// are reproduced bit by bit (float-to-fixed conversions, wrap-around adder
+/// trees, quantized multipliers, step size decline and index cycling), with
+/// samples applied in order; the pipeline staleness of the real device, which
+/// depends on memory timing, is not modelled. The model is split across
+/// threads by cache lines, which is exact since all accumulations are integer.
+class AFUEmulator {
+public:
+	AFUEmulator(uint32_t _page_size_in_cache_lines, uint32_t _numThreads);
+	~AFUEmulator();
+
+	btVirtAddr WorkspaceAllocate(btWSSize size, btPhysAddr* phys);
+	void WorkspaceFree(btVirtAddr virt);
+
+	void CSRWrite(uint32_t address, uint32_t value);
+	void CSRWrite64(uint32_t address, uint64_t value);
+
+	void loadDesign(char _design, int _quantizationBits);
+
+	uint32_t numThreads;
+	// CSR writes and design loads while a job was running, which the RTL would
+	// apply to that job (it reads its registers live)
+	uint32_t numLiveWrites;
+
+private:
+	struct allocation {
+		btVirtAddr virt;
+		btPhysAddr phys;
+		btWSSize size;
+	};
+
+	struct worker {
+		AFUEmulator* afu;
+		uint32_t id;
+		uint32_t firstUnit;
+		uint32_t lastUnit;
+	};
+
+	uint32_t page_size_in_cache_lines;
+	uint32_t page_bits;
+
+	allocation allocations[AFU_EMULATOR_MAX_ALLOCATIONS];
+	uint32_t numAllocations;
+	btPhysAddr nextPhys;
+
+	char design;
+	int quantizationBits;
+
+	// Registers
+	uint32_t ctl;
+	uint32_t addr_reset;
+	uint32_t read_offset;
+	uint32_t write_offset;
+	uint32_t num_lines;
+	uint32_t config[6];
+	btPhysAddr dsm_base;
+
+	// Page tables, as resolved host addresses
+	btVirtAddr src_pages[2048];
+	uint32_t src_count;
+	btVirtAddr dst_pages[2048];
+	uint32_t dst_count;
+
+	pthread_t run_thread;
+	char running;
+	std::atomic<char> busy;	// From the start of a job until it signals completion
+
+	// State shared by the workers of one run
+	uint32_t units;			// Model units (cache lines or half lines) per sample
+	uint32_t elements;		// Model elements per unit
+	uint32_t lines_per_row;
+	int32_t* x;				// Model used for the dot product
+	int32_t* x_loading;		// Model receiving the updates
+	int32_t* partial_dot;	// [2][numThreads] padded to cache lines
+	std::atomic<uint32_t> barrier_count;
+	std::atomic<uint32_t> barrier_generation;
+	uint32_t active_threads;
+	uint32_t zero_line[16];
+
+	btVirtAddr translate(btPhysAddr phys);
+	uint32_t* sourceLine(uint32_t address);
+	uint32_t* destinationLine(uint32_t address);
+	void barrier();
+
+	static void* run(void* arg);
+	static void* runWorker(void* arg);
+	void floatFSGD(worker* w);
+	void qFSGD(worker* w);
+	void join();
+};
+
+#endif
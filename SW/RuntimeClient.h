@@ -28,6 +28,18 @@
 #ifndef RUNTIME_CLIENT
 #define RUNTIME_CLIENT
 
+#ifdef SWAFU
+#include "AFUEmulator.h"
+
+/// @brief   Stand-in for the AAL runtime client when the AFU is emulated in software.
+class RuntimeClient {
+public:
+	void end() {}
+	btBool isOK() { return true; }
+};
+
+#else
+
 #ifdef HARPv1
 	#include <aalsdk/AAL.h>
 	#include <aalsdk/xlRuntime.h>
@@ -98,4 +110,6 @@ public:
 	CSemaphore       m_Sem;       // For synchronizing with the AAL runtime.
 };
 
+#endif // SWAFU
+
 #endif
\ No newline at end of file
@@ -0,0 +1,73 @@
+// Copyright (C) 2017 Kaan Kara - Systems Group, ETH Zurich
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//*************************************************************************
+
+#ifndef FPGA_DATASET
+#define FPGA_DATASET
+
+#include <stdint.h>
+
+// On-disk dataset already laid out the way the FPGA reads it, so that it can
+// be mmapped and copied page by page into the workspace.
+//
+// File: fpga_dataset_header, then per-column min and max of a as stored in the
+// file, i.e. after whatever normalization ran before saving (numFeatures floats
+// each), then the sections, each starting on a FPGA_DATASET_ALIGNMENT
+// boundary. Section 0 is always the float layout of copy_data_into_FPGA_memory
+// (accumulationCount lines per row, label in the last slot). Further sections
+// hold numberOfIndices quantized copies in the layout of
+// copy_data_into_FPGA_memory_after_quantization, one per quantization width.
+// Quantized sections are only written if a_normalized is set: the quantizer
+// expects a in [0,1], or [-1,1] with a_normalizedToMinus1_1 (all but the bias
+// in column 0, as a_normalize leaves it).
+
+#define FPGA_DATASET_MAGIC			0x4C4D505A // "ZPML"
+#define FPGA_DATASET_VERSION		2
+#define FPGA_DATASET_MAX_SECTIONS	5
+#define FPGA_DATASET_ALIGNMENT		4096
+
+struct fpga_dataset_section {
+	uint32_t quantizationBits;		// 0 for the float layout
+	uint32_t numberOfIndices;
+	uint32_t cacheLinesPerIndex;
+	uint32_t reserved;
+	uint64_t offset;				// In bytes from the start of the file
+	uint64_t size;					// In bytes
+};
+
+struct fpga_dataset_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t numSamples;
+	uint32_t numFeatures;
+	uint32_t numValuesPerLine;
+	uint32_t accumulationCount;
+	uint32_t b_toIntegerScaler;
+	uint8_t a_normalizedToMinus1_1;
+	uint8_t b_normalizedToMinus1_1;
+	uint8_t a_normalized;			// 1 if the column min/max lie in the quantizer range
+	uint8_t reserved;
+	float b_range;
+	float b_min;
+	uint32_t numSections;
+	uint64_t columnStatsOffset;		// numFeatures mins, then numFeatures maxs
+	fpga_dataset_section sections[FPGA_DATASET_MAX_SECTIONS];
+};
+
+static inline uint64_t fpga_dataset_align(uint64_t offset) {
+	return (offset + FPGA_DATASET_ALIGNMENT-1)/FPGA_DATASET_ALIGNMENT*FPGA_DATASET_ALIGNMENT;
+}
+
+#endif
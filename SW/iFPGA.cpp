@@ -27,10 +27,12 @@
 
 #include <sched.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/resource.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <math.h>
 #include <limits.h>
 #include <pthread.h>
@@ -38,19 +40,21 @@
 #include "iFPGA.h"
 
 using namespace std;
+#ifndef SWAFU
 using namespace AAL;
-
-#define MAX_page_count 2048
+#endif
 
 iFPGA::iFPGA(RuntimeClient *rtc, uint32_t _page_count, uint32_t _page_size_in_cache_lines) :
-#ifdef HARPv1
+#if defined(HARPv1) || defined(SWAFU)
 m_AFUService(NULL),
 #else
 m_pALIBufferService(NULL),
 m_pALIMMIOService(NULL),
 m_pALIResetService(NULL),
 #endif
+#ifndef SWAFU
 m_pAALService(NULL),
+#endif
 m_runtimeClient(rtc),
 m_Result(0),
 m_DSMVirt(NULL),
@@ -58,16 +62,24 @@ m_DSMPhys(0),
 m_DSMSize(0)
 {
 	page_size_in_cache_lines = _page_size_in_cache_lines;
-	page_count = _page_count;
-
-	m_InputVirt = (btVirtAddr*)malloc(page_count*sizeof(btVirtAddr));
-	m_InputPhys = (btPhysAddr*)malloc(page_count*sizeof(btPhysAddr));
-	m_InputSize = (btWSSize*)malloc(page_count*sizeof(btWSSize));
-	m_OutputVirt = (btVirtAddr*)malloc(page_count*sizeof(btVirtAddr));
-	m_OutputPhys = (btPhysAddr*)malloc(page_count*sizeof(btPhysAddr));
-	m_OutputSize = (btWSSize*)malloc(page_count*sizeof(btWSSize));
-
-	for (uint32_t i = 0; i < page_count; i++) {
+	page_count = (_page_count > MAX_page_count) ? MAX_page_count : _page_count;
+
+	// Page geometry in 32-bit words, page sizes are powers of two
+	page_shift32 = 4;
+	while ((1u << page_shift32) < page_size_in_cache_lines*16)
+		page_shift32++;
+	page_mask32 = (1u << page_shift32) - 1;
+
+	// Page tables for the most pages the AFU supports, so that growWorkspace
+	// can add pages without moving them
+	m_InputVirt = (btVirtAddr*)malloc(MAX_page_count*sizeof(btVirtAddr));
+	m_InputPhys = (btPhysAddr*)malloc(MAX_page_count*sizeof(btPhysAddr));
+	m_InputSize = (btWSSize*)malloc(MAX_page_count*sizeof(btWSSize));
+	m_OutputVirt = (btVirtAddr*)malloc(MAX_page_count*sizeof(btVirtAddr));
+	m_OutputPhys = (btPhysAddr*)malloc(MAX_page_count*sizeof(btPhysAddr));
+	m_OutputSize = (btWSSize*)malloc(MAX_page_count*sizeof(btWSSize));
+
+	for (uint32_t i = 0; i < MAX_page_count; i++) {
 		m_InputVirt[i] = NULL;
 		m_InputPhys[i] = 0;
 		m_InputSize[i] = 0;
@@ -75,6 +87,7 @@ m_DSMSize(0)
 		m_OutputPhys[i] = 0;
 		m_OutputSize[i] = 0;
 	}
+#ifndef SWAFU
 #ifdef HARPv1
 	SetSubClassInterface(iidServiceClient, dynamic_cast<IServiceClient *>(this));
 	SetInterface(iidCCIClient, dynamic_cast<ICCIClient *>(this));
@@ -83,18 +96,31 @@ m_DSMSize(0)
 #endif
 
 	m_Sem.Create(0, 1);
+#endif
+	jobsSubmitted = 0;
+	jobsCompleted = 0;
+	setWaitPolicy(1000, 100, 1000);
+	resetWaitStatistics();
+
 	allocateSuccess = allocateWorkspace();
 }
 
 iFPGA::~iFPGA() {
-#ifdef HARPv1
+#if defined(SWAFU)
+	for(uint32_t i = 0; i < page_count; i++) {
+		m_AFUService->WorkspaceFree(m_InputVirt[i]);
+		m_AFUService->WorkspaceFree(m_OutputVirt[i]);
+	}
+	m_AFUService->WorkspaceFree(m_DSMVirt);
+	delete m_AFUService;
+#elif defined(HARPv1)
 	// Release the Workspaces and wait for all three then Release the Service
 	for(uint32_t i = 0; i < page_count; i++) {
 		m_AFUService->WorkspaceFree(m_InputVirt[i],  TransactionID(i+1));
 		m_Sem.Wait();
 	}
 	for(uint32_t i = 0; i < page_count; i++) {
-		m_AFUService->WorkspaceFree(m_OutputVirt[i],  TransactionID(page_count+i+1));
+		m_AFUService->WorkspaceFree(m_OutputVirt[i],  TransactionID(MAX_page_count+i+1));
 		m_Sem.Wait();
 	}
 	m_AFUService->WorkspaceFree(m_DSMVirt, TransactionID(0));
@@ -119,8 +145,10 @@ iFPGA::~iFPGA() {
 	m_runtimeClient->m_Runtime.stop();
 	m_runtimeClient->m_Sem.Wait();
 #endif
+#ifndef SWAFU
 	m_runtimeClient->m_Sem.Destroy();
 	m_Sem.Destroy();
+#endif
 
 	free(m_InputVirt);
 	free(m_InputPhys);
@@ -132,18 +160,8 @@ iFPGA::~iFPGA() {
 
 void iFPGA::writeToMemory32(char inOrOut, uint32_t dat32, uint32_t address32)
 {
-	int whichPage = 0;
-	int addressInPage = 0;
-	if (page_size_in_cache_lines == 128)
-	{
-		whichPage = (address32 >> 11);
-		addressInPage = address32 & 0x7FF;
-	}
-	else if (page_size_in_cache_lines == 65536)
-	{
-		whichPage = (address32 >> 20);
-		addressInPage = address32 & 0xFFFFF;
-	}
+	uint32_t whichPage = address32 >> page_shift32;
+	uint32_t addressInPage = address32 & page_mask32;
 
 	if (inOrOut == 'i')
 	{
@@ -165,18 +183,8 @@ void iFPGA::writeToMemory32(char inOrOut, uint32_t dat32, uint32_t address32)
 
 uint32_t iFPGA::readFromMemory32(char inOrOut, uint32_t address32)
 {
-	int whichPage = 0;
-	int addressInPage = 0;
-	if (page_size_in_cache_lines == 128)
-	{
-		whichPage = (address32 >> 11);
-		addressInPage = address32 & 0x7FF;
-	}
-	else if (page_size_in_cache_lines == 65536)
-	{
-		whichPage = (address32 >> 20);
-		addressInPage = address32 & 0xFFFFF;
-	}
+	uint32_t whichPage = address32 >> page_shift32;
+	uint32_t addressInPage = address32 & page_mask32;
 
 	if (inOrOut == 'i')
 	{
@@ -200,18 +208,8 @@ uint32_t iFPGA::readFromMemory32(char inOrOut, uint32_t address32)
 
 void iFPGA::writeToMemory64(char inOrOut, uint64_t dat64, uint32_t address64)
 {
-	int whichPage = 0;
-	int addressInPage = 0;
-	if (page_size_in_cache_lines == 128)
-	{
-		whichPage = (address64 >> 10);
-		addressInPage = address64 & 0x3FF;
-	}
-	else if (page_size_in_cache_lines == 65536)
-	{
-		whichPage = (address64 >> 19);
-		addressInPage = address64 & 0x7FFFF;
-	}
+	uint32_t whichPage = address64 >> (page_shift32-1);
+	uint32_t addressInPage = address64 & (page_mask32 >> 1);
 
 	if (inOrOut == 'i')
 	{
@@ -233,18 +231,8 @@ void iFPGA::writeToMemory64(char inOrOut, uint64_t dat64, uint32_t address64)
 
 uint64_t iFPGA::readFromMemory64(char inOrOut, uint32_t address64)
 {
-	int whichPage = 0;
-	int addressInPage = 0;
-	if (page_size_in_cache_lines == 128)
-	{
-		whichPage = (address64 >> 10);
-		addressInPage = address64 & 0x3FF;
-	}
-	else if (page_size_in_cache_lines == 65536)
-	{
-		whichPage = (address64 >> 19);
-		addressInPage = address64 & 0x7FFFF;
-	}
+	uint32_t whichPage = address64 >> (page_shift32-1);
+	uint32_t addressInPage = address64 & (page_mask32 >> 1);
 
 	if (inOrOut == 'i')
 	{
@@ -268,18 +256,8 @@ uint64_t iFPGA::readFromMemory64(char inOrOut, uint32_t address64)
 
 void iFPGA::writeToMemoryDouble(char inOrOut, double dat, uint32_t address)
 {
-	int whichPage = 0;
-	int addressInPage = 0;
-	if (page_size_in_cache_lines == 128)
-	{
-		whichPage = (address >> 10);
-		addressInPage = address & 0x3FF;
-	}
-	else if (page_size_in_cache_lines == 65536)
-	{
-		whichPage = (address >> 19);
-		addressInPage = address & 0x7FFFF;
-	}
+	uint32_t whichPage = address >> (page_shift32-1);
+	uint32_t addressInPage = address & (page_mask32 >> 1);
 
 	if (inOrOut == 'i')
 	{
@@ -301,18 +279,8 @@ void iFPGA::writeToMemoryDouble(char inOrOut, double dat, uint32_t address)
 
 double iFPGA::readFromMemoryDouble(char inOrOut, uint32_t address)
 {
-	int whichPage = 0;
-	int addressInPage = 0;
-	if (page_size_in_cache_lines == 128)
-	{
-		whichPage = (address >> 10);
-		addressInPage = address & 0x3FF;
-	}
-	else if (page_size_in_cache_lines == 65536)
-	{
-		whichPage = (address >> 19);
-		addressInPage = address & 0x7FFFF;
-	}
+	uint32_t whichPage = address >> (page_shift32-1);
+	uint32_t addressInPage = address & (page_mask32 >> 1);
 
 	if (inOrOut == 'i')
 	{
@@ -336,18 +304,8 @@ double iFPGA::readFromMemoryDouble(char inOrOut, uint32_t address)
 
 void iFPGA::writeToMemoryFloat(char inOrOut, float dat, uint32_t address)
 {
-	int whichPage = 0;
-	int addressInPage = 0;
-	if (page_size_in_cache_lines == 128)
-	{
-		whichPage = (address >> 11);
-		addressInPage = address & 0x7FF;
-	}
-	else if (page_size_in_cache_lines == 65536)
-	{
-		whichPage = (address >> 20);
-		addressInPage = address & 0xFFFFF;
-	}
+	uint32_t whichPage = address >> page_shift32;
+	uint32_t addressInPage = address & page_mask32;
 
 	if (inOrOut == 'i')
 	{
@@ -369,18 +327,8 @@ void iFPGA::writeToMemoryFloat(char inOrOut, float dat, uint32_t address)
 
 float iFPGA::readFromMemoryFloat(char inOrOut, uint32_t address)
 {
-	int whichPage = 0;
-	int addressInPage = 0;
-	if (page_size_in_cache_lines == 128)
-	{
-		whichPage = (address >> 11);
-		addressInPage = address & 0x7FF;
-	}
-	else if (page_size_in_cache_lines == 65536)
-	{
-		whichPage = (address >> 20);
-		addressInPage = address & 0xFFFFF;
-	}
+	uint32_t whichPage = address >> page_shift32;
+	uint32_t addressInPage = address & page_mask32;
 
 	if (inOrOut == 'i')
 	{
@@ -402,7 +350,109 @@ float iFPGA::readFromMemoryFloat(char inOrOut, uint32_t address)
 	return 0;
 }
 
+// Contiguous workspace words from address32 up to the end of its page
+uint32_t iFPGA::getSpan(char inOrOut, uint32_t address32, uint32_t** span)
+{
+	uint32_t whichPage = address32 >> page_shift32;
+	btVirtAddr* pages = (inOrOut == 'i') ? m_InputVirt : m_OutputVirt;
+	if (whichPage >= page_count || pages[whichPage] == NULL)
+	{
+		*span = NULL;
+		return 0;
+	}
+	uint32_t addressInPage = address32 & page_mask32;
+	*span = (uint32_t*)pages[whichPage] + addressInPage;
+	return page_mask32 + 1 - addressInPage;
+}
+
+struct bulk_copy_args {
+	iFPGA* fpga;
+	char inOrOut;
+	char toWorkspace;
+	uint32_t* host;
+	uint32_t address32;
+	uint32_t numWords;
+	uint32_t copied;
+};
+
+static void* bulkCopyWorker(void* arg)
+{
+	bulk_copy_args* args = (bulk_copy_args*)arg;
+	args->copied = 0;
+	while (args->copied < args->numWords)
+	{
+		uint32_t* span;
+		uint32_t spanWords = args->fpga->getSpan(args->inOrOut, args->address32 + args->copied, &span);
+		if (spanWords == 0)
+			break;
+		if (spanWords > args->numWords - args->copied)
+			spanWords = args->numWords - args->copied;
+		if (args->toWorkspace == 1)
+			memcpy(span, args->host + args->copied, spanWords*sizeof(uint32_t));
+		else
+			memcpy(args->host + args->copied, span, spanWords*sizeof(uint32_t));
+		args->copied += spanWords;
+	}
+	return NULL;
+}
+
+uint32_t iFPGA::bulkCopy(char inOrOut, char toWorkspace, uint32_t* host, uint32_t address32, uint32_t numWords, uint32_t numThreads)
+{
+	// Split into chunks of whole pages, at least one page per thread
+	uint32_t numPages = (numWords + page_mask32) >> page_shift32;
+	if (numThreads > numPages)
+		numThreads = numPages;
+	if (numThreads <= 1)
+	{
+		bulk_copy_args args = {this, inOrOut, toWorkspace, host, address32, numWords, 0};
+		bulkCopyWorker(&args);
+		return args.copied;
+	}
+
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+	bulk_copy_args* args = (bulk_copy_args*)malloc(numThreads*sizeof(bulk_copy_args));
+	for (uint32_t t = 0; t < numThreads; t++)
+	{
+		uint32_t first = (uint32_t)(((uint64_t)numPages*t/numThreads) << page_shift32);
+		uint32_t last = (uint32_t)(((uint64_t)numPages*(t+1)/numThreads) << page_shift32);
+		if (last > numWords)
+			last = numWords;
+		args[t].fpga = this;
+		args[t].inOrOut = inOrOut;
+		args[t].toWorkspace = toWorkspace;
+		args[t].host = host + first;
+		args[t].address32 = address32 + first;
+		args[t].numWords = last - first;
+		args[t].copied = 0;
+		pthread_create(&threads[t], NULL, bulkCopyWorker, &args[t]);
+	}
+	uint32_t copied = 0;
+	for (uint32_t t = 0; t < numThreads; t++)
+	{
+		pthread_join(threads[t], NULL);
+		copied += args[t].copied;
+	}
+	free(threads);
+	free(args);
+	return copied;
+}
+
+uint32_t iFPGA::writeToMemory(char inOrOut, const void* src, uint32_t address32, uint32_t numWords, uint32_t numThreads)
+{
+	return bulkCopy(inOrOut, 1, (uint32_t*)src, address32, numWords, numThreads);
+}
+
+uint32_t iFPGA::readFromMemory(char inOrOut, void* dst, uint32_t address32, uint32_t numWords, uint32_t numThreads)
+{
+	return bulkCopy(inOrOut, 0, (uint32_t*)dst, address32, numWords, numThreads);
+}
+
 void iFPGA::doTransaction()
+{
+	waitTransaction(submitTransaction());
+}
+
+void iFPGA::startTransaction()
 {
 	// Assert Device Reset
 	CSR_WRITE32(this, CSR_CTL, 0);
@@ -410,20 +460,237 @@ void iFPGA::doTransaction()
 	// De-assert Device Reset
 	CSR_WRITE32(this, CSR_CTL, 1);
 
-	volatile bt32bitCSR *StatusAddr = (volatile bt32bitCSR *)(m_DSMVirt  + DSM_STATUS_TEST_COMPLETE);
-
 	// Start the test
 	CSR_WRITE32(this, CSR_CTL, 3);
+}
+
+// Returns 1 once the running transaction has completed, and rearms the status
+char iFPGA::pollTransaction()
+{
+	volatile bt32bitCSR *StatusAddr = (volatile bt32bitCSR *)(m_DSMVirt  + DSM_STATUS_TEST_COMPLETE);
+	if (0 == *StatusAddr)
+		return 0;
+	*StatusAddr = 0;
+	return 1;
+}
+
+static double thread_cpu_time() {
+	struct timespec t;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
 
-	// Wait for test completion
-	while( 0 == *StatusAddr ) {
-		SleepNano(100);
+static uint32_t histogram_bucket(double seconds) {
+	uint64_t nanos = (uint64_t)(seconds*1e9);
+	uint32_t bucket = 0;
+	while (nanos > 1 && bucket < WAIT_HISTOGRAM_BUCKETS-1) {
+		nanos >>= 1;
+		bucket++;
 	}
+	return bucket;
+}
 
-	*StatusAddr = 0;
+uint64_t iFPGA::submitTransaction()
+{
+	if (jobsCompleted < jobsSubmitted)
+		waitTransaction(jobsSubmitted);
+	startTransaction();
+	lastPollTime = get_time();
+	return ++jobsSubmitted;
+}
+
+char iFPGA::testTransaction(uint64_t job)
+{
+	if (job <= jobsCompleted)
+		return 1;
+	numPolls++;
+	double now = get_time();
+	if (pollTransaction() == 0) {
+		lastPollTime = now;
+		return 0;
+	}
+	detectionHistogram[histogram_bucket(now - lastPollTime)]++;
+	jobsCompleted = jobsSubmitted;
+	return 1;
+}
+
+void iFPGA::waitIdle()
+{
+	waitTransaction(jobsSubmitted);
+}
+
+void iFPGA::waitTransaction(uint64_t job)
+{
+	if (job <= jobsCompleted)
+		return;
+	double wallStart = get_time();
+	double cpuStart = thread_cpu_time();
+	uint32_t polls = 0;
+	while (testTransaction(job) == 0) {
+		if (polls < waitSpinPolls) {
+#if defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause();
+#endif
+		}
+		else if (polls < waitSpinPolls + waitYieldPolls)
+			sched_yield();
+		else
+			SleepNano(waitSleepNanos);
+		polls++;
+	}
+	double cpu = thread_cpu_time() - cpuStart;
+	waitCPUHistogram[histogram_bucket(cpu)]++;
+	waitCPUTime += cpu;
+	waitWallTime += get_time() - wallStart;
+	numWaits++;
+}
+
+void iFPGA::setWaitPolicy(uint32_t spinPolls, uint32_t yieldPolls, uint32_t sleepNanos)
+{
+	waitSpinPolls = spinPolls;
+	waitYieldPolls = yieldPolls;
+	waitSleepNanos = sleepNanos;
+}
+
+void iFPGA::resetWaitStatistics()
+{
+	for (uint32_t i = 0; i < WAIT_HISTOGRAM_BUCKETS; i++) {
+		detectionHistogram[i] = 0;
+		waitCPUHistogram[i] = 0;
+	}
+	numPolls = 0;
+	numWaits = 0;
+	waitCPUTime = 0;
+	waitWallTime = 0;
+}
+
+void iFPGA::printWaitStatistics()
+{
+	printf("Jobs: %lu, waits: %lu, polls: %lu, wait time: %f s, of which CPU: %f s\n", (unsigned long)jobsCompleted, (unsigned long)numWaits, (unsigned long)numPolls, waitWallTime, waitCPUTime);
+	printf("ns <=\tdetection\twait CPU\n");
+	for (uint32_t i = 0; i < WAIT_HISTOGRAM_BUCKETS; i++) {
+		if (detectionHistogram[i] != 0 || waitCPUHistogram[i] != 0)
+			printf("%lu\t%lu\t%lu\n", (unsigned long)(2ul << i) - 1, (unsigned long)detectionHistogram[i], (unsigned long)waitCPUHistogram[i]);
+	}
+}
+
+uint32_t iFPGA::getPageCount() {
+	return page_count;
+}
+
+uint32_t iFPGA::getPageSizeInCacheLines() {
+	return page_size_in_cache_lines;
+}
+
+// Resets the device, then writes the source and destination page tables
+// for all page_count pages
+void iFPGA::programPageTables() {
+	CSR_WRITE32(this, CSR_CTL, 0);
+	CSR_WRITE32(this, CSR_CTL, 1);
+	CSR_WRITE32(this, CSR_ADDR_RESET, 0);
+
+	// Source pages
+	CSR_WRITE32(this, CSR_SRC_ADDR, 0);
+	CSR_WRITE32(this, CSR_ADDR_RESET, 1);
+	for(uint32_t i = 0; i < page_count; i++) {
+		CSR_WRITE32(this, CSR_SRC_ADDR, CACHELINE_ALIGNED_ADDR(m_InputPhys[i]));
+	}
+	CSR_WRITE32(this, CSR_SRC_ADDR, 0);
+
+	// Destination pages
+	CSR_WRITE32(this, CSR_DST_ADDR, 0);
+	CSR_WRITE32(this, CSR_ADDR_RESET, 2);
+	for(uint32_t i = 0; i < page_count; i++) {
+		CSR_WRITE32(this, CSR_DST_ADDR, CACHELINE_ALIGNED_ADDR(m_OutputPhys[i]));
+	}
+	CSR_WRITE32(this, CSR_DST_ADDR, 0);
+
+	CSR_WRITE32(this, CSR_ADDR_RESET, 0xFFFFFFFF);
+}
+
+uint32_t iFPGA::growWorkspace(uint32_t _page_count) {
+	if (_page_count > MAX_page_count)
+		_page_count = MAX_page_count;
+	if (_page_count <= page_count)
+		return page_count;
+
+	uint32_t i;
+	for(i = page_count; i < _page_count; i++) {
+#if defined(SWAFU)
+		m_InputVirt[i] = m_AFUService->WorkspaceAllocate(CL(page_size_in_cache_lines), &m_InputPhys[i]);
+		m_OutputVirt[i] = m_AFUService->WorkspaceAllocate(CL(page_size_in_cache_lines), &m_OutputPhys[i]);
+		if (m_InputVirt[i] == NULL || m_OutputVirt[i] == NULL) {
+			m_AFUService->WorkspaceFree(m_InputVirt[i]);
+			m_AFUService->WorkspaceFree(m_OutputVirt[i]);
+			break;
+		}
+#elif defined(HARPv1)
+		btInt result = m_Result;
+		m_AFUService->WorkspaceAllocate(CL(page_size_in_cache_lines), TransactionID(i+1));
+		m_Sem.Wait();
+		m_AFUService->WorkspaceAllocate(CL(page_size_in_cache_lines), TransactionID(MAX_page_count+i+1));
+		m_Sem.Wait();
+		if (m_Result != result) {
+			m_Result = result;
+			if (m_InputVirt[i] != NULL) {
+				m_AFUService->WorkspaceFree(m_InputVirt[i], TransactionID(i+1));
+				m_Sem.Wait();
+			}
+			if (m_OutputVirt[i] != NULL) {
+				m_AFUService->WorkspaceFree(m_OutputVirt[i], TransactionID(MAX_page_count+i+1));
+				m_Sem.Wait();
+			}
+			break;
+		}
+		memset((void*)m_OutputVirt[i], 0, CL(page_size_in_cache_lines));
+#else
+		if( ali_errnumOK != m_pALIBufferService->bufferAllocate(CL(page_size_in_cache_lines), &m_InputVirt[i]) )
+			break;
+		if( ali_errnumOK != m_pALIBufferService->bufferAllocate(CL(page_size_in_cache_lines), &m_OutputVirt[i]) ) {
+			m_pALIBufferService->bufferFree(m_InputVirt[i]);
+			break;
+		}
+		m_InputPhys[i] = m_pALIBufferService->bufferGetIOVA(m_InputVirt[i]);
+		m_OutputPhys[i] = m_pALIBufferService->bufferGetIOVA(m_OutputVirt[i]);
+		memset((void*)m_OutputVirt[i], 0, CL(page_size_in_cache_lines));
+#endif
+		m_InputSize[i] = CL(page_size_in_cache_lines);
+		m_OutputSize[i] = CL(page_size_in_cache_lines);
+	}
+	if (i < _page_count)
+		ERR("Workspace could only grow to " << i << " of " << _page_count << " pages");
+
+	if (i > page_count) {
+		page_count = i;
+		programPageTables();
+	}
+	return page_count;
 }
 
 char iFPGA::allocateWorkspace() {
+#if defined(SWAFU)
+	MSG("Allocating emulated AFU");
+	m_AFUService = new AFUEmulator(page_size_in_cache_lines, 0);
+
+	m_DSMVirt = m_AFUService->WorkspaceAllocate(DSM_SIZE, &m_DSMPhys);
+	m_DSMSize = DSM_SIZE;
+	for(uint32_t i = 0; i < page_count; i++) { // Input
+		m_InputVirt[i] = m_AFUService->WorkspaceAllocate(CL(page_size_in_cache_lines), &m_InputPhys[i]);
+		m_InputSize[i] = CL(page_size_in_cache_lines);
+	}
+	for(uint32_t i = 0; i < page_count; i++) { // Output
+		m_OutputVirt[i] = m_AFUService->WorkspaceAllocate(CL(page_size_in_cache_lines), &m_OutputPhys[i]);
+		m_OutputSize[i] = CL(page_size_in_cache_lines);
+	}
+	if (m_DSMVirt == NULL)
+		return -1;
+
+	// Same page table programming as on HARPv1
+	m_AFUService->CSRWrite64(CSR_AFU_DSM_BASEL, m_DSMPhys);
+	programPageTables();
+	m_AFUService->CSRWrite(CSR_CFG, 0);
+	return 0;
+#else
 	// Request our AFU.
 
 	// NOTE: This example is bypassing the Resource Manager's configuration record lookup
@@ -462,7 +729,7 @@ char iFPGA::allocateWorkspace() {
 	}
 	for(uint32_t i = 0; i < page_count; i++) // Output
 	{
-		m_AFUService->WorkspaceAllocate(CL(page_size_in_cache_lines), TransactionID(page_count+i+1));
+		m_AFUService->WorkspaceAllocate(CL(page_size_in_cache_lines), TransactionID(MAX_page_count+i+1));
 		m_Sem.Wait();
 	}
 
@@ -485,35 +752,8 @@ char iFPGA::allocateWorkspace() {
 		SleepSec(5);
 #endif /* ASE AFU */
 
-		// Assert Device Reset
-		m_AFUService->CSRWrite(CSR_CTL, 0);
-
-		// De-assert Device Reset
-		m_AFUService->CSRWrite(CSR_CTL, 1);
-
-		m_AFUService->CSRWrite(CSR_ADDR_RESET, 0);
-
-		// Source pages
-		m_AFUService->CSRWrite(CSR_SRC_ADDR, 0);
-		m_AFUService->CSRWrite(CSR_ADDR_RESET, 1);
-		for(uint32_t i = 0; i < page_count; i++)
-		{
-		// Set input workspace address
-			m_AFUService->CSRWrite(CSR_SRC_ADDR, CACHELINE_ALIGNED_ADDR(m_InputPhys[i]));
-		}
-		m_AFUService->CSRWrite(CSR_SRC_ADDR, 0);
-
-		// Destination pages
-		m_AFUService->CSRWrite(CSR_DST_ADDR, 0);
-		m_AFUService->CSRWrite(CSR_ADDR_RESET, 2);
-		for(uint32_t i = 0; i < page_count; i++)
-		{
-		// Set output workspace address
-			m_AFUService->CSRWrite(CSR_DST_ADDR, CACHELINE_ALIGNED_ADDR(m_OutputPhys[i]));
-		}
-		m_AFUService->CSRWrite(CSR_DST_ADDR, 0);
-
-		m_AFUService->CSRWrite(CSR_ADDR_RESET, 0xFFFFFFFF);
+		// Reset the device and populate the page tables
+		programPageTables();
 
 		// Set the test mode
 		m_AFUService->CSRWrite(CSR_CFG, 0);
@@ -705,8 +945,10 @@ char iFPGA::allocateWorkspace() {
 	}
 	return 0;
 #endif
+#endif // SWAFU
 }
 
+#ifndef SWAFU
 // We must implement the IServiceClient interface (IServiceClient.h):
 // <begin IServiceClient interface>
 void iFPGA::serviceAllocated(IBase *pServiceBase, TransactionID const &rTranID) {
@@ -820,7 +1062,7 @@ void iFPGA::OnWorkspaceAllocated(TransactionID const &TranID, btVirtAddr WkspcVi
 		printf("DSM Virt:%p, Phys:%lu, Size:%llu\n", m_DSMVirt, m_DSMPhys, m_DSMSize);
 		m_Sem.Post(1);
 	}
-	else if(TranID.ID() >= 1 && TranID.ID() <= (int)page_count)
+	else if(TranID.ID() >= 1 && TranID.ID() <= (int)MAX_page_count)
 	{
 		int index = TranID.ID()-1;
 		m_InputVirt[index] = WkspcVirt;
@@ -830,9 +1072,9 @@ void iFPGA::OnWorkspaceAllocated(TransactionID const &TranID, btVirtAddr WkspcVi
 		//printf("Input Virt:%x, Phys:%x, Size:%d\n", m_InputVirt[index], m_InputPhys[index], m_InputSize[index]);
 		m_Sem.Post(1);
 	}
-	else if(TranID.ID() >= (int)page_count+1 && TranID.ID() <= 2*(int)page_count)
+	else if(TranID.ID() >= (int)MAX_page_count+1 && TranID.ID() <= 2*(int)MAX_page_count)
 	{
-		int index = TranID.ID()-(page_count+1);
+		int index = TranID.ID()-(MAX_page_count+1);
 		m_OutputVirt[index] = WkspcVirt;
 		m_OutputPhys[index] = WkspcPhys;
 		m_OutputSize[index] = WkspcSize;
@@ -869,4 +1111,5 @@ void iFPGA::OnWorkspaceFreeFailed(const IEvent &rEvent) {
 	m_Sem.Post(1);
 }
 // </ICCIClient>
-#endif
\ No newline at end of file
+#endif
+#endif // SWAFU
\ No newline at end of file
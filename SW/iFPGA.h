@@ -46,6 +46,8 @@
 #endif // MB
 
 #define DSM_SIZE					MB(0.2)
+#define MAX_page_count				2048 // Page table entries per direction on the AFU
+#define WAIT_HISTOGRAM_BUCKETS		40 // Powers of two of nanoseconds
 #ifdef HARPv1
 	#define CSR_AFU_DSM_BASEH			0x1a04
 	#define CSR_SRC_ADDR				0x1a20
@@ -103,7 +105,9 @@ static uint64_t ipow(uint64_t base, uint64_t exponent)
 	return result;
 }
 
-#ifdef HARPv1
+#if defined(SWAFU)
+class iFPGA {
+#elif defined(HARPv1)
 class iFPGA: public CAASBase, public IServiceClient, public ICCIClient {
 #else
 class iFPGA: public CAASBase, public IServiceClient {
@@ -122,9 +126,48 @@ public:
 	void writeToMemoryFloat(char inOrOut, float dat, uint32_t address);
 	float readFromMemoryFloat(char inOrOut, uint32_t address);
 
-	void doTransaction();
+	// Bulk access, addresses and sizes in 32-bit words. getSpan returns how many
+	// words are contiguous at *span (0 if unmapped); the copies return how many
+	// words were copied and split page ranges over numThreads threads. Like the
+	// addresses, sizes are limited to 32 bits of words (16 GiB): callers reject
+	// anything larger rather than have it truncated.
+	uint32_t getSpan(char inOrOut, uint32_t address32, uint32_t** span);
+	uint32_t writeToMemory(char inOrOut, const void* src, uint32_t address32, uint32_t numWords, uint32_t numThreads = 1);
+	uint32_t readFromMemory(char inOrOut, void* dst, uint32_t address32, uint32_t numWords, uint32_t numThreads = 1);
+
+	// Workspace geometry. growWorkspace adds pages (up to MAX_page_count) to both
+	// the input and the output workspace, keeping what is already in them, and
+	// reprograms the page tables. Returns the page count reached.
+	uint32_t getPageCount();
+	uint32_t getPageSizeInCacheLines();
+	uint32_t growWorkspace(uint32_t _page_count);
 
-#ifdef HARPv1
+	void doTransaction();
+	// Non-blocking variant of doTransaction: start, then poll until it returns 1
+	void startTransaction();
+	char pollTransaction();
+
+	// Asynchronous jobs. submitTransaction starts a job and returns its handle;
+	// completion is checked with testTransaction or awaited with waitTransaction,
+	// which polls spinPolls times, then yields for yieldPolls polls, then sleeps
+	// sleepNanos between polls. A running job reads its CSRs and the workspace
+	// live, so nothing may change them (or grow the workspace) before it is
+	// over: waitIdle waits for the outstanding job, if any. submitTransaction
+	// waits too, but only after the caller has already configured the next job.
+	uint64_t submitTransaction();
+	char testTransaction(uint64_t job);
+	void waitTransaction(uint64_t job);
+	void waitIdle();
+	void setWaitPolicy(uint32_t spinPolls, uint32_t yieldPolls, uint32_t sleepNanos);
+	// Histograms (powers of two of nanoseconds) of how late completion was
+	// detected, bounded by the time since the previous poll, and of the thread
+	// CPU time spent per wait
+	void printWaitStatistics();
+	void resetWaitStatistics();
+
+#if defined(SWAFU)
+	AFUEmulator   *m_AFUService;
+#elif defined(HARPv1)
 	ICCIAFU       *m_AFUService;
 #else
 	IALIMMIO      *m_pALIMMIOService;   ///< Pointer to MMIO Service
@@ -133,10 +176,29 @@ public:
 private:
 	uint32_t page_size_in_cache_lines;
 	uint32_t page_count;
-
+	uint32_t page_shift32;	// log2 of the page size in 32-bit words
+	uint32_t page_mask32;
+
+	uint64_t jobsSubmitted;
+	uint64_t jobsCompleted;
+	uint32_t waitSpinPolls;
+	uint32_t waitYieldPolls;
+	uint32_t waitSleepNanos;
+	double lastPollTime;
+	uint64_t detectionHistogram[WAIT_HISTOGRAM_BUCKETS];
+	uint64_t waitCPUHistogram[WAIT_HISTOGRAM_BUCKETS];
+	uint64_t numPolls;
+	uint64_t numWaits;
+	double waitCPUTime;
+	double waitWallTime;
+
+	uint32_t bulkCopy(char inOrOut, char toWorkspace, uint32_t* host, uint32_t address32, uint32_t numWords, uint32_t numThreads);
+
+	void programPageTables();
 	char allocateWorkspace();
 	char allocateSuccess;
 
+#ifndef SWAFU
 #ifdef HARPv1
 	// <ICCIClient>
 	virtual void OnWorkspaceAllocated(TransactionID const &TranID, btVirtAddr WkspcVirt, btPhysAddr WkspcPhys, btWSSize WkspcSize);
@@ -159,13 +221,16 @@ private:
 	void serviceEvent(const IEvent &rEvent);
 
 	IBase         *m_pAALService;    // The generic AAL Service interface for the AFU.
+#endif // SWAFU
 	RuntimeClient *m_runtimeClient;
 	
-#ifndef HARPv1
+#if !defined(HARPv1) && !defined(SWAFU)
 	IALIBuffer    *m_pALIBufferService; ///< Pointer to Buffer Service
 	IALIReset     *m_pALIResetService;  ///< Pointer to AFU Reset Service
 #endif
+#ifndef SWAFU
 	CSemaphore     m_Sem;            // For synchronizing with the AAL runtime.
+#endif
 	btInt          m_Result;         // Returned result value; 0 if success
 
 	// Workspace info
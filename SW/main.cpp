@@ -19,6 +19,8 @@
 #include <pthread.h>
 
 #include "zipml_sgd.h"
+#include "model_server.h"
+#include "sgd_sweep.h"
 
 using namespace std;
 
@@ -65,12 +67,41 @@ int main(int argc, char* argv[]) {
 	app.log_history('s', 0, quantizationBits, 1.0/(1 << stepSizeShifter), numEpochs, end-start, x_history1);
 
 /*
+	// Same, logging the progressive training loss computed during the epochs
+	float loss_history1[numEpochs];
+	start = get_time();
+	app.float_linreg_SGD( x_history1, numEpochs, 1.0/(1 << stepSizeShifter), loss_history1 );
+	end = get_time();
+	app.log_history('s', 0, quantizationBits, 1.0/(1 << stepSizeShifter), numEpochs, end-start, x_history1, loss_history1);
+
+	// Hogwild! linear regression in SW, scaling over thread counts
+	uint32_t numCores = sysconf(_SC_NPROCESSORS_ONLN);
+	for (uint32_t numThreads = 1; numThreads <= numCores; numThreads = (numThreads*2 > numCores && numThreads < numCores) ? numCores : numThreads*2) {
+		start = get_time();
+		app.float_linreg_SGD_hogwild( x_history1, numEpochs, 1.0/(1 << stepSizeShifter), numThreads, 0 );
+		end = get_time();
+		app.log_history('s', 0, quantizationBits, 1.0/(1 << stepSizeShifter), numEpochs, end-start, x_history1);
+	}
+
+	// Mini-batch linear regression in SW, batches of 64 split over all cores
+	start = get_time();
+	app.float_linreg_SGD_minibatch( x_history1, numEpochs, 1.0/(1 << stepSizeShifter), 64, 0 );
+	end = get_time();
+	app.log_history('s', 0, quantizationBits, 1.0/(1 << stepSizeShifter), numEpochs, end-start, x_history1);
+
 	// Quantized linear regression in SW
 	float x_history2[numEpochs*app.numFeatures];
 	start = get_time();
 	app.Qfixed_linreg_SGD( x_history2, numEpochs, stepSizeShifter, quantizationBits );
 	end = get_time();
 	app.log_history('s', 0, quantizationBits, 1.0/(1 << stepSizeShifter), numEpochs, end-start, x_history2);
+
+	// Quantized linear regression in SW, on the packed FPGA layout
+	float x_history3[numEpochs*app.numFeatures];
+	start = get_time();
+	app.Qpacked_linreg_SGD( x_history3, numEpochs, stepSizeShifter, quantizationBits, numberOfIndices );
+	end = get_time();
+	app.log_history('s', 0, quantizationBits, 1.0/(1 << stepSizeShifter), numEpochs, end-start, x_history3);
 */
 
 	// Full precision linear regression on FPGA
@@ -89,6 +120,54 @@ int main(int argc, char* argv[]) {
 	app.qFSGD( x2, numEpochs, stepSizeShifter, quantizationBits, 0, 0.0);
 	end = get_time();
 	app.log_history('h', 0, quantizationBits, 1.0/(1 << stepSizeShifter), numEpochs, end-start, NULL);
+
+	// Quantized linear regression on FPGA, indices regenerated in a ring of 3 while training
+	start = get_time();
+	app.qFSGD_ring( x2, numEpochs, stepSizeShifter, quantizationBits, 0, 0.0, 3);
+	end = get_time();
+	app.log_history('h', 0, quantizationBits, 1.0/(1 << stepSizeShifter), numEpochs, end-start, NULL);
+*/
+/*
+	// Out-of-core linear regression on FPGA, streaming chunks of 50000 samples
+	start = get_time();
+	app.qFSGD_chunked( x2, numEpochs, stepSizeShifter, quantizationBits, 50000);
+	end = get_time();
+	app.log_history('h', 0, quantizationBits, 1.0/(1 << stepSizeShifter), numEpochs, end-start, NULL);
+*/
+/*
+	// Load, normalize, quantize and pack a raw dataset in one pipelined pass
+	app.numCacheLines = app.ingest_raw_data(pathToDataset, 10, 2048, 'c', 0, 1, 0, quantizationBits, numberOfIndices, 'd');
+	start = get_time();
+	app.qFSGD( x2, numEpochs, stepSizeShifter, quantizationBits, 0, 0.0);
+	end = get_time();
+	app.log_history('h', 0, quantizationBits, 1.0/(1 << stepSizeShifter), numEpochs, end-start, NULL);
+*/
+/*
+	// Write the dataset once in the FPGA layout, then map it straight into the workspace
+	int widths[4] = {1, 2, 4, 8};
+	app.save_fpga_dataset((char*)"./dataset.zml", widths, 4, numberOfIndices);
+	app.numCacheLines = app.load_fpga_dataset((char*)"./dataset.zml", quantizationBits);
+*/
+/*
+	// Sweep step sizes and widths (0: float) in SW on 5 folds of the loaded data,
+	// pruning runs whose loss grows past 10x that of the zero model
+	sgd_sweep sweep(&app);
+	int stepSizeShifters[4] = {6, 8, 9, 12};
+	int widths[4] = {0, 2, 4, 8};
+	sweep.add_grid(stepSizeShifters, 4, widths, 4, 10);
+	sweep.run(5, 0, 10.0);
+	sweep.print_summary(0.01);
+	sweep.write_summary((char*)"./sweep.csv");
+*/
+/*
+	// Sparse linear regression in SW, training on the nonzeros only
+	app.load_libsvm_data_sparse(pathToDataset, 0, 0);
+	float x_history4[numEpochs*app.numFeatures];
+	start = get_time();
+	app.float_linreg_SGD_sparse( x_history4, numEpochs, 1.0/(1 << stepSizeShifter), 1e-4 );
+	end = get_time();
+	app.log_history('s', 0, quantizationBits, 1.0/(1 << stepSizeShifter), numEpochs, end-start, x_history4);
+	app.sparse_to_dense(); // For normalization and the FPGA layouts
 */
 /*
 	// Multi-class training for MNIST
@@ -99,19 +178,33 @@ int main(int argc, char* argv[]) {
 	float* xs[10];
 
 	app.numCacheLines = app.copy_data_into_FPGA_memory_after_quantization(quantizationBits, numberOfIndices, 0);
-	start = get_time();
 	for (int digit = 0; digit < 10; digit++) {
 		xs[digit] = (float*)malloc(app.numFeatures*sizeof(float));
-		app.qFSGD( xs[digit], numEpochs, stepSizeShifter, quantizationBits, 1, digit*value_to_integer_scaler);
 	}
-	end = get_time();
-	cout << "Total training time: " << end-start << endl;
+	double digitTimes[10];
+	double total = app.qFSGD_multiclass(xs, 10, NULL, numEpochs, stepSizeShifter, quantizationBits, digitTimes);
+	cout << "Total training time: " << total << endl;
 
 	app.load_libsvm_data((char*)"./Datasets/mnist.t", 10000, 780);
 
 	app.a_normalize(0, 'r');
 
 	app.multi_classification(xs, 10);
+	app.multi_classification(xs, 10, 1); // int8 models and samples
+
+	// Serve the digit models: in-process, and to other processes on a Unix socket
+	app.save_models((char*)"./mnist.models", xs, 10);
+	model_server server;
+	server.load_models((char*)"./mnist.models");
+	server.start(2, 64, 50e-6);
+	server.serve_unix_socket((char*)"/tmp/zipml.sock");
+	int predictions[16];
+	float scores[16];
+	for (uint32_t i = 0; i + 16 <= app.numSamples; i += 16) {
+		server.predict(app.a + i*app.numFeatures, 16, predictions, scores);
+	}
+	server.print_statistics();
+	server.stop();
 
 	for (int digit = 0; digit < 10; digit++) {
 		free(xs[digit]);
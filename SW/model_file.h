@@ -0,0 +1,41 @@
+// Copyright (C) 2017 Kaan Kara - Systems Group, ETH Zurich
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//*************************************************************************
+
+#ifndef MODEL_FILE
+#define MODEL_FILE
+
+#include <stdint.h>
+
+// Trained models exported for serving (zipml_sgd::save_models, model_server):
+// model_file_header, then numClasses models of numFeatures floats each. With a
+// single model the output is a regression value, rescaled with b_range/b_min
+// as zipml_sgd::inference does; otherwise the best class is predicted.
+
+#define MODEL_FILE_MAGIC	0x4C444F4D // "MODL"
+#define MODEL_FILE_VERSION	1
+
+struct model_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t numClasses;
+	uint32_t numFeatures;
+	uint8_t b_normalizedToMinus1_1;
+	uint8_t reserved[3];
+	float b_range;
+	float b_min;
+};
+
+#endif
@@ -0,0 +1,655 @@
+// Copyright (C) 2017 Kaan Kara - Systems Group, ETH Zurich
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//*************************************************************************
+
+#ifndef MODEL_SERVER
+#define MODEL_SERVER
+
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "sgd_kernels.h"
+#include "model_file.h"
+
+using namespace std;
+
+// Serves models exported with zipml_sgd::save_models. Requests (one sample or
+// a micro-batch) are queued; worker threads take everything queued, up to
+// maxBatchSamples, once that many samples are waiting or the oldest request
+// has waited maxBatchDelay seconds, and score the batch with block_kernels.
+// predict() is the in-process API; serve_unix_socket() accepts the same
+// requests from other processes (see model_client_predict).
+//
+// Socket protocol, all values in host byte order: on connect the server sends
+// numFeatures and numClasses (uint32_t each). A request is a uint32_t count
+// followed by count*numFeatures floats, 0 < count <= SERVE_MAX_REQUEST_SAMPLES;
+// the reply is count int32_t predictions followed by count float scores. Any
+// other count closes the connection.
+
+#define SERVE_LATENCY_SAMPLES	65536	// Latencies kept for the percentiles
+#define SERVE_MAX_CONNECTIONS	64
+#define SERVE_MAX_REQUEST_SAMPLES	65536	// Per socket request
+
+static double serve_time() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+static char serve_read(int fd, void* buffer, uint64_t size) {
+	char* p = (char*)buffer;
+	while (size > 0) {
+		ssize_t r = read(fd, p, size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return 0;
+		p += r;
+		size -= r;
+	}
+	return 1;
+}
+
+static char serve_write(int fd, const void* buffer, uint64_t size) {
+	const char* p = (const char*)buffer;
+	while (size > 0) {
+		ssize_t r = send(fd, p, size, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return 0;
+		p += r;
+		size -= r;
+	}
+	return 1;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+struct serve_request {
+	const float* samples;	// count*numFeatures
+	uint32_t count;
+	int* predictions;		// count
+	float* scores;			// count
+	double submitTime;
+	char done;
+	serve_request* next;
+};
+
+class model_server;
+
+struct serve_connection_args {
+	model_server* server;
+	int fd;
+};
+
+class model_server {
+private:
+	float* w;				// numModels x ldw, padded with zeros
+	uint32_t numModels;
+	uint32_t ldw;
+	uint8_t b_normalizedToMinus1_1;
+	float b_range;
+	float b_min;
+
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t completed;
+	serve_request* head;
+	serve_request* tail;
+	uint32_t queuedSamples;
+	char stopping;
+	pthread_t* workers;
+	uint32_t numWorkers;
+
+	int listenFd;
+	char* socketPath;
+	pthread_t listener;
+	int connections[SERVE_MAX_CONNECTIONS];
+	uint32_t numConnections;
+	pthread_cond_t disconnected;
+
+	double* latencies;		// Ring of the last SERVE_LATENCY_SAMPLES request latencies
+	uint64_t numRequests;
+	uint64_t numSamplesServed;
+	uint64_t numBatches;
+	double firstSubmitTime;
+	double lastCompletionTime;
+
+	void score(const float* samples, uint32_t count, int predictions[], float scores[]);
+	serve_request* take_batch();
+	void complete_batch(serve_request* batch, double now);
+
+	static void* worker_main(void* arg);
+	static void* listener_main(void* arg);
+	static void* connection_main(void* arg);
+
+public:
+	uint32_t numClasses;
+	uint32_t numFeatures;
+	uint32_t maxBatchSamples;
+	double maxBatchDelay;
+
+	model_server() {
+		w = NULL;
+		numModels = 0;
+		ldw = 0;
+		numClasses = 0;
+		numFeatures = 0;
+		pthread_mutex_init(&lock, NULL);
+		pthread_cond_init(&queued, NULL);
+		pthread_cond_init(&completed, NULL);
+		pthread_cond_init(&disconnected, NULL);
+		head = NULL;
+		tail = NULL;
+		queuedSamples = 0;
+		stopping = 0;
+		workers = NULL;
+		numWorkers = 0;
+		listenFd = -1;
+		socketPath = NULL;
+		numConnections = 0;
+		latencies = (double*)malloc(SERVE_LATENCY_SAMPLES*sizeof(double));
+		reset_statistics();
+	}
+
+	~model_server() {
+		stop();
+		if (w != NULL)
+			free(w);
+		free(latencies);
+		pthread_mutex_destroy(&lock);
+		pthread_cond_destroy(&queued);
+		pthread_cond_destroy(&completed);
+		pthread_cond_destroy(&disconnected);
+	}
+
+	// Returns 0 on success
+	char load_models(char* pathToFile);
+	// Starts numWorkers batching threads. Before start, predict scores inline
+	void start(uint32_t _numWorkers, uint32_t _maxBatchSamples, double _maxBatchDelay);
+	// Stops the socket and the workers, after the queued requests are served
+	void stop();
+
+	// Scores count samples: predictions[count] get the best class (-1 if no
+	// score is positive, as multi_classification) or, for a single model, the
+	// rounded regression value; scores[count] the best score or the value
+	void predict(const float* samples, uint32_t count, int predictions[], float scores[]);
+
+	// Returns 0 once the socket is listening
+	char serve_unix_socket(char* path);
+
+	void print_statistics();
+	void reset_statistics();
+};
+
+char model_server::load_models(char* pathToFile) {
+	FILE* f = fopen(pathToFile, "rb");
+	if (f == NULL) {
+		cout << "Could not open " << pathToFile << endl;
+		return -1;
+	}
+	model_file_header header;
+	if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != MODEL_FILE_MAGIC || header.version != MODEL_FILE_VERSION || header.numClasses == 0) {
+		cout << pathToFile << " is not a model file" << endl;
+		fclose(f);
+		return -1;
+	}
+	// The sizes come from the file: they must describe exactly its models
+	struct stat st;
+	uint64_t modelBytes = (uint64_t)header.numClasses*header.numFeatures*sizeof(float);
+	if (header.numFeatures == 0 || fstat(fileno(f), &st) != 0 || (uint64_t)st.st_size != sizeof(header) + modelBytes) {
+		cout << pathToFile << " does not hold " << header.numClasses << " models of " << header.numFeatures << " features" << endl;
+		fclose(f);
+		return -1;
+	}
+	numClasses = header.numClasses;
+	numFeatures = header.numFeatures;
+	b_normalizedToMinus1_1 = header.b_normalizedToMinus1_1;
+	b_range = header.b_range;
+	b_min = header.b_min;
+
+	// Contiguous models, padded to a multiple of 4 and to whole cache lines
+	numModels = (numClasses + 3)/4*4;
+	ldw = (numFeatures + 15)/16*16;
+	if (w != NULL)
+		free(w);
+	w = (float*)calloc((uint64_t)numModels*ldw, sizeof(float));
+	char success = 1;
+	for (uint32_t c = 0; c < numClasses; c++) {
+		success &= (fread(w + (uint64_t)c*ldw, sizeof(float), numFeatures, f) == numFeatures);
+	}
+	fclose(f);
+	if (!success) {
+		cout << "Read from " << pathToFile << " failed" << endl;
+		return -1;
+	}
+	cout << "Loaded " << numClasses << " models, numFeatures: " << numFeatures << ", kernels: " << get_block_kernels().name << endl;
+	return 0;
+}
+
+void model_server::score(const float* samples, uint32_t count, int predictions[], float scores[]) {
+	const block_kernels& kernels = get_block_kernels();
+	for (uint32_t r = 0; r < count; r += 2) {
+		uint32_t rows = (r+1 < count) ? 2 : 1;
+		const float* a = samples + (uint64_t)r*numFeatures;
+		float max[2] = {0.0, 0.0};
+		int matched_class[2] = {-1, -1};
+		for (uint32_t m = 0; m < numModels; m += 4) {
+			float dots[8];
+			kernels.dot(a, (rows == 2) ? numFeatures : 0, w + (uint64_t)m*ldw, ldw, numFeatures, dots);
+			for (uint32_t k = 0; k < rows; k++) {
+				for (uint32_t l = 0; l < 4 && m+l < numClasses; l++) {
+					if (numClasses == 1)
+						max[k] = dots[k*4];
+					else if (dots[k*4 + l] > max[k]) {
+						max[k] = dots[k*4 + l];
+						matched_class[k] = m+l;
+					}
+				}
+			}
+		}
+		for (uint32_t k = 0; k < rows; k++) {
+			float value = max[k];
+			if (numClasses == 1) {
+				if (b_normalizedToMinus1_1 == 0)
+					value = value*b_range + b_min;
+				else if (b_normalizedToMinus1_1 == 1)
+					value = (value+1.0)*(b_range/2.0) + b_min;
+				matched_class[k] = (int)(value+0.5);
+			}
+			predictions[r+k] = matched_class[k];
+			scores[r+k] = value;
+		}
+	}
+}
+
+void model_server::start(uint32_t _numWorkers, uint32_t _maxBatchSamples, double _maxBatchDelay) {
+	if (workers != NULL)
+		return;
+	numWorkers = (_numWorkers == 0) ? 1 : _numWorkers;
+	maxBatchSamples = (_maxBatchSamples == 0) ? 1 : _maxBatchSamples;
+	maxBatchDelay = _maxBatchDelay;
+	stopping = 0;
+	workers = (pthread_t*)malloc(numWorkers*sizeof(pthread_t));
+	for (uint32_t t = 0; t < numWorkers; t++) {
+		pthread_create(&workers[t], NULL, worker_main, this);
+	}
+	cout << "Serving with " << numWorkers << " workers, batches of up to " << maxBatchSamples << " samples or " << maxBatchDelay*1e6 << " us" << endl;
+}
+
+void model_server::stop() {
+	if (listenFd >= 0) {
+		shutdown(listenFd, SHUT_RDWR);
+		pthread_join(listener, NULL);
+		close(listenFd);
+		listenFd = -1;
+		unlink(socketPath);
+		free(socketPath);
+		socketPath = NULL;
+
+		pthread_mutex_lock(&lock);
+		for (uint32_t c = 0; c < numConnections; c++)
+			shutdown(connections[c], SHUT_RDWR);
+		while (numConnections > 0)
+			pthread_cond_wait(&disconnected, &lock);
+		pthread_mutex_unlock(&lock);
+	}
+	if (workers != NULL) {
+		pthread_mutex_lock(&lock);
+		stopping = 1;
+		pthread_cond_broadcast(&queued);
+		pthread_mutex_unlock(&lock);
+		for (uint32_t t = 0; t < numWorkers; t++) {
+			pthread_join(workers[t], NULL);
+		}
+		free(workers);
+		workers = NULL;
+		numWorkers = 0;
+	}
+}
+
+// Called with lock held. Waits for a full batch, or for the oldest request to
+// reach maxBatchDelay, and unlinks up to maxBatchSamples samples worth of
+// requests (at least one). Returns NULL once stopping with nothing queued.
+serve_request* model_server::take_batch() {
+	while (head == NULL) {
+		if (stopping == 1)
+			return NULL;
+		pthread_cond_wait(&queued, &lock);
+	}
+	while (queuedSamples < maxBatchSamples && stopping == 0) {
+		double deadline = head->submitTime + maxBatchDelay;
+		double now = serve_time();
+		if (now >= deadline)
+			break;
+		// The condition variable waits on CLOCK_REALTIME, so wait relative to it
+		struct timespec wake;
+		clock_gettime(CLOCK_REALTIME, &wake);
+		double until = wake.tv_sec + wake.tv_nsec*1e-9 + (deadline - now);
+		wake.tv_sec = (time_t)until;
+		wake.tv_nsec = (long)((until - wake.tv_sec)*1e9);
+		pthread_cond_timedwait(&queued, &lock, &wake);
+		if (head == NULL) // Taken by another worker
+			return take_batch();
+	}
+	serve_request* batch = head;
+	serve_request* last = head;
+	uint32_t samples = head->count;
+	while (last->next != NULL && samples + last->next->count <= maxBatchSamples) {
+		last = last->next;
+		samples += last->count;
+	}
+	head = last->next;
+	if (head == NULL)
+		tail = NULL;
+	last->next = NULL;
+	queuedSamples -= samples;
+	return batch;
+}
+
+// Called with lock held
+void model_server::complete_batch(serve_request* batch, double now) {
+	numBatches++;
+	for (serve_request* request = batch; request != NULL; request = request->next) {
+		latencies[numRequests%SERVE_LATENCY_SAMPLES] = now - request->submitTime;
+		numRequests++;
+		numSamplesServed += request->count;
+		if (firstSubmitTime == 0 || request->submitTime < firstSubmitTime)
+			firstSubmitTime = request->submitTime;
+	}
+	lastCompletionTime = now;
+	// done is set last: the waiting threads own their requests again after it
+	serve_request* request = batch;
+	while (request != NULL) {
+		serve_request* next = request->next;
+		request->done = 1;
+		request = next;
+	}
+	pthread_cond_broadcast(&completed);
+}
+
+void* model_server::worker_main(void* arg) {
+	model_server* server = (model_server*)arg;
+	uint32_t capacity = server->maxBatchSamples;
+	float* samples = (float*)malloc((uint64_t)capacity*server->numFeatures*sizeof(float));
+	int* predictions = (int*)malloc(capacity*sizeof(int));
+	float* scores = (float*)malloc(capacity*sizeof(float));
+
+	pthread_mutex_lock(&server->lock);
+	while (1) {
+		serve_request* batch = server->take_batch();
+		if (batch == NULL)
+			break;
+		pthread_mutex_unlock(&server->lock);
+
+		uint32_t count = 0;
+		for (serve_request* request = batch; request != NULL; request = request->next) {
+			if (request->count > capacity) { // Larger than a batch on its own
+				server->score(request->samples, request->count, request->predictions, request->scores);
+				continue;
+			}
+			memcpy(samples + (uint64_t)count*server->numFeatures, request->samples, (uint64_t)request->count*server->numFeatures*sizeof(float));
+			count += request->count;
+		}
+		server->score(samples, count, predictions, scores);
+		count = 0;
+		for (serve_request* request = batch; request != NULL; request = request->next) {
+			if (request->count > capacity)
+				continue;
+			memcpy(request->predictions, predictions + count, request->count*sizeof(int));
+			memcpy(request->scores, scores + count, request->count*sizeof(float));
+			count += request->count;
+		}
+		double now = serve_time();
+
+		pthread_mutex_lock(&server->lock);
+		server->complete_batch(batch, now);
+	}
+	pthread_mutex_unlock(&server->lock);
+
+	free(samples);
+	free(predictions);
+	free(scores);
+	return NULL;
+}
+
+void model_server::predict(const float* samples, uint32_t count, int predictions[], float scores[]) {
+	serve_request request;
+	request.samples = samples;
+	request.count = count;
+	request.predictions = predictions;
+	request.scores = scores;
+	request.submitTime = serve_time();
+	request.done = 0;
+	request.next = NULL;
+
+	pthread_mutex_lock(&lock);
+	if (workers == NULL) {
+		pthread_mutex_unlock(&lock);
+		score(samples, count, predictions, scores);
+		pthread_mutex_lock(&lock);
+		complete_batch(&request, serve_time());
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	if (tail == NULL)
+		head = &request;
+	else
+		tail->next = &request;
+	tail = &request;
+	queuedSamples += count;
+	if (queuedSamples >= maxBatchSamples)
+		pthread_cond_broadcast(&queued);
+	else
+		pthread_cond_signal(&queued);
+	while (request.done == 0)
+		pthread_cond_wait(&completed, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+char model_server::serve_unix_socket(char* path) {
+	struct sockaddr_un address;
+	if (strlen(path) >= sizeof(address.sun_path)) {
+		cout << "Socket path too long: " << path << endl;
+		return -1;
+	}
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0) {
+		cout << "Could not create a socket" << endl;
+		return -1;
+	}
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	// Replace a stale socket, but never anything else
+	struct stat st;
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+	if (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listenFd, SERVE_MAX_CONNECTIONS) != 0) {
+		cout << "Could not listen on " << path << endl;
+		close(listenFd);
+		listenFd = -1;
+		return -1;
+	}
+	socketPath = strdup(path);
+	pthread_create(&listener, NULL, listener_main, this);
+	cout << "Listening on " << path << endl;
+	return 0;
+}
+
+void* model_server::listener_main(void* arg) {
+	model_server* server = (model_server*)arg;
+	while (1) {
+		int fd = accept(server->listenFd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break; // Shut down by stop()
+		}
+		pthread_mutex_lock(&server->lock);
+		if (server->numConnections == SERVE_MAX_CONNECTIONS) {
+			pthread_mutex_unlock(&server->lock);
+			close(fd);
+			continue;
+		}
+		server->connections[server->numConnections++] = fd;
+		pthread_mutex_unlock(&server->lock);
+
+		serve_connection_args* args = (serve_connection_args*)malloc(sizeof(serve_connection_args));
+		args->server = server;
+		args->fd = fd;
+		pthread_t thread;
+		pthread_create(&thread, NULL, connection_main, args);
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+void* model_server::connection_main(void* arg) {
+	serve_connection_args* args = (serve_connection_args*)arg;
+	model_server* server = args->server;
+	int fd = args->fd;
+	free(args);
+
+	uint32_t dimensions[2] = {server->numFeatures, server->numClasses};
+	uint32_t capacity = 0;
+	float* samples = NULL;
+	int* predictions = NULL;
+	float* scores = NULL;
+	uint32_t count;
+	if (serve_write(fd, dimensions, sizeof(dimensions))) {
+		while (serve_read(fd, &count, sizeof(count))) {
+			if (count == 0 || count > SERVE_MAX_REQUEST_SAMPLES)
+				break;
+			if (count > capacity) {
+				float* newSamples = (float*)realloc(samples, (uint64_t)count*server->numFeatures*sizeof(float));
+				if (newSamples != NULL)
+					samples = newSamples;
+				int* newPredictions = (int*)realloc(predictions, count*sizeof(int));
+				if (newPredictions != NULL)
+					predictions = newPredictions;
+				float* newScores = (float*)realloc(scores, count*sizeof(float));
+				if (newScores != NULL)
+					scores = newScores;
+				if (newSamples == NULL || newPredictions == NULL || newScores == NULL)
+					break;
+				capacity = count;
+			}
+			if (!serve_read(fd, samples, (uint64_t)count*server->numFeatures*sizeof(float)))
+				break;
+			server->predict(samples, count, predictions, scores);
+			if (!serve_write(fd, predictions, count*sizeof(int)) || !serve_write(fd, scores, count*sizeof(float)))
+				break;
+		}
+	}
+	free(samples);
+	free(predictions);
+	free(scores);
+
+	pthread_mutex_lock(&server->lock);
+	for (uint32_t c = 0; c < server->numConnections; c++) {
+		if (server->connections[c] == fd) {
+			server->connections[c] = server->connections[--server->numConnections];
+			break;
+		}
+	}
+	close(fd);
+	pthread_cond_broadcast(&server->disconnected);
+	pthread_mutex_unlock(&server->lock);
+	return NULL;
+}
+
+void model_server::reset_statistics() {
+	numRequests = 0;
+	numSamplesServed = 0;
+	numBatches = 0;
+	firstSubmitTime = 0;
+	lastCompletionTime = 0;
+}
+
+void model_server::print_statistics() {
+	pthread_mutex_lock(&lock);
+	uint64_t numLatencies = (numRequests < SERVE_LATENCY_SAMPLES) ? numRequests : SERVE_LATENCY_SAMPLES;
+	double* sorted = (double*)malloc((numLatencies > 0 ? numLatencies : 1)*sizeof(double));
+	memcpy(sorted, latencies, numLatencies*sizeof(double));
+	uint64_t requests = numRequests;
+	uint64_t samples = numSamplesServed;
+	uint64_t batches = numBatches;
+	double elapsed = lastCompletionTime - firstSubmitTime;
+	pthread_mutex_unlock(&lock);
+
+	cout << "Requests: " << requests << ", samples: " << samples << ", batches: " << batches << endl;
+	if (numLatencies > 0) {
+		qsort(sorted, numLatencies, sizeof(double), compare_doubles);
+		cout << "Latency p50: " << sorted[numLatencies*50/100]*1e6 << " us, p99: " << sorted[numLatencies*99/100]*1e6 << " us, max: " << sorted[numLatencies-1]*1e6 << " us" << endl;
+	}
+	if (elapsed > 0)
+		cout << "Throughput: " << samples/elapsed << " samples/s, " << requests/elapsed << " requests/s" << endl;
+	free(sorted);
+}
+
+// Client side of serve_unix_socket. Returns the connected socket (and the
+// server's dimensions), -1 on failure
+static int model_client_connect(char* path, uint32_t* numFeatures, uint32_t* numClasses) {
+	struct sockaddr_un address;
+	*numFeatures = 0;
+	*numClasses = 0;
+	if (strlen(path) >= sizeof(address.sun_path))
+		return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	uint32_t dimensions[2];
+	if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || !serve_read(fd, dimensions, sizeof(dimensions))) {
+		close(fd);
+		return -1;
+	}
+	*numFeatures = dimensions[0];
+	*numClasses = dimensions[1];
+	return fd;
+}
+
+// Returns 1 on success. Larger batches go as several requests
+static char model_client_predict(int fd, const float* samples, uint32_t count, uint32_t numFeatures, int predictions[], float scores[]) {
+	for (uint32_t first = 0; first < count; first += SERVE_MAX_REQUEST_SAMPLES) {
+		uint32_t n = (count - first < SERVE_MAX_REQUEST_SAMPLES) ? count - first : SERVE_MAX_REQUEST_SAMPLES;
+		if (!serve_write(fd, &n, sizeof(n))
+			|| !serve_write(fd, samples + (uint64_t)first*numFeatures, (uint64_t)n*numFeatures*sizeof(float))
+			|| !serve_read(fd, predictions + first, n*sizeof(int))
+			|| !serve_read(fd, scores + first, n*sizeof(float)))
+			return 0;
+	}
+	return 1;
+}
+
+#endif
@@ -0,0 +1,968 @@
+// Copyright (C) 2017 Kaan Kara - Systems Group, ETH Zurich
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//*************************************************************************
+
+#ifndef SGD_KERNELS
+#define SGD_KERNELS
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SGD_KERNELS_X86
+#include <immintrin.h>
+#endif
+
+// Vector kernels used by the software SGD. Every ISA variant is compiled with
+// its own target attribute, and get_float_kernels() picks the widest one the
+// CPU supports (CPUID) the first time it is called. Any length is handled;
+// remainders are done with masked loads (AVX2, AVX-512) or scalar code (SSE).
+struct float_kernels {
+	const char* name;
+	// returns x.a
+	float (*dot)(const float* x, const float* a, uint32_t n);
+	// x += alpha*a
+	void (*axpy)(float* x, const float* a, float alpha, uint32_t n);
+	// x += alpha*a, then returns x.a_next, in a single pass over x
+	float (*axpy_dot)(float* x, const float* a, float alpha, const float* a_next, uint32_t n);
+};
+
+// Fixed-point kernels for Qfixed_linreg_SGD. Every product is shifted before it
+// is accumulated, exactly like the scalar reference, so all variants give
+// bit-identical results (32-bit lanes, wrap-around multiplies and adds).
+struct fixed_kernels {
+	const char* name;
+	// returns sum((x*a) >> shift)
+	int32_t (*dot)(const int32_t* x, const int32_t* a, int shift, uint32_t n);
+	// x -= (scale*a) >> shift
+	void (*update)(int32_t* x, const int32_t* a, int32_t scale, int shift, uint32_t n);
+};
+
+// Fixed-point kernels that read the quantized values straight from the packed
+// FPGA layout (see zipml_sgd::pack_quantized_data): element k of a row takes
+// 2*bits bits starting at bit 2*bits*k, q1 in the low half and q2 in the high
+// half. Values are sign-extended, except that the pattern 1 << (bits-1) stands
+// for +2^(bits-1), as in the qFSGD multipliers. first must be a multiple of 8,
+// and up to 16 bytes past the end of the row may be read.
+struct packed_kernels {
+	const char* name;
+	// returns sum((x[k]*q1[k]) >> shift) for k in [first, first+n)
+	int32_t (*dot)(const int32_t* x, const uint32_t* row, uint32_t first, uint32_t n, int bits, int shift);
+	// x[k] -= (scale*q2[k]) >> shift for k in [first, first+n)
+	void (*update)(int32_t* x, const uint32_t* row, uint32_t first, uint32_t n, int bits, int32_t scale, int shift);
+};
+
+// Kernels for CSR rows: nnz values with their column indices (distinct within
+// a row) against a dense x. The fixed-point ones shift every product like
+// fixed_kernels, so they match them bit for bit on the same nonzeros.
+struct sparse_kernels {
+	const char* name;
+	// returns sum(x[columns[k]]*values[k])
+	float (*dot)(const float* x, const float* values, const uint32_t* columns, uint32_t nnz);
+	// x[columns[k]] += alpha*values[k]
+	void (*axpy)(float* x, const float* values, const uint32_t* columns, float alpha, uint32_t nnz);
+	// returns sum((x[columns[k]]*values[k]) >> shift)
+	int32_t (*fixed_dot)(const int32_t* x, const int32_t* values, const uint32_t* columns, int shift, uint32_t nnz);
+	// x[columns[k]] -= (scale*values[k]) >> shift
+	void (*fixed_update)(int32_t* x, const int32_t* values, const uint32_t* columns, int32_t scale, int shift, uint32_t nnz);
+};
+
+// Blocked dot products for inference: 2 samples against 4 models, so that every
+// load feeds several multiply-adds. out[r*4 + m] is the dot of row a + r*lda
+// with model w + m*ldw; pass lda = 0 for a single sample. The int8 variant
+// takes unsigned samples and signed models (as VNNI does), n a multiple of 64.
+struct block_kernels {
+	const char* name;
+	void (*dot)(const float* a, uint32_t lda, const float* w, uint32_t ldw, uint32_t n, float out[8]);
+	void (*dot_u8s8)(const uint8_t* a, uint32_t lda, const int8_t* w, uint32_t ldw, uint32_t n, int32_t out[8]);
+};
+
+static float dot_scalar(const float* x, const float* a, uint32_t n) {
+	float dot = 0;
+	for (uint32_t j = 0; j < n; j++) {
+		dot += x[j]*a[j];
+	}
+	return dot;
+}
+
+static void axpy_scalar(float* x, const float* a, float alpha, uint32_t n) {
+	for (uint32_t j = 0; j < n; j++) {
+		x[j] += alpha*a[j];
+	}
+}
+
+static float axpy_dot_scalar(float* x, const float* a, float alpha, const float* a_next, uint32_t n) {
+	float dot = 0;
+	for (uint32_t j = 0; j < n; j++) {
+		x[j] += alpha*a[j];
+		dot += x[j]*a_next[j];
+	}
+	return dot;
+}
+
+static int32_t fixed_dot_scalar(const int32_t* x, const int32_t* a, int shift, uint32_t n) {
+	uint32_t dot = 0;
+	for (uint32_t j = 0; j < n; j++) {
+		dot += (uint32_t)((int32_t)((uint32_t)x[j]*(uint32_t)a[j]) >> shift);
+	}
+	return (int32_t)dot;
+}
+
+static void fixed_update_scalar(int32_t* x, const int32_t* a, int32_t scale, int shift, uint32_t n) {
+	for (uint32_t j = 0; j < n; j++) {
+		x[j] = (int32_t)((uint32_t)x[j] - (uint32_t)((int32_t)((uint32_t)scale*(uint32_t)a[j]) >> shift));
+	}
+}
+
+static inline int32_t packed_value(const uint32_t* row, uint32_t k, int bits, int high) {
+	uint32_t position = 2*bits*k + high*bits;
+	uint32_t q = (row[position >> 5] >> (position & 31)) & ((1u << bits)-1);
+	uint32_t top = 1u << (bits-1);
+	return (q == top) ? (int32_t)top : (int32_t)(q << (32-bits)) >> (32-bits);
+}
+
+static int32_t packed_dot_scalar(const int32_t* x, const uint32_t* row, uint32_t first, uint32_t n, int bits, int shift) {
+	uint32_t dot = 0;
+	for (uint32_t k = first; k < first+n; k++) {
+		dot += (uint32_t)((int32_t)((uint32_t)x[k]*(uint32_t)packed_value(row, k, bits, 0)) >> shift);
+	}
+	return (int32_t)dot;
+}
+
+static void packed_update_scalar(int32_t* x, const uint32_t* row, uint32_t first, uint32_t n, int bits, int32_t scale, int shift) {
+	for (uint32_t k = first; k < first+n; k++) {
+		x[k] = (int32_t)((uint32_t)x[k] - (uint32_t)((int32_t)((uint32_t)scale*(uint32_t)packed_value(row, k, bits, 1)) >> shift));
+	}
+}
+
+static float sparse_dot_scalar(const float* x, const float* values, const uint32_t* columns, uint32_t nnz) {
+	float dot = 0;
+	for (uint32_t k = 0; k < nnz; k++) {
+		dot += x[columns[k]]*values[k];
+	}
+	return dot;
+}
+
+static void sparse_axpy_scalar(float* x, const float* values, const uint32_t* columns, float alpha, uint32_t nnz) {
+	for (uint32_t k = 0; k < nnz; k++) {
+		x[columns[k]] += alpha*values[k];
+	}
+}
+
+static int32_t sparse_fixed_dot_scalar(const int32_t* x, const int32_t* values, const uint32_t* columns, int shift, uint32_t nnz) {
+	uint32_t dot = 0;
+	for (uint32_t k = 0; k < nnz; k++) {
+		dot += (uint32_t)((int32_t)((uint32_t)x[columns[k]]*(uint32_t)values[k]) >> shift);
+	}
+	return (int32_t)dot;
+}
+
+static void sparse_fixed_update_scalar(int32_t* x, const int32_t* values, const uint32_t* columns, int32_t scale, int shift, uint32_t nnz) {
+	for (uint32_t k = 0; k < nnz; k++) {
+		x[columns[k]] = (int32_t)((uint32_t)x[columns[k]] - (uint32_t)((int32_t)((uint32_t)scale*(uint32_t)values[k]) >> shift));
+	}
+}
+
+static void block_dot_scalar(const float* a, uint32_t lda, const float* w, uint32_t ldw, uint32_t n, float out[8]) {
+	for (uint32_t r = 0; r < 2; r++) {
+		for (uint32_t m = 0; m < 4; m++) {
+			out[r*4 + m] = dot_scalar(a + r*lda, w + m*ldw, n);
+		}
+	}
+}
+
+static void block_dot_u8s8_scalar(const uint8_t* a, uint32_t lda, const int8_t* w, uint32_t ldw, uint32_t n, int32_t out[8]) {
+	for (uint32_t r = 0; r < 2; r++) {
+		for (uint32_t m = 0; m < 4; m++) {
+			int32_t dot = 0;
+			for (uint32_t j = 0; j < n; j++) {
+				dot += (int32_t)a[r*lda + j]*(int32_t)w[m*ldw + j];
+			}
+			out[r*4 + m] = dot;
+		}
+	}
+}
+
+#ifdef SGD_KERNELS_X86
+
+static inline float hsum_sse(__m128 v) {
+	__m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+	__m128 sums = _mm_add_ps(v, shuf);
+	shuf = _mm_movehl_ps(shuf, sums);
+	sums = _mm_add_ss(sums, shuf);
+	return _mm_cvtss_f32(sums);
+}
+
+static float dot_sse(const float* x, const float* a, uint32_t n) {
+	__m128 acc0 = _mm_setzero_ps();
+	__m128 acc1 = _mm_setzero_ps();
+	uint32_t j = 0;
+	for (; j + 8 <= n; j += 8) {
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + j), _mm_loadu_ps(a + j)));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + j + 4), _mm_loadu_ps(a + j + 4)));
+	}
+	float dot = hsum_sse(_mm_add_ps(acc0, acc1));
+	for (; j < n; j++) {
+		dot += x[j]*a[j];
+	}
+	return dot;
+}
+
+static void axpy_sse(float* x, const float* a, float alpha, uint32_t n) {
+	__m128 valpha = _mm_set1_ps(alpha);
+	uint32_t j = 0;
+	for (; j + 4 <= n; j += 4) {
+		_mm_storeu_ps(x + j, _mm_add_ps(_mm_loadu_ps(x + j), _mm_mul_ps(valpha, _mm_loadu_ps(a + j))));
+	}
+	for (; j < n; j++) {
+		x[j] += alpha*a[j];
+	}
+}
+
+static float axpy_dot_sse(float* x, const float* a, float alpha, const float* a_next, uint32_t n) {
+	__m128 valpha = _mm_set1_ps(alpha);
+	__m128 acc = _mm_setzero_ps();
+	uint32_t j = 0;
+	for (; j + 4 <= n; j += 4) {
+		__m128 vx = _mm_add_ps(_mm_loadu_ps(x + j), _mm_mul_ps(valpha, _mm_loadu_ps(a + j)));
+		_mm_storeu_ps(x + j, vx);
+		acc = _mm_add_ps(acc, _mm_mul_ps(vx, _mm_loadu_ps(a_next + j)));
+	}
+	float dot = hsum_sse(acc);
+	for (; j < n; j++) {
+		x[j] += alpha*a[j];
+		dot += x[j]*a_next[j];
+	}
+	return dot;
+}
+
+__attribute__((target("sse4.1")))
+static inline int32_t hsum_epi32_sse(__m128i v) {
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return _mm_cvtsi128_si32(v);
+}
+
+__attribute__((target("sse4.1")))
+static int32_t fixed_dot_sse(const int32_t* x, const int32_t* a, int shift, uint32_t n) {
+	__m128i vshift = _mm_cvtsi32_si128(shift);
+	__m128i acc = _mm_setzero_si128();
+	uint32_t j = 0;
+	for (; j + 4 <= n; j += 4) {
+		__m128i p = _mm_mullo_epi32(_mm_loadu_si128((const __m128i*)(x + j)), _mm_loadu_si128((const __m128i*)(a + j)));
+		acc = _mm_add_epi32(acc, _mm_sra_epi32(p, vshift));
+	}
+	return (int32_t)((uint32_t)hsum_epi32_sse(acc) + (uint32_t)fixed_dot_scalar(x + j, a + j, shift, n - j));
+}
+
+__attribute__((target("sse4.1")))
+static void fixed_update_sse(int32_t* x, const int32_t* a, int32_t scale, int shift, uint32_t n) {
+	__m128i vshift = _mm_cvtsi32_si128(shift);
+	__m128i vscale = _mm_set1_epi32(scale);
+	uint32_t j = 0;
+	for (; j + 4 <= n; j += 4) {
+		__m128i p = _mm_sra_epi32(_mm_mullo_epi32(vscale, _mm_loadu_si128((const __m128i*)(a + j))), vshift);
+		_mm_storeu_si128((__m128i*)(x + j), _mm_sub_epi32(_mm_loadu_si128((const __m128i*)(x + j)), p));
+	}
+	fixed_update_scalar(x + j, a + j, scale, shift, n - j);
+}
+
+__attribute__((target("avx2,fma")))
+static inline __m256i tail_mask_avx2(uint32_t remaining) {
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	return _mm256_cmpgt_epi32(_mm256_set1_epi32((int)remaining), lanes);
+}
+
+__attribute__((target("avx2,fma")))
+static inline float hsum_avx2(__m256 v) {
+	return hsum_sse(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+__attribute__((target("avx2,fma")))
+static float dot_avx2(const float* x, const float* a, uint32_t n) {
+	__m256 acc0 = _mm256_setzero_ps();
+	__m256 acc1 = _mm256_setzero_ps();
+	uint32_t j = 0;
+	for (; j + 16 <= n; j += 16) {
+		acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(x + j), _mm256_loadu_ps(a + j), acc0);
+		acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(x + j + 8), _mm256_loadu_ps(a + j + 8), acc1);
+	}
+	for (; j < n; j += 8) {
+		__m256i mask = tail_mask_avx2(n - j);
+		acc0 = _mm256_fmadd_ps(_mm256_maskload_ps(x + j, mask), _mm256_maskload_ps(a + j, mask), acc0);
+	}
+	return hsum_avx2(_mm256_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx2,fma")))
+static void axpy_avx2(float* x, const float* a, float alpha, uint32_t n) {
+	__m256 valpha = _mm256_set1_ps(alpha);
+	uint32_t j = 0;
+	for (; j + 8 <= n; j += 8) {
+		_mm256_storeu_ps(x + j, _mm256_fmadd_ps(valpha, _mm256_loadu_ps(a + j), _mm256_loadu_ps(x + j)));
+	}
+	if (j < n) {
+		__m256i mask = tail_mask_avx2(n - j);
+		__m256 vx = _mm256_fmadd_ps(valpha, _mm256_maskload_ps(a + j, mask), _mm256_maskload_ps(x + j, mask));
+		_mm256_maskstore_ps(x + j, mask, vx);
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static float axpy_dot_avx2(float* x, const float* a, float alpha, const float* a_next, uint32_t n) {
+	__m256 valpha = _mm256_set1_ps(alpha);
+	__m256 acc = _mm256_setzero_ps();
+	uint32_t j = 0;
+	for (; j + 8 <= n; j += 8) {
+		__m256 vx = _mm256_fmadd_ps(valpha, _mm256_loadu_ps(a + j), _mm256_loadu_ps(x + j));
+		_mm256_storeu_ps(x + j, vx);
+		acc = _mm256_fmadd_ps(vx, _mm256_loadu_ps(a_next + j), acc);
+	}
+	if (j < n) {
+		__m256i mask = tail_mask_avx2(n - j);
+		__m256 vx = _mm256_fmadd_ps(valpha, _mm256_maskload_ps(a + j, mask), _mm256_maskload_ps(x + j, mask));
+		_mm256_maskstore_ps(x + j, mask, vx);
+		acc = _mm256_fmadd_ps(vx, _mm256_maskload_ps(a_next + j, mask), acc);
+	}
+	return hsum_avx2(acc);
+}
+
+__attribute__((target("avx2,fma")))
+static int32_t fixed_dot_avx2(const int32_t* x, const int32_t* a, int shift, uint32_t n) {
+	__m128i vshift = _mm_cvtsi32_si128(shift);
+	__m256i acc0 = _mm256_setzero_si256();
+	__m256i acc1 = _mm256_setzero_si256();
+	uint32_t j = 0;
+	for (; j + 16 <= n; j += 16) {
+		__m256i p0 = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(x + j)), _mm256_loadu_si256((const __m256i*)(a + j)));
+		__m256i p1 = _mm256_mullo_epi32(_mm256_loadu_si256((const __m256i*)(x + j + 8)), _mm256_loadu_si256((const __m256i*)(a + j + 8)));
+		acc0 = _mm256_add_epi32(acc0, _mm256_sra_epi32(p0, vshift));
+		acc1 = _mm256_add_epi32(acc1, _mm256_sra_epi32(p1, vshift));
+	}
+	for (; j < n; j += 8) {
+		__m256i mask = tail_mask_avx2(n - j);
+		__m256i p = _mm256_mullo_epi32(_mm256_maskload_epi32((const int*)(x + j), mask), _mm256_maskload_epi32((const int*)(a + j), mask));
+		acc0 = _mm256_add_epi32(acc0, _mm256_sra_epi32(p, vshift));
+	}
+	__m256i acc = _mm256_add_epi32(acc0, acc1);
+	return hsum_epi32_sse(_mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+}
+
+__attribute__((target("avx2,fma")))
+static void fixed_update_avx2(int32_t* x, const int32_t* a, int32_t scale, int shift, uint32_t n) {
+	__m128i vshift = _mm_cvtsi32_si128(shift);
+	__m256i vscale = _mm256_set1_epi32(scale);
+	uint32_t j = 0;
+	for (; j + 8 <= n; j += 8) {
+		__m256i p = _mm256_sra_epi32(_mm256_mullo_epi32(vscale, _mm256_loadu_si256((const __m256i*)(a + j))), vshift);
+		_mm256_storeu_si256((__m256i*)(x + j), _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(x + j)), p));
+	}
+	if (j < n) {
+		__m256i mask = tail_mask_avx2(n - j);
+		__m256i p = _mm256_sra_epi32(_mm256_mullo_epi32(vscale, _mm256_maskload_epi32((const int*)(a + j), mask)), vshift);
+		_mm256_maskstore_epi32((int*)(x + j), mask, _mm256_sub_epi32(_mm256_maskload_epi32((const int*)(x + j), mask), p));
+	}
+}
+
+// Loads elements [k, k+8) of a packed row into 8 lanes, each lane holding the
+// 2*bits bit field of one element in its low bits
+__attribute__((target("avx2,fma")))
+static inline __m256i packed_fields_avx2(const uint32_t* row, uint32_t k, int bits) {
+	const uint8_t* bytes = (const uint8_t*)row;
+	if (bits == 8) {
+		return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(bytes + 2*k)));
+	}
+	else if (bits == 4) {
+		return _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(bytes + k)));
+	}
+	else {
+		uint32_t word;
+		memcpy(&word, bytes + (2*bits*k)/8, sizeof(word));
+		__m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		return _mm256_srlv_epi32(_mm256_set1_epi32((int)word), _mm256_slli_epi32(lanes, bits == 2 ? 2 : 1));
+	}
+}
+
+// Sign-extends the field at bit offset [low, low+bits) of every lane, mapping 1 << (bits-1) to +2^(bits-1)
+__attribute__((target("avx2,fma")))
+static inline __m256i packed_decode_avx2(__m256i fields, int bits, int low) {
+	__m256i v = _mm256_sra_epi32(_mm256_sll_epi32(fields, _mm_cvtsi32_si128(32-bits-low)), _mm_cvtsi32_si128(32-bits));
+	__m256i top = _mm256_set1_epi32(1 << (bits-1));
+	return _mm256_blendv_epi8(v, top, _mm256_cmpeq_epi32(v, _mm256_sub_epi32(_mm256_setzero_si256(), top)));
+}
+
+__attribute__((target("avx2,fma")))
+static int32_t packed_dot_avx2(const int32_t* x, const uint32_t* row, uint32_t first, uint32_t n, int bits, int shift) {
+	__m128i vshift = _mm_cvtsi32_si128(shift);
+	__m256i acc = _mm256_setzero_si256();
+	for (uint32_t j = 0; j < n; j += 8) {
+		__m256i mask = tail_mask_avx2(n - j);
+		__m256i q1 = packed_decode_avx2(packed_fields_avx2(row, first + j, bits), bits, 0);
+		__m256i p = _mm256_mullo_epi32(_mm256_maskload_epi32((const int*)(x + first + j), mask), q1);
+		acc = _mm256_add_epi32(acc, _mm256_sra_epi32(p, vshift));
+	}
+	return hsum_epi32_sse(_mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)));
+}
+
+__attribute__((target("avx2,fma")))
+static void packed_update_avx2(int32_t* x, const uint32_t* row, uint32_t first, uint32_t n, int bits, int32_t scale, int shift) {
+	__m128i vshift = _mm_cvtsi32_si128(shift);
+	__m256i vscale = _mm256_set1_epi32(scale);
+	for (uint32_t j = 0; j < n; j += 8) {
+		__m256i q2 = packed_decode_avx2(packed_fields_avx2(row, first + j, bits), bits, bits);
+		__m256i p = _mm256_sra_epi32(_mm256_mullo_epi32(vscale, q2), vshift);
+		if (j + 8 <= n) {
+			_mm256_storeu_si256((__m256i*)(x + first + j), _mm256_sub_epi32(_mm256_loadu_si256((const __m256i*)(x + first + j)), p));
+		}
+		else {
+			__m256i mask = tail_mask_avx2(n - j);
+			_mm256_maskstore_epi32((int*)(x + first + j), mask, _mm256_sub_epi32(_mm256_maskload_epi32((const int*)(x + first + j), mask), p));
+		}
+	}
+}
+
+__attribute__((target("avx2,fma")))
+static void block_dot_avx2(const float* a, uint32_t lda, const float* w, uint32_t ldw, uint32_t n, float out[8]) {
+	__m256 acc[8];
+	for (uint32_t k = 0; k < 8; k++)
+		acc[k] = _mm256_setzero_ps();
+	for (uint32_t j = 0; j < n; j += 8) {
+		__m256i mask = tail_mask_avx2(n - j);
+		__m256 a0 = _mm256_maskload_ps(a + j, mask);
+		__m256 a1 = _mm256_maskload_ps(a + lda + j, mask);
+		for (uint32_t m = 0; m < 4; m++) {
+			__m256 vw = _mm256_maskload_ps(w + m*ldw + j, mask);
+			acc[m] = _mm256_fmadd_ps(a0, vw, acc[m]);
+			acc[4 + m] = _mm256_fmadd_ps(a1, vw, acc[4 + m]);
+		}
+	}
+	for (uint32_t k = 0; k < 8; k++)
+		out[k] = hsum_avx2(acc[k]);
+}
+
+// Widens to 16 bits and uses madd, which cannot saturate (unlike maddubs)
+__attribute__((target("avx2,fma")))
+static void block_dot_u8s8_avx2(const uint8_t* a, uint32_t lda, const int8_t* w, uint32_t ldw, uint32_t n, int32_t out[8]) {
+	__m256i acc[8];
+	for (uint32_t k = 0; k < 8; k++)
+		acc[k] = _mm256_setzero_si256();
+	for (uint32_t j = 0; j < n; j += 16) {
+		__m256i a0 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + j)));
+		__m256i a1 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(a + lda + j)));
+		for (uint32_t m = 0; m < 4; m++) {
+			__m256i vw = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i*)(w + m*ldw + j)));
+			acc[m] = _mm256_add_epi32(acc[m], _mm256_madd_epi16(a0, vw));
+			acc[4 + m] = _mm256_add_epi32(acc[4 + m], _mm256_madd_epi16(a1, vw));
+		}
+	}
+	for (uint32_t k = 0; k < 8; k++)
+		out[k] = hsum_epi32_sse(_mm_add_epi32(_mm256_castsi256_si128(acc[k]), _mm256_extracti128_si256(acc[k], 1)));
+}
+
+__attribute__((target("avx512f")))
+static inline __mmask16 tail_mask_avx512(uint32_t remaining) {
+	return (__mmask16)((remaining >= 16) ? 0xFFFF : ((1u << remaining) - 1));
+}
+
+__attribute__((target("avx512f")))
+static inline float hsum_avx512(__m512 v) {
+	// Masked extracts with an explicit source avoid _mm512_undefined_ps()
+	__m128 z = _mm_setzero_ps();
+	__m128 s01 = _mm_add_ps(_mm512_mask_extractf32x4_ps(z, 0xF, v, 0), _mm512_mask_extractf32x4_ps(z, 0xF, v, 1));
+	__m128 s23 = _mm_add_ps(_mm512_mask_extractf32x4_ps(z, 0xF, v, 2), _mm512_mask_extractf32x4_ps(z, 0xF, v, 3));
+	return hsum_sse(_mm_add_ps(s01, s23));
+}
+
+__attribute__((target("avx512f")))
+static float dot_avx512(const float* x, const float* a, uint32_t n) {
+	__m512 acc0 = _mm512_setzero_ps();
+	__m512 acc1 = _mm512_setzero_ps();
+	uint32_t j = 0;
+	for (; j + 32 <= n; j += 32) {
+		acc0 = _mm512_fmadd_ps(_mm512_loadu_ps(x + j), _mm512_loadu_ps(a + j), acc0);
+		acc1 = _mm512_fmadd_ps(_mm512_loadu_ps(x + j + 16), _mm512_loadu_ps(a + j + 16), acc1);
+	}
+	for (; j < n; j += 16) {
+		__mmask16 mask = tail_mask_avx512(n - j);
+		acc0 = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, x + j), _mm512_maskz_loadu_ps(mask, a + j), acc0);
+	}
+	return hsum_avx512(_mm512_add_ps(acc0, acc1));
+}
+
+__attribute__((target("avx512f")))
+static void axpy_avx512(float* x, const float* a, float alpha, uint32_t n) {
+	__m512 valpha = _mm512_set1_ps(alpha);
+	for (uint32_t j = 0; j < n; j += 16) {
+		__mmask16 mask = tail_mask_avx512(n - j);
+		__m512 vx = _mm512_fmadd_ps(valpha, _mm512_maskz_loadu_ps(mask, a + j), _mm512_maskz_loadu_ps(mask, x + j));
+		_mm512_mask_storeu_ps(x + j, mask, vx);
+	}
+}
+
+__attribute__((target("avx512f")))
+static float axpy_dot_avx512(float* x, const float* a, float alpha, const float* a_next, uint32_t n) {
+	__m512 valpha = _mm512_set1_ps(alpha);
+	__m512 acc = _mm512_setzero_ps();
+	for (uint32_t j = 0; j < n; j += 16) {
+		__mmask16 mask = tail_mask_avx512(n - j);
+		__m512 vx = _mm512_fmadd_ps(valpha, _mm512_maskz_loadu_ps(mask, a + j), _mm512_maskz_loadu_ps(mask, x + j));
+		_mm512_mask_storeu_ps(x + j, mask, vx);
+		acc = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(mask, a_next + j), acc);
+	}
+	return hsum_avx512(acc);
+}
+
+__attribute__((target("avx512f")))
+static int32_t fixed_dot_avx512(const int32_t* x, const int32_t* a, int shift, uint32_t n) {
+	__m128i vshift = _mm_cvtsi32_si128(shift);
+	__m512i acc = _mm512_setzero_si512();
+	for (uint32_t j = 0; j < n; j += 16) {
+		__mmask16 mask = tail_mask_avx512(n - j);
+		__m512i p = _mm512_mullo_epi32(_mm512_maskz_loadu_epi32(mask, x + j), _mm512_maskz_loadu_epi32(mask, a + j));
+		acc = _mm512_add_epi32(acc, _mm512_maskz_sra_epi32(mask, p, vshift));
+	}
+	__m128i z = _mm_setzero_si128();
+	__m128i s01 = _mm_add_epi32(_mm512_mask_extracti32x4_epi32(z, 0xF, acc, 0), _mm512_mask_extracti32x4_epi32(z, 0xF, acc, 1));
+	__m128i s23 = _mm_add_epi32(_mm512_mask_extracti32x4_epi32(z, 0xF, acc, 2), _mm512_mask_extracti32x4_epi32(z, 0xF, acc, 3));
+	return hsum_epi32_sse(_mm_add_epi32(s01, s23));
+}
+
+__attribute__((target("avx512f")))
+static void fixed_update_avx512(int32_t* x, const int32_t* a, int32_t scale, int shift, uint32_t n) {
+	__m128i vshift = _mm_cvtsi32_si128(shift);
+	__m512i vscale = _mm512_set1_epi32(scale);
+	for (uint32_t j = 0; j < n; j += 16) {
+		__mmask16 mask = tail_mask_avx512(n - j);
+		__m512i p = _mm512_maskz_sra_epi32(mask, _mm512_mullo_epi32(vscale, _mm512_maskz_loadu_epi32(mask, a + j)), vshift);
+		_mm512_mask_storeu_epi32(x + j, mask, _mm512_sub_epi32(_mm512_maskz_loadu_epi32(mask, x + j), p));
+	}
+}
+
+// Gathers and scatters; the indices within a row are distinct (the libsvm
+// loader merges repeated columns), so a scatter never has conflicting lanes
+__attribute__((target("avx512f")))
+static float sparse_dot_avx512(const float* x, const float* values, const uint32_t* columns, uint32_t nnz) {
+	__m512 acc = _mm512_setzero_ps();
+	for (uint32_t k = 0; k < nnz; k += 16) {
+		__mmask16 mask = tail_mask_avx512(nnz - k);
+		__m512i index = _mm512_maskz_loadu_epi32(mask, columns + k);
+		__m512 vx = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, index, x, 4);
+		acc = _mm512_fmadd_ps(vx, _mm512_maskz_loadu_ps(mask, values + k), acc);
+	}
+	return hsum_avx512(acc);
+}
+
+__attribute__((target("avx512f")))
+static void sparse_axpy_avx512(float* x, const float* values, const uint32_t* columns, float alpha, uint32_t nnz) {
+	__m512 valpha = _mm512_set1_ps(alpha);
+	for (uint32_t k = 0; k < nnz; k += 16) {
+		__mmask16 mask = tail_mask_avx512(nnz - k);
+		__m512i index = _mm512_maskz_loadu_epi32(mask, columns + k);
+		__m512 vx = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), mask, index, x, 4);
+		vx = _mm512_fmadd_ps(valpha, _mm512_maskz_loadu_ps(mask, values + k), vx);
+		_mm512_mask_i32scatter_ps(x, mask, index, vx, 4);
+	}
+}
+
+__attribute__((target("avx512f")))
+static int32_t sparse_fixed_dot_avx512(const int32_t* x, const int32_t* values, const uint32_t* columns, int shift, uint32_t nnz) {
+	__m128i vshift = _mm_cvtsi32_si128(shift);
+	__m512i acc = _mm512_setzero_si512();
+	for (uint32_t k = 0; k < nnz; k += 16) {
+		__mmask16 mask = tail_mask_avx512(nnz - k);
+		__m512i index = _mm512_maskz_loadu_epi32(mask, columns + k);
+		__m512i vx = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), mask, index, x, 4);
+		__m512i p = _mm512_mullo_epi32(vx, _mm512_maskz_loadu_epi32(mask, values + k));
+		acc = _mm512_add_epi32(acc, _mm512_maskz_sra_epi32(mask, p, vshift));
+	}
+	__m128i z = _mm_setzero_si128();
+	__m128i s01 = _mm_add_epi32(_mm512_mask_extracti32x4_epi32(z, 0xF, acc, 0), _mm512_mask_extracti32x4_epi32(z, 0xF, acc, 1));
+	__m128i s23 = _mm_add_epi32(_mm512_mask_extracti32x4_epi32(z, 0xF, acc, 2), _mm512_mask_extracti32x4_epi32(z, 0xF, acc, 3));
+	return hsum_epi32_sse(_mm_add_epi32(s01, s23));
+}
+
+__attribute__((target("avx512f")))
+static void sparse_fixed_update_avx512(int32_t* x, const int32_t* values, const uint32_t* columns, int32_t scale, int shift, uint32_t nnz) {
+	__m128i vshift = _mm_cvtsi32_si128(shift);
+	__m512i vscale = _mm512_set1_epi32(scale);
+	for (uint32_t k = 0; k < nnz; k += 16) {
+		__mmask16 mask = tail_mask_avx512(nnz - k);
+		__m512i index = _mm512_maskz_loadu_epi32(mask, columns + k);
+		__m512i vx = _mm512_mask_i32gather_epi32(_mm512_setzero_si512(), mask, index, x, 4);
+		__m512i p = _mm512_maskz_sra_epi32(mask, _mm512_mullo_epi32(vscale, _mm512_maskz_loadu_epi32(mask, values + k)), vshift);
+		_mm512_mask_i32scatter_epi32(x, mask, index, _mm512_sub_epi32(vx, p), 4);
+	}
+}
+
+__attribute__((target("avx512f")))
+static void block_dot_avx512(const float* a, uint32_t lda, const float* w, uint32_t ldw, uint32_t n, float out[8]) {
+	__m512 acc[8];
+	for (uint32_t k = 0; k < 8; k++)
+		acc[k] = _mm512_setzero_ps();
+	for (uint32_t j = 0; j < n; j += 16) {
+		__mmask16 mask = tail_mask_avx512(n - j);
+		__m512 a0 = _mm512_maskz_loadu_ps(mask, a + j);
+		__m512 a1 = _mm512_maskz_loadu_ps(mask, a + lda + j);
+		for (uint32_t m = 0; m < 4; m++) {
+			__m512 vw = _mm512_maskz_loadu_ps(mask, w + m*ldw + j);
+			acc[m] = _mm512_fmadd_ps(a0, vw, acc[m]);
+			acc[4 + m] = _mm512_fmadd_ps(a1, vw, acc[4 + m]);
+		}
+	}
+	for (uint32_t k = 0; k < 8; k++)
+		out[k] = hsum_avx512(acc[k]);
+}
+
+__attribute__((target("avx512f,avx512vnni")))
+static void block_dot_u8s8_vnni(const uint8_t* a, uint32_t lda, const int8_t* w, uint32_t ldw, uint32_t n, int32_t out[8]) {
+	__m512i acc[8];
+	for (uint32_t k = 0; k < 8; k++)
+		acc[k] = _mm512_setzero_si512();
+	for (uint32_t j = 0; j < n; j += 64) {
+		__m512i a0 = _mm512_loadu_si512(a + j);
+		__m512i a1 = _mm512_loadu_si512(a + lda + j);
+		for (uint32_t m = 0; m < 4; m++) {
+			__m512i vw = _mm512_loadu_si512(w + m*ldw + j);
+			acc[m] = _mm512_dpbusd_epi32(acc[m], a0, vw);
+			acc[4 + m] = _mm512_dpbusd_epi32(acc[4 + m], a1, vw);
+		}
+	}
+	__m128i z = _mm_setzero_si128();
+	for (uint32_t k = 0; k < 8; k++) {
+		__m128i s01 = _mm_add_epi32(_mm512_mask_extracti32x4_epi32(z, 0xF, acc[k], 0), _mm512_mask_extracti32x4_epi32(z, 0xF, acc[k], 1));
+		__m128i s23 = _mm_add_epi32(_mm512_mask_extracti32x4_epi32(z, 0xF, acc[k], 2), _mm512_mask_extracti32x4_epi32(z, 0xF, acc[k], 3));
+		out[k] = hsum_epi32_sse(_mm_add_epi32(s01, s23));
+	}
+}
+
+#endif // SGD_KERNELS_X86
+
+// Counter-based random numbers for the stochastic quantizer: every value is a
+// hash (murmur3 finalizer over a Weyl sequence) of a key and a counter, so any
+// element can be generated independently of all others, on any thread.
+static inline uint32_t counter_rng(uint32_t key, uint32_t counter) {
+	uint32_t h = counter*0x9E3779B9u ^ key;
+	h ^= h >> 16;
+	h *= 0x85EBCA6Bu;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35u;
+	h ^= h >> 16;
+	return h;
+}
+
+// Stochastically rounds one row to integer levels: element j goes to
+// floor(|a|*scale) or the level above, with probability given by the fraction,
+// using counter_rng(rowKey, j). With toMinus1_1 the sign of a is kept.
+// Cloned per ISA and resolved at load time, the loops are auto-vectorized.
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static void quantize_row(const float* a, int* aiq, uint32_t n, float scale, char toMinus1_1, uint32_t rowKey) {
+	if (toMinus1_1 == 0) {
+		for (uint32_t j = 0; j < n; j++) {
+			float scaledElement = a[j]*scale;
+			int baseLevel = (int)scaledElement;
+			float toBaseLevelProbability = 1.0f - (scaledElement - (float)baseLevel);
+			float probability = (float)(counter_rng(rowKey, j) >> 8)*(1.0f/16777216.0f);
+			aiq[j] = baseLevel + (toBaseLevelProbability > probability ? 0 : 1);
+		}
+	}
+	else {
+		for (uint32_t j = 0; j < n; j++) {
+			float a_here = a[j];
+			float scaledElement = (a_here > 0 ? a_here : -a_here)*scale;
+			int baseLevel = (int)scaledElement;
+			float toBaseLevelProbability = 1.0f - (scaledElement - (float)baseLevel);
+			float probability = (float)(counter_rng(rowKey, j) >> 8)*(1.0f/16777216.0f);
+			int level = baseLevel + (toBaseLevelProbability > probability ? 0 : 1);
+			aiq[j] = (a_here > 0) ? level : -level;
+		}
+	}
+}
+
+// quantize_row for the nonzeros of a CSR row: the random number of a value is
+// counter_rng(rowKey, column), so the result equals the dense quantization.
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static void quantize_sparse_row(const float* values, const uint32_t* columns, int* aiq, uint32_t nnz, float scale, char toMinus1_1, uint32_t rowKey) {
+	for (uint32_t k = 0; k < nnz; k++) {
+		float a_here = values[k];
+		float scaledElement = (toMinus1_1 == 0 ? a_here : (a_here > 0 ? a_here : -a_here))*scale;
+		int baseLevel = (int)scaledElement;
+		float toBaseLevelProbability = 1.0f - (scaledElement - (float)baseLevel);
+		float probability = (float)(counter_rng(rowKey, columns[k]) >> 8)*(1.0f/16777216.0f);
+		int level = baseLevel + (toBaseLevelProbability > probability ? 0 : 1);
+		aiq[k] = (toMinus1_1 == 0 || a_here > 0) ? level : -level;
+	}
+}
+
+// Narrows n doubles to floats, e.g. a row of a raw double file into a.
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static void convert_double_to_float(const double* src, float* dst, uint32_t n) {
+	for (uint32_t j = 0; j < n; j++) {
+		dst[j] = (float)src[j];
+	}
+}
+
+// Normalization. The comparisons skip NaNs like the scalar loops they replace,
+// and the scaling divides (rather than multiplying by a reciprocal), so the
+// results are the same bit for bit.
+// Running per-column min/max: amin[j] = min(amin[j], a[j]), same for amax.
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static void minmax_columns(const float* a, float* amin, float* amax, uint32_t n) {
+	for (uint32_t j = 0; j < n; j++) {
+		float v = a[j];
+		amin[j] = v < amin[j] ? v : amin[j];
+		amax[j] = v > amax[j] ? v : amax[j];
+	}
+}
+
+// Min/max of a row, folded into *amin/*amax. Sixteen running lanes make the
+// reduction element-wise, so it vectorizes without fast-math.
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static void minmax_row(const float* a, uint32_t n, float* amin, float* amax) {
+	float lmin[16], lmax[16];
+	for (uint32_t k = 0; k < 16; k++) {
+		lmin[k] = *amin;
+		lmax[k] = *amax;
+	}
+	uint32_t j = 0;
+	for (; j + 16 <= n; j += 16) {
+		for (uint32_t k = 0; k < 16; k++) {
+			float v = a[j + k];
+			lmin[k] = v < lmin[k] ? v : lmin[k];
+			lmax[k] = v > lmax[k] ? v : lmax[k];
+		}
+	}
+	for (; j < n; j++) {
+		lmin[0] = a[j] < lmin[0] ? a[j] : lmin[0];
+		lmax[0] = a[j] > lmax[0] ? a[j] : lmax[0];
+	}
+	for (uint32_t k = 0; k < 16; k++) {
+		*amin = lmin[k] < *amin ? lmin[k] : *amin;
+		*amax = lmax[k] > *amax ? lmax[k] : *amax;
+	}
+}
+
+// a[j] = ((a[j] - offset[j])/range[j])*mul[j] + add[j]; offset 0, range 1,
+// mul 1, add 0 leaves a column unchanged
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static void scale_columns(float* a, const float* offset, const float* range, const float* mul, const float* add, uint32_t n) {
+	for (uint32_t j = 0; j < n; j++) {
+		a[j] = ((a[j] - offset[j])/range[j])*mul[j] + add[j];
+	}
+}
+
+// scale_columns with the same factors for every element
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static void scale_row(float* a, float offset, float range, float mul, float add, uint32_t n) {
+	for (uint32_t j = 0; j < n; j++) {
+		a[j] = ((a[j] - offset)/range)*mul + add;
+	}
+}
+
+// ai[j] = (int)(a[j]*scaler), e.g. the labels into bi
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static void convert_float_to_integer(const float* a, int* ai, float scaler, uint32_t n) {
+	for (uint32_t j = 0; j < n; j++) {
+		ai[j] = (int)(a[j]*scaler);
+	}
+}
+
+// Quantizes a row symmetrically to [-127, 127] and stores it offset by 128,
+// as block_kernels.dot_u8s8 takes it. Returns the scale (max |a|/127).
+__attribute__((target_clones("avx512f", "avx2", "default")))
+static float quantize_row_int8(const float* a, uint8_t* q, uint32_t n) {
+	// Max of |a| on the bit patterns: they order like the (non-negative) values,
+	// and an integer max reduction vectorizes without fast-math
+	uint32_t maxBits = 0;
+	for (uint32_t j = 0; j < n; j++) {
+		uint32_t bits;
+		memcpy(&bits, a + j, sizeof(bits));
+		bits &= 0x7FFFFFFF;
+		maxBits = bits > maxBits ? bits : maxBits;
+	}
+	float max;
+	memcpy(&max, &maxBits, sizeof(max));
+	float scale = (max > 0) ? max/127.0f : 1.0f;
+	float inverse = 1.0f/scale;
+	for (uint32_t j = 0; j < n; j++) {
+		float v = a[j]*inverse;
+		q[j] = (uint8_t)(128 + (int32_t)(v + (v >= 0 ? 0.5f : -0.5f)));
+	}
+	return scale;
+}
+
+#define SGD_KERNELS_SCALAR	0
+#define SGD_KERNELS_SSE		1
+#define SGD_KERNELS_AVX2	2
+#define SGD_KERNELS_AVX512	3
+
+// Widest kernel set the CPU supports, from CPUID
+static int select_kernels_isa() {
+#ifdef SGD_KERNELS_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return SGD_KERNELS_AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return SGD_KERNELS_AVX2;
+	if (__builtin_cpu_supports("sse4.1"))
+		return SGD_KERNELS_SSE;
+#endif
+	return SGD_KERNELS_SCALAR;
+}
+
+static float_kernels select_float_kernels() {
+	float_kernels k;
+	k.name = "scalar";
+	k.dot = dot_scalar;
+	k.axpy = axpy_scalar;
+	k.axpy_dot = axpy_dot_scalar;
+#ifdef SGD_KERNELS_X86
+	switch (select_kernels_isa()) {
+	case SGD_KERNELS_AVX512:
+		k.name = "avx512";
+		k.dot = dot_avx512;
+		k.axpy = axpy_avx512;
+		k.axpy_dot = axpy_dot_avx512;
+		break;
+	case SGD_KERNELS_AVX2:
+		k.name = "avx2";
+		k.dot = dot_avx2;
+		k.axpy = axpy_avx2;
+		k.axpy_dot = axpy_dot_avx2;
+		break;
+	case SGD_KERNELS_SSE:
+		k.name = "sse";
+		k.dot = dot_sse;
+		k.axpy = axpy_sse;
+		k.axpy_dot = axpy_dot_sse;
+		break;
+	}
+#endif
+	return k;
+}
+
+static fixed_kernels select_fixed_kernels() {
+	fixed_kernels k;
+	k.name = "scalar";
+	k.dot = fixed_dot_scalar;
+	k.update = fixed_update_scalar;
+#ifdef SGD_KERNELS_X86
+	switch (select_kernels_isa()) {
+	case SGD_KERNELS_AVX512:
+		k.name = "avx512";
+		k.dot = fixed_dot_avx512;
+		k.update = fixed_update_avx512;
+		break;
+	case SGD_KERNELS_AVX2:
+		k.name = "avx2";
+		k.dot = fixed_dot_avx2;
+		k.update = fixed_update_avx2;
+		break;
+	case SGD_KERNELS_SSE:
+		k.name = "sse";
+		k.dot = fixed_dot_sse;
+		k.update = fixed_update_sse;
+		break;
+	}
+#endif
+	return k;
+}
+
+// The packed kernels are bound by the unpacking, so AVX-512 machines use the AVX2 ones
+static packed_kernels select_packed_kernels() {
+	packed_kernels k;
+	k.name = "scalar";
+	k.dot = packed_dot_scalar;
+	k.update = packed_update_scalar;
+#ifdef SGD_KERNELS_X86
+	if (select_kernels_isa() >= SGD_KERNELS_AVX2) {
+		k.name = "avx2";
+		k.dot = packed_dot_avx2;
+		k.update = packed_update_avx2;
+	}
+#endif
+	return k;
+}
+
+// Gathers only pay off with AVX-512 (which also has scatters)
+static sparse_kernels select_sparse_kernels() {
+	sparse_kernels k;
+	k.name = "scalar";
+	k.dot = sparse_dot_scalar;
+	k.axpy = sparse_axpy_scalar;
+	k.fixed_dot = sparse_fixed_dot_scalar;
+	k.fixed_update = sparse_fixed_update_scalar;
+#ifdef SGD_KERNELS_X86
+	if (select_kernels_isa() == SGD_KERNELS_AVX512) {
+		k.name = "avx512";
+		k.dot = sparse_dot_avx512;
+		k.axpy = sparse_axpy_avx512;
+		k.fixed_dot = sparse_fixed_dot_avx512;
+		k.fixed_update = sparse_fixed_update_avx512;
+	}
+#endif
+	return k;
+}
+
+// SSE machines use the scalar kernels; int8 uses VNNI where the CPU has it
+static block_kernels select_block_kernels() {
+	block_kernels k;
+	k.name = "scalar";
+	k.dot = block_dot_scalar;
+	k.dot_u8s8 = block_dot_u8s8_scalar;
+#ifdef SGD_KERNELS_X86
+	int isa = select_kernels_isa();
+	if (isa >= SGD_KERNELS_AVX2) {
+		k.name = "avx2";
+		k.dot = block_dot_avx2;
+		k.dot_u8s8 = block_dot_u8s8_avx2;
+	}
+	if (isa >= SGD_KERNELS_AVX512) {
+		k.name = "avx512";
+		k.dot = block_dot_avx512;
+		if (__builtin_cpu_supports("avx512vnni")) {
+			k.name = "avx512, vnni";
+			k.dot_u8s8 = block_dot_u8s8_vnni;
+		}
+	}
+#endif
+	return k;
+}
+
+static const float_kernels& get_float_kernels() {
+	static const float_kernels kernels = select_float_kernels();
+	return kernels;
+}
+
+static const fixed_kernels& get_fixed_kernels() {
+	static const fixed_kernels kernels = select_fixed_kernels();
+	return kernels;
+}
+
+static const packed_kernels& get_packed_kernels() {
+	static const packed_kernels kernels = select_packed_kernels();
+	return kernels;
+}
+
+static const sparse_kernels& get_sparse_kernels() {
+	static const sparse_kernels kernels = select_sparse_kernels();
+	return kernels;
+}
+
+static const block_kernels& get_block_kernels() {
+	static const block_kernels kernels = select_block_kernels();
+	return kernels;
+}
+
+#endif
@@ -0,0 +1,416 @@
+// Copyright (C) 2017 Kaan Kara - Systems Group, ETH Zurich
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//*************************************************************************
+
+#ifndef SGD_SWEEP
+#define SGD_SWEEP
+
+#include <iostream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <atomic>
+
+#include "zipml_sgd.h"
+
+using namespace std;
+
+// Hyperparameter sweep over the data already loaded (and normalized) in a
+// zipml_sgd: every configuration x fold is one run, and numThreads threads
+// take runs from a shared counter, each training its own model against the
+// same read-only a/b/bi. Configurations with quantizationBits 0 train like
+// float_linreg_SGD, the others like Qfixed_linreg_SGD, quantizing every row on
+// the fly with the counter-based quantizer (epoch e uses the random streams 2e
+// and 2e+1, so a run without folds matches Qfixed_linreg_SGD from stream 0).
+//
+// Folds are index views: the samples are shuffled once into order[], fold f
+// validates on one contiguous slice of it and trains on the rest, in order.
+// With one fold there is no split, the runs train on all samples in their
+// original order and report the loss over all samples.
+//
+// After every epoch a run records its thread CPU time spent training (so that
+// concurrent runs do not inflate each other's times) and its loss. With
+// pruneFactor > 0 a run stops once its loss is not finite or exceeds
+// pruneFactor times the loss of the zero model.
+
+struct sweep_config {
+	int stepSizeShifter;	// Step size 1/2^stepSizeShifter
+	int quantizationBits;	// 0: float
+	uint32_t numEpochs;
+};
+
+struct sweep_run {
+	uint32_t config;
+	uint32_t fold;
+	uint32_t epochsRun;
+	char pruned;
+	float* losses;			// [numEpochs]
+	double* seconds;		// [numEpochs], cumulative
+};
+
+class sgd_sweep {
+private:
+	zipml_sgd* app;
+	sweep_config* configs;
+	uint32_t numConfigs;
+	uint32_t capacity;
+
+	sweep_run* runs;
+	uint32_t numRuns;
+	uint32_t numFolds;
+	uint32_t* order;		// Sample permutation the folds are slices of
+	float pruneFactor;
+	std::atomic<uint32_t> nextRun;
+
+	void free_runs();
+	void train(sweep_run* run);
+	double fold_loss(const float* x, uint32_t fold);
+
+	static void* worker_main(void* arg);
+
+public:
+	sgd_sweep(zipml_sgd* _app) {
+		app = _app;
+		capacity = 16;
+		configs = (sweep_config*)malloc(capacity*sizeof(sweep_config));
+		numConfigs = 0;
+		runs = NULL;
+		numRuns = 0;
+		numFolds = 0;
+		order = NULL;
+		pruneFactor = 0;
+	}
+
+	~sgd_sweep() {
+		free_runs();
+		free(configs);
+	}
+
+	void add(int stepSizeShifter, int quantizationBits, uint32_t numEpochs);
+	// Every combination of the given step sizes and widths (0: float)
+	void add_grid(const int stepSizeShifters[], uint32_t numShifters, const int quantizationBits[], uint32_t numWidths, uint32_t numEpochs);
+
+	// Runs all configurations on numFolds folds (1: no split), numThreads 0
+	// means numCPUThreads. Returns 0 if the data cannot be used
+	char run(uint32_t _numFolds, uint32_t numThreads, float _pruneFactor, uint32_t seed = 7);
+
+	// One record per configuration, fold and epoch: seconds and loss. JSON if
+	// pathToFile ends in ".json", CSV otherwise
+	char write_summary(char* pathToFile);
+	// Per configuration: mean final loss over the folds, and the mean time for
+	// the folds to reach targetLoss (if all of them do)
+	void print_summary(float targetLoss);
+};
+
+void sgd_sweep::add(int stepSizeShifter, int quantizationBits, uint32_t numEpochs) {
+	if (numConfigs == capacity) {
+		capacity *= 2;
+		configs = (sweep_config*)realloc(configs, capacity*sizeof(sweep_config));
+	}
+	configs[numConfigs].stepSizeShifter = stepSizeShifter;
+	configs[numConfigs].quantizationBits = quantizationBits;
+	configs[numConfigs].numEpochs = numEpochs;
+	numConfigs++;
+}
+
+void sgd_sweep::add_grid(const int stepSizeShifters[], uint32_t numShifters, const int quantizationBits[], uint32_t numWidths, uint32_t numEpochs) {
+	for (uint32_t w = 0; w < numWidths; w++) {
+		for (uint32_t s = 0; s < numShifters; s++) {
+			add(stepSizeShifters[s], quantizationBits[w], numEpochs);
+		}
+	}
+}
+
+void sgd_sweep::free_runs() {
+	for (uint32_t r = 0; r < numRuns; r++) {
+		free(runs[r].losses);
+		free(runs[r].seconds);
+	}
+	if (runs != NULL)
+		free(runs);
+	if (order != NULL)
+		free(order);
+	runs = NULL;
+	order = NULL;
+	numRuns = 0;
+}
+
+// Loss over the validation slice of fold (all samples with one fold)
+double sgd_sweep::fold_loss(const float* x, uint32_t fold) {
+	const float_kernels& kernels = get_float_kernels();
+	uint32_t first = (numFolds > 1) ? (uint64_t)app->numSamples*fold/numFolds : 0;
+	uint32_t last = (numFolds > 1) ? (uint64_t)app->numSamples*(fold+1)/numFolds : app->numSamples;
+	double loss = 0;
+	for (uint32_t k = first; k < last; k++) {
+		uint32_t i = order[k];
+		float error = kernels.dot(x, app->a + (uint64_t)i*app->numFeatures, app->numFeatures) - app->b[i];
+		loss += error*error;
+	}
+	return (last > first) ? loss/(2.0*(last - first)) : 0;
+}
+
+static double sweep_thread_time() {
+	struct timespec t;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+void sgd_sweep::train(sweep_run* run) {
+	const sweep_config& config = configs[run->config];
+	uint32_t numFeatures = app->numFeatures;
+	uint32_t numSamples = app->numSamples;
+	const float_kernels& kernels = get_float_kernels();
+	const fixed_kernels& fkernels = get_fixed_kernels();
+
+	// Training view: order[] without the validation slice
+	uint32_t validationFirst = (numFolds > 1) ? (uint64_t)numSamples*run->fold/numFolds : numSamples;
+	uint32_t validationLast = (numFolds > 1) ? (uint64_t)numSamples*(run->fold+1)/numFolds : numSamples;
+
+	float* x = (float*)calloc(numFeatures, sizeof(float));
+	double zeroLoss = fold_loss(x, run->fold);
+	int32_t* xi = NULL;
+	int* aiq1 = NULL;
+	int* aiq2 = NULL;
+	int numBitsToShift = 0;
+	float scale = 0;
+	if (config.quantizationBits != 0) {
+		xi = (int32_t*)calloc(numFeatures, sizeof(int32_t));
+		aiq1 = (int*)malloc(2*numFeatures*sizeof(int));
+		aiq2 = aiq1 + numFeatures;
+		numBitsToShift = (app->a_normalizedToMinus1_1 == 0) ? config.quantizationBits-1 : config.quantizationBits-2;
+		int numLevels = (1 << (config.quantizationBits-1)) + 1;
+		scale = (app->a_normalizedToMinus1_1 == 0) ? numLevels-1 : (numLevels-1)/2;
+	}
+	float stepSize = 1.0/(1 << config.stepSizeShifter);
+
+	double seconds = 0;
+	run->epochsRun = 0;
+	run->pruned = 0;
+	for (uint32_t epoch = 0; epoch < config.numEpochs; epoch++) {
+		double start = sweep_thread_time();
+		uint32_t streamKey1 = counter_rng(app->quantizationSeed, 2*epoch);
+		uint32_t streamKey2 = counter_rng(app->quantizationSeed, 2*epoch+1);
+		for (uint32_t k = 0; k < numSamples; k++) {
+			if (k == validationFirst) {
+				k = validationLast - 1;
+				continue;
+			}
+			uint32_t i = order[k];
+			const float* ai = app->a + (uint64_t)i*numFeatures;
+			if (config.quantizationBits == 0) {
+				float dot = kernels.dot(x, ai, numFeatures);
+				kernels.axpy(x, ai, -stepSize*(dot - app->b[i]), numFeatures);
+			}
+			else {
+				quantize_row(ai, aiq1, numFeatures, scale, app->a_normalizedToMinus1_1, counter_rng(streamKey1, i));
+				quantize_row(ai, aiq2, numFeatures, scale, app->a_normalizedToMinus1_1, counter_rng(streamKey2, i));
+				int32_t error = fkernels.dot(xi, aiq1, numBitsToShift, numFeatures) - app->bi[i];
+				fkernels.update(xi, aiq2, error, config.stepSizeShifter + numBitsToShift, numFeatures);
+			}
+		}
+		if (config.quantizationBits != 0) {
+			for (uint32_t j = 0; j < numFeatures; j++) {
+				x[j] = (float)xi[j]/(float)app->b_toIntegerScaler;
+			}
+		}
+		seconds += sweep_thread_time() - start;
+
+		float loss = (float)fold_loss(x, run->fold);
+		run->losses[epoch] = loss;
+		run->seconds[epoch] = seconds;
+		run->epochsRun = epoch+1;
+		if (pruneFactor > 0 && (!std::isfinite(loss) || loss > pruneFactor*zeroLoss)) {
+			run->pruned = 1;
+			break;
+		}
+	}
+	free(x);
+	if (xi != NULL) {
+		free(xi);
+		free(aiq1);
+	}
+}
+
+void* sgd_sweep::worker_main(void* arg) {
+	sgd_sweep* sweep = (sgd_sweep*)arg;
+	while (1) {
+		uint32_t r = sweep->nextRun.fetch_add(1);
+		if (r >= sweep->numRuns)
+			break;
+		sweep->train(sweep->runs + r);
+	}
+	return NULL;
+}
+
+char sgd_sweep::run(uint32_t _numFolds, uint32_t numThreads, float _pruneFactor, uint32_t seed) {
+	if (app->a == NULL) {
+		cout << "The sweep needs dense data in a" << endl;
+		return 0;
+	}
+	for (uint32_t c = 0; c < numConfigs; c++) {
+		int bits = configs[c].quantizationBits;
+		if (bits < 0 || bits > 8) {
+			cout << "Configuration " << c << ": only 0 (float) to 8 bit quantization" << endl;
+			return 0;
+		}
+	}
+	free_runs();
+	numFolds = (_numFolds == 0) ? 1 : _numFolds;
+	if (numFolds > app->numSamples)
+		numFolds = app->numSamples;
+	pruneFactor = _pruneFactor;
+
+	// Fisher-Yates over the samples for the folds, identity without them
+	order = (uint32_t*)malloc(app->numSamples*sizeof(uint32_t));
+	for (uint32_t i = 0; i < app->numSamples; i++) {
+		order[i] = i;
+	}
+	if (numFolds > 1) {
+		for (uint32_t i = app->numSamples-1; i > 0; i--) {
+			uint32_t k = counter_rng(seed, i)%(i+1);
+			uint32_t temp = order[i];
+			order[i] = order[k];
+			order[k] = temp;
+		}
+	}
+
+	numRuns = numConfigs*numFolds;
+	runs = (sweep_run*)malloc(numRuns*sizeof(sweep_run));
+	for (uint32_t c = 0; c < numConfigs; c++) {
+		for (uint32_t f = 0; f < numFolds; f++) {
+			sweep_run* run = runs + c*numFolds + f;
+			run->config = c;
+			run->fold = f;
+			run->epochsRun = 0;
+			run->pruned = 0;
+			run->losses = (float*)malloc(configs[c].numEpochs*sizeof(float));
+			run->seconds = (double*)malloc(configs[c].numEpochs*sizeof(double));
+		}
+	}
+
+	if (numThreads == 0)
+		numThreads = app->numCPUThreads;
+	if (numThreads > numRuns)
+		numThreads = numRuns;
+	cout << "Sweep: " << numConfigs << " configurations, " << numFolds << " folds, " << numRuns << " runs on " << numThreads << " threads" << endl;
+
+	double start = get_time();
+	nextRun = 0;
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_create(&threads[t], NULL, worker_main, this);
+	worker_main(this);
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_join(threads[t], NULL);
+	free(threads);
+
+	uint32_t numPruned = 0;
+	for (uint32_t r = 0; r < numRuns; r++) {
+		numPruned += runs[r].pruned;
+	}
+	cout << "Sweep took " << get_time()-start << " s, pruned runs: " << numPruned << endl;
+	return 1;
+}
+
+char sgd_sweep::write_summary(char* pathToFile) {
+	FILE* f = fopen(pathToFile, "w");
+	if (f == NULL) {
+		cout << "Unable to open file " << pathToFile << endl;
+		return 0;
+	}
+	size_t length = strlen(pathToFile);
+	char json = (length >= 5 && strcmp(pathToFile + length-5, ".json") == 0);
+
+	if (json)
+		fprintf(f, "[\n");
+	else
+		fprintf(f, "config,quantization_bits,step_size_shifter,fold,epoch,seconds,loss,pruned\n");
+	char first = 1;
+	for (uint32_t r = 0; r < numRuns; r++) {
+		const sweep_run& run = runs[r];
+		const sweep_config& config = configs[run.config];
+		for (uint32_t epoch = 0; epoch < run.epochsRun; epoch++) {
+			char pruned = (run.pruned == 1 && epoch+1 == run.epochsRun);
+			if (json) {
+				fprintf(f, "%s  {\"config\": %u, \"quantization_bits\": %d, \"step_size_shifter\": %d, \"fold\": %u, \"epoch\": %u, \"seconds\": %.6f, ",
+					first ? "" : ",\n", run.config, config.quantizationBits, config.stepSizeShifter, run.fold, epoch, run.seconds[epoch]);
+				// JSON has no literal for the losses of diverged runs
+				if (std::isfinite(run.losses[epoch]))
+					fprintf(f, "\"loss\": %.9g, \"pruned\": %s}", run.losses[epoch], pruned ? "true" : "false");
+				else
+					fprintf(f, "\"loss\": null, \"pruned\": %s}", pruned ? "true" : "false");
+			}
+			else {
+				fprintf(f, "%u,%d,%d,%u,%u,%.6f,%.9g,%d\n", run.config, config.quantizationBits, config.stepSizeShifter, run.fold, epoch, run.seconds[epoch], run.losses[epoch], pruned);
+			}
+			first = 0;
+		}
+	}
+	if (json)
+		fprintf(f, "\n]\n");
+	char success = (ferror(f) == 0);
+	if (fclose(f) != 0 || success == 0) {
+		cout << "Writing " << pathToFile << " failed" << endl;
+		return 0;
+	}
+	cout << "Wrote the sweep summary to " << pathToFile << endl;
+	return 1;
+}
+
+void sgd_sweep::print_summary(float targetLoss) {
+	int best = -1;
+	double bestLoss = 0;
+	for (uint32_t c = 0; c < numConfigs; c++) {
+		double finalLoss = 0;
+		double timeToTarget = 0;
+		uint32_t numReached = 0;
+		uint32_t numPruned = 0;
+		for (uint32_t f = 0; f < numFolds; f++) {
+			const sweep_run& run = runs[c*numFolds + f];
+			numPruned += run.pruned;
+			if (run.epochsRun > 0)
+				finalLoss += run.losses[run.epochsRun-1];
+			for (uint32_t epoch = 0; epoch < run.epochsRun; epoch++) {
+				if (run.losses[epoch] <= targetLoss) {
+					timeToTarget += run.seconds[epoch];
+					numReached++;
+					break;
+				}
+			}
+		}
+		finalLoss /= numFolds;
+		cout << "bits: " << configs[c].quantizationBits << ", stepSizeShifter: " << configs[c].stepSizeShifter << ", epochs: " << configs[c].numEpochs;
+		cout << ", loss: " << finalLoss;
+		if (numReached == numFolds)
+			cout << ", time to " << targetLoss << ": " << timeToTarget/numFolds << " s";
+		else
+			cout << ", " << targetLoss << " not reached";
+		if (numPruned > 0)
+			cout << ", pruned folds: " << numPruned;
+		cout << endl;
+		if (numPruned == 0 && std::isfinite(finalLoss) && (best == -1 || finalLoss < bestLoss)) {
+			best = c;
+			bestLoss = finalLoss;
+		}
+	}
+	if (best != -1)
+		cout << "Best: bits: " << configs[best].quantizationBits << ", stepSizeShifter: " << configs[best].stepSizeShifter << ", loss: " << bestLoss << endl;
+}
+
+#endif
@@ -0,0 +1,83 @@
+// Copyright (C) 2017 Kaan Kara - Systems Group, ETH Zurich
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//*************************************************************************
+
+// Two asynchronous jobs submitted back to back must each train exactly as if
+// it ran alone: the second submission may not touch the CSRs, the workspace
+// or the epoch sentinels of the first while it runs. The second job trains
+// for enough epochs that its output grows the workspace, which reprograms the
+// page tables; the first trains for fewer epochs, so that its last model
+// survives in the output. The reference runs come after the asynchronous ones,
+// when the workspace has its final size.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "zipml_sgd.h"
+
+using namespace std;
+
+#define VALUE_TO_INT_SCALER 0x00800000
+#define NUM_VALUES_PER_LINE 16
+
+#define NUM_SAMPLES 512
+#define NUM_FEATURES 64
+#define FIRST_EPOCHS 2000
+#define SECOND_EPOCHS 16384 // x 5 cache lines per model > one 4 MB page
+
+static char check(const char* name, const float* x, const float* expected) {
+	if (memcmp(x, expected, NUM_FEATURES*sizeof(float)) == 0)
+		return 1;
+	cout << "FAIL: " << name << " differs from the job run alone" << endl;
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	zipml_sgd app(1, VALUE_TO_INT_SCALER, NUM_VALUES_PER_LINE);
+	app.generate_synthetic_data(NUM_SAMPLES, NUM_FEATURES, 0);
+	app.a_normalize(0, 'c');
+	app.b_normalize(0, 0, 0.0);
+	app.numCacheLines = app.copy_data_into_FPGA_memory();
+
+	float x1[NUM_FEATURES], x2[NUM_FEATURES];
+	float expected1[NUM_FEATURES], expected2[NUM_FEATURES];
+	uint64_t job1 = app.floatFSGD_async(FIRST_EPOCHS, 1.0/(1 << 9), 0, 0.0);
+	SleepNano(1000000); // Let it start, on a single core too
+	uint64_t job2 = app.floatFSGD_async(SECOND_EPOCHS, 1.0/(1 << 5), 0, 0.0);
+	app.FSGD_collect(x2, job2, SECOND_EPOCHS, 0);
+	// job2 overwrote the first epochs, not the last one of job1
+	app.FSGD_collect(x1, job1, FIRST_EPOCHS, 0);
+	app.floatFSGD(expected1, FIRST_EPOCHS, 1.0/(1 << 9), 0, 0.0);
+	app.floatFSGD(expected2, SECOND_EPOCHS, 1.0/(1 << 5), 0, 0.0);
+	char success = check("floatFSGD job 1", x1, expected1) & check("floatFSGD job 2", x2, expected2);
+
+	app.numCacheLines = app.copy_data_into_FPGA_memory_after_quantization(4, 1, 0);
+	job1 = app.qFSGD_async(FIRST_EPOCHS, 9, 4, 0, 0);
+	SleepNano(1000000); // Let it start, on a single core too
+	job2 = app.qFSGD_async(SECOND_EPOCHS/2, 5, 4, 0, 0);
+	app.FSGD_collect(x2, job2, SECOND_EPOCHS/2, 4);
+	app.FSGD_collect(x1, job1, FIRST_EPOCHS, 4);
+	app.qFSGD(expected1, FIRST_EPOCHS, 9, 4, 0, 0);
+	app.qFSGD(expected2, SECOND_EPOCHS/2, 5, 4, 0, 0);
+	success &= check("qFSGD job 1", x1, expected1) & check("qFSGD job 2", x2, expected2);
+
+	if (app.interfaceFPGA->m_AFUService->numLiveWrites != 0) {
+		cout << "FAIL: " << app.interfaceFPGA->m_AFUService->numLiveWrites << " CSR writes reached a running job" << endl;
+		success = 0;
+	}
+	cout << (success ? "PASS" : "FAIL") << endl;
+	return success ? 0 : 1;
+}
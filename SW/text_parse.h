@@ -0,0 +1,136 @@
+// Copyright (C) 2017 Kaan Kara - Systems Group, ETH Zurich
+
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Affero General Public License as published
+// by the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Affero General Public License for more details.
+
+// You should have received a copy of the GNU Affero General Public License
+// along with this program. If not, see <http://www.gnu.org/licenses/>.
+//*************************************************************************
+
+#ifndef TEXT_PARSE
+#define TEXT_PARSE
+
+#include <stdint.h>
+#include <math.h>
+
+// In-place parsing of numbers from a mapped text file. None of the functions
+// need a terminating '\0': they stop at end, and return the position after the
+// parsed token (the input position if there was nothing to parse).
+
+static inline const char* parse_skip_blanks(const char* p, const char* end) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+		p++;
+	return p;
+}
+
+static inline const char* parse_skip_line(const char* p, const char* end) {
+	while (p < end && *p != '\n')
+		p++;
+	return p < end ? p+1 : end;
+}
+
+static inline const char* parse_uint(const char* p, const char* end, uint32_t* value) {
+	uint32_t result = 0;
+	while (p < end && *p >= '0' && *p <= '9') {
+		result = result*10 + (*p - '0');
+		p++;
+	}
+	*value = result;
+	return p;
+}
+
+static inline const char* parse_int(const char* p, const char* end, int32_t* value) {
+	char negative = 0;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = (*p == '-');
+		p++;
+	}
+	uint32_t magnitude;
+	const char* q = parse_uint(p, end, &magnitude);
+	*value = negative ? -(int32_t)magnitude : (int32_t)magnitude;
+	return q;
+}
+
+// [+-]digits[.digits][(e|E)[+-]digits]. The first 19 significant digits are
+// kept exactly, the result is rounded once to double and then to float.
+static inline const char* parse_float(const char* p, const char* end, float* value) {
+	static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	const char* start = p;
+	char negative = 0;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = (*p == '-');
+		p++;
+	}
+	uint64_t mantissa = 0;
+	int32_t exponent = 0;
+	uint32_t numDigits = 0;
+	uint32_t numSignificant = 0;
+	while (p < end && *p >= '0' && *p <= '9') {
+		if (numSignificant < 19) {
+			mantissa = mantissa*10 + (*p - '0');
+			if (mantissa > 0)
+				numSignificant++;
+		}
+		else
+			exponent++;
+		numDigits++;
+		p++;
+	}
+	if (p < end && *p == '.') {
+		p++;
+		while (p < end && *p >= '0' && *p <= '9') {
+			if (numSignificant < 19) {
+				mantissa = mantissa*10 + (*p - '0');
+				if (mantissa > 0)
+					numSignificant++;
+				exponent--;
+			}
+			numDigits++;
+			p++;
+		}
+	}
+	if (numDigits == 0) {
+		*value = 0;
+		return start;
+	}
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		int32_t e;
+		const char* q = parse_int(p+1, end, &e);
+		if (q > p+1 && q[-1] >= '0' && q[-1] <= '9') {
+			exponent += e;
+			p = q;
+		}
+	}
+	double result = (double)mantissa;
+	if (exponent < 0)
+		result = (exponent >= -22) ? result/powers[-exponent] : result*pow(10.0, exponent);
+	else if (exponent > 0)
+		result = (exponent <= 22) ? result*powers[exponent] : result*pow(10.0, exponent);
+	*value = (float)(negative ? -result : result);
+	return p;
+}
+
+// Splits [begin, begin+size) into numChunks ranges that start at line
+// beginnings: chunk c is [begin+offsets[c], begin+offsets[c+1]).
+static inline void text_split_lines(const char* begin, uint64_t size, uint32_t numChunks, uint64_t offsets[]) {
+	offsets[0] = 0;
+	for (uint32_t c = 1; c < numChunks; c++) {
+		uint64_t offset = size*c/numChunks;
+		if (offset < offsets[c-1])
+			offset = offsets[c-1];
+		if (offset > 0)
+			offset = parse_skip_line(begin + offset-1, begin + size) - begin;
+		offsets[c] = offset;
+	}
+	offsets[numChunks] = size;
+}
+
+#endif
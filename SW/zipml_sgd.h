@@ -22,24 +22,340 @@
 #include <fstream>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <vector>
 #include <limits>
 #include <cmath>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "iFPGA.h"
+#include "sgd_kernels.h"
+#include "fpga_dataset.h"
+#include "text_parse.h"
+#include "model_file.h"
 
 using namespace std;
 
+struct hogwild_args {
+	float* a;
+	float* b;
+	float* x;
+	float* x_history;
+	uint32_t numFeatures;
+	uint32_t numEpochs;
+	uint32_t firstSample;
+	uint32_t lastSample;
+	float stepSize;
+	char atomicUpdates;
+	pthread_barrier_t* barrier;
+};
+
+struct spin_barrier {
+	std::atomic<uint32_t> count;
+	std::atomic<uint32_t> generation;
+	uint32_t numThreads;
+};
+
+static void spin_barrier_wait(spin_barrier* barrier) {
+	uint32_t generation = barrier->generation.load(std::memory_order_acquire);
+	if (barrier->count.fetch_add(1, std::memory_order_acq_rel) + 1 == barrier->numThreads) {
+		barrier->count.store(0, std::memory_order_relaxed);
+		barrier->generation.fetch_add(1, std::memory_order_release);
+	}
+	else {
+		uint32_t spins = 0;
+		while (barrier->generation.load(std::memory_order_acquire) == generation) {
+			if (++spins > 1000)
+				sched_yield();
+		}
+	}
+}
+
+#define MINIBATCH_GRADIENT_STRIDE 16 // Per-thread gradients start on their own cache line
+
+struct minibatch_args {
+	float* a;
+	float* b;
+	float* x;
+	float* x_history;
+	float* loss_history;
+	float* gradients;		// numThreads gradients, gradientStride floats apart
+	uint32_t gradientStride;
+	uint32_t numFeatures;
+	uint32_t numSamples;
+	uint32_t numEpochs;
+	uint32_t minibatchSize;
+	uint32_t id;
+	uint32_t numThreads;
+	float stepSize;
+	double loss;			// Progressive loss of this thread's samples in the epoch
+	minibatch_args* all;	// args of all threads, for thread 0 to sum the losses
+	spin_barrier* barrier;
+};
+
+#define RAW_CHUNK_BYTES 4194304 // load_raw_data reads whole rows up to this much at once
+
+#define INGEST_BLOCK_BYTES 262144 // ingest_raw_data hands whole rows up to this much between stages
+#define INGEST_DONE 0xFFFFFFFF // Queued once per worker after the last block
+
+// Bounded FIFO of block ids between the ingest stages
+struct ingest_queue {
+	uint32_t* ids;
+	uint32_t capacity;
+	uint32_t head;
+	uint32_t count;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+};
+
+static void ingest_queue_init(ingest_queue* queue, uint32_t capacity) {
+	queue->ids = (uint32_t*)malloc(capacity*sizeof(uint32_t));
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->changed, NULL);
+}
+
+static void ingest_queue_destroy(ingest_queue* queue) {
+	free(queue->ids);
+	pthread_mutex_destroy(&queue->lock);
+	pthread_cond_destroy(&queue->changed);
+}
+
+static void ingest_queue_push(ingest_queue* queue, uint32_t id) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == queue->capacity)
+		pthread_cond_wait(&queue->changed, &queue->lock);
+	queue->ids[(queue->head + queue->count)%queue->capacity] = id;
+	queue->count++;
+	pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static uint32_t ingest_queue_pop(ingest_queue* queue) {
+	pthread_mutex_lock(&queue->lock);
+	while (queue->count == 0)
+		pthread_cond_wait(&queue->changed, &queue->lock);
+	uint32_t id = queue->ids[queue->head];
+	queue->head = (queue->head + 1)%queue->capacity;
+	queue->count--;
+	pthread_cond_broadcast(&queue->changed);
+	pthread_mutex_unlock(&queue->lock);
+	return id;
+}
+
+struct ingest_block {
+	char* raw;			// Rows as in the file: label, then the features
+	uint32_t firstSample;
+	uint32_t numRows;
+};
+
+struct ingest_args {
+	ingest_block* blocks;
+	ingest_queue* filled;	// Read by the reader, to be processed
+	ingest_queue* emptied;	// Processed, to be refilled
+	char scan;				// 1: pre-scan, only collect the statistics
+	uint32_t elementSize;
+	uint32_t numFeatures;
+	uint32_t numSamples;
+	float* a;
+	float* b;
+	int* bi;
+	uint32_t b_toIntegerScaler;
+	// a: 'r' row-wise, 'c' column-wise with the factors of scale_columns, else none
+	char rowOrColumnWise;
+	char a_toMinus1_1;
+	const float* offset;
+	const float* range;
+	const float* mul;
+	const float* add;
+	// b: ((b - b_offset)/b_range)*b_mul + b_add if normalize_b
+	char normalize_b;
+	float b_offset;
+	float b_range;
+	float b_mul;
+	float b_add;
+	// Pre-scan partials of this thread
+	float* amin;			// [numFeatures]
+	float* amax;
+	float bmin;
+	float bmax;
+	// Output: the float layout (quantizationBits 0) or numberOfIndices packed indices
+	int quantizationBits;
+	uint32_t numberOfIndices;
+	const uint32_t* streamKeys;	// [2*numberOfIndices]
+	float scale;
+	uint32_t rowWords;
+	iFPGA* fpga;
+};
+
+#define QFIXED_PARTIAL_STRIDE 16 // One cache line per partial dot product
+
+struct qfixed_args {
+	int32_t* xi;
+	int* aiq1;
+	int* aiq2;
+	int* bi;
+	uint32_t numFeatures;
+	uint32_t numSamples;
+	uint32_t firstFeature;
+	uint32_t lastFeature;
+	uint32_t id;
+	uint32_t numThreads;
+	int numBitsToShift;
+	int stepSizeShifter;
+	int32_t* partial_dot;	// [2][numThreads*QFIXED_PARTIAL_STRIDE]
+	spin_barrier* barrier;
+	// Packed layout, used instead of aiq1/aiq2/bi if not NULL
+	uint32_t* packed;
+	uint32_t rowWords;
+	int quantizationBits;
+	double loss;	// Thread 0 only: sum of squared errors, in b_toIntegerScaler units
+};
+
+// Shared by the libsvm and tsv loaders
+struct text_load_args {
+	const char* begin;	// Chunk of the mapped file, starting at a line
+	const char* end;
+	float* a;
+	float* b;
+	int* bi;
+	uint32_t numFeatures;	// 0 in the first pass: find maxColumn
+	uint32_t numSamples;	// 0 in the first pass: find maxSample (tsv only)
+	uint32_t firstSample;
+	uint32_t numLines;
+	uint32_t maxColumn;
+	uint32_t maxSample;
+	uint32_t b_toIntegerScaler;
+	// Sparse libsvm loading: values per chunk, and the chunk's CSR output
+	char countValues;
+	uint64_t numValues;
+	uint64_t firstValue;
+	float* values;
+	uint32_t* columns;
+	uint64_t* row_ptr;
+};
+
+struct classify_args {
+	const float* a;
+	uint32_t numFeatures;
+	uint32_t firstSample;
+	uint32_t lastSample;
+	uint32_t numClasses;
+	uint32_t numModels;			// numClasses padded to a multiple of 4
+	uint32_t ldw;				// Row stride of the packed models
+	const float* w;				// [numModels*ldw], float mode
+	const int8_t* w8;			// [numModels*ldw], int8 mode if not NULL
+	const float* w8_scale;
+	const int32_t* w8_sum;
+	int* predictions;			// Best class per sample, if not NULL
+	float* result;				// Otherwise the score of class 0
+	// CSR samples, used instead of a if row_ptr is not NULL (float mode only)
+	const float* values;
+	const uint32_t* columns;
+	const uint64_t* row_ptr;
+};
+
+struct loss_args {
+	const float* a;
+	const float* b;
+	const float* xs;
+	uint32_t numFeatures;
+	uint32_t numModels;
+	uint32_t firstSample;
+	uint32_t lastSample;
+	double* partial_loss;	// [numModels]
+	// CSR samples, used instead of a if row_ptr is not NULL
+	const float* values;
+	const uint32_t* columns;
+	const uint64_t* row_ptr;
+};
+
+struct normalize_args {
+	float* a;
+	uint32_t numFeatures;
+	uint32_t firstSample;
+	uint32_t lastSample;
+	char rowOrColumnWise;
+	char toMinus1_1;
+	char scale;		// Column mode: 0 collects amin/amax, 1 applies the factors
+	float* amin;	// Column mode: [numFeatures] partials of this thread
+	float* amax;
+	const float* offset;	// Column mode: [numFeatures] factors, see scale_columns
+	const float* range;
+	const float* mul;
+	const float* add;
+};
+
+struct quantize_args {
+	float* a;
+	int* aiq;
+	uint32_t numFeatures;
+	uint32_t numSamples;
+	float scale;
+	char toMinus1_1;
+	uint32_t seed;
+	uint32_t firstStream;
+	uint64_t firstRow;	// Rows of all copies, numCopies*numSamples in total
+	uint64_t lastRow;
+	// CSR: a holds the values, copy c of row i goes to aiq + c*nnz + row_ptr[i]
+	const uint32_t* columns;
+	const uint64_t* row_ptr;
+	uint64_t nnz;
+};
+
 class zipml_sgd {
 private:
 	uint32_t page_size_in_cache_lines;
 	uint32_t pages_to_allocate;
 
+	// Text loaders: map a file and split it into one chunk per thread
+	const char* map_text_file(char* pathToFile, uint64_t* size);
+	text_load_args* split_text_file(const char* file, uint64_t size, uint32_t* numThreads);
+	// Raw loaders: open a file of rows of elementType values
+	FILE* open_raw_file(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures, char elementType, uint32_t* elementSize);
+
+	// Loads the qFSGD design and writes the CSRs of a job, without submitting it.
+	// Returns 0 if the workspace is too small
+	char configure_qFSGD(uint32_t numEpochs, int stepSizeShifter, int quantizationBits, int binarize_b, int bi_toBinarizeTo);
+	// Shared by Qfixed_linreg_SGD (packed == NULL) and Qpacked_linreg_SGD
+	void Qfixed_train(float x_history[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, uint32_t numThreads, uint32_t* packed, uint32_t numberOfPackedIndices, float loss_history[]);
+
+	// Shared by inference and multi_classification
+	double classify(float* xs[], uint32_t numClasses, char useInt8, int predictions[], float result[]);
+
+	// Presets the last line of every epoch model in the output to all ones
+	void mark_epoch_models(uint32_t numEpochs, int quantizationBits);
+	// Whether the last line of epoch's model has replaced its sentinel
+	char epoch_model_written(uint32_t epoch, int quantizationBits);
+	void read_epoch_models(float xs[], uint32_t firstEpoch, uint32_t numModels, int quantizationBits);
+
+	// Chunked FPGA training (floatFSGD_chunked, qFSGD_chunked)
+	void prepare_chunk(uint32_t staging[], int quantizationBits, uint32_t firstSample, uint32_t count, uint32_t address32);
+	void patch_chunk_labels(float x[], int quantizationBits, uint32_t firstSample, uint32_t count, uint32_t address32);
+	void run_chunks(float x[], uint32_t numEpochs, float stepSize, int stepSizeShifter, int quantizationBits, uint32_t chunkSamples);
+
 public:
 	float* a;	// Data set features matrix: numSamples x numFeatures
 	float* b;	// Data set labels vector: numSamples
 	int* bi;	// Integer version of b
 
+	// Sparse (CSR) mode, with a == NULL (see load_libsvm_data_sparse): row i has
+	// the values csr_values[csr_row_ptr[i], csr_row_ptr[i+1]) at the columns
+	// csr_columns[...]. SGD, losses and inference work on it; everything else
+	// (normalization, FPGA layouts) needs sparse_to_dense() first
+	float* csr_values;
+	uint32_t* csr_columns;
+	uint64_t* csr_row_ptr;	// numSamples+1
+	uint64_t csr_nnz;
+
 	uint32_t numberOfIndices;
 
 	uint32_t numFeatures;
@@ -59,18 +375,55 @@ public:
 	float b_min;
 	uint32_t b_toIntegerScaler;
 
+	float* column_min;	// Per-column min/max of a, as stored in the last loaded FPGA dataset file
+	float* column_max;
+
+	uint32_t numCPUThreads;
+	uint32_t quantizationSeed;
+	uint32_t quantizationStream; // Random stream of the next quantized copy
+
 	zipml_sgd(char getFPGA, uint32_t _b_toIntegerScaler, uint32_t _numValuesPerLine);
 	~zipml_sgd();
 
 	float calculate_loss(float x[]);
+	// Losses of numModels models stored one after the other in xs, all evaluated
+	// in the same pass over a, split over numCPUThreads threads
+	void calculate_losses(float losses[], const float* xs, uint32_t numModels);
 
 	// Data loading functions
 	void load_tsv_data(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures);
 	void load_libsvm_data(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures);
-	void load_raw_data(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures);
+	// Same as load_libsvm_data (bias term included), into CSR instead of a
+	void load_libsvm_data_sparse(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures);
+	void sparse_to_dense();
+	char is_sparse() { return a == NULL && csr_row_ptr != NULL; }
+	// Returns 1 with dense data in a, else prints that caller needs it and returns 0
+	char require_dense(const char* caller);
+	// Rows of the label and then the features, all elementType ('d' double, 'f' float)
+	void load_raw_data(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures, char elementType = 'd');
+	// load_raw_data, a_normalize (rowOrColumnWise 'r' or 'c', 0: none), b_normalize
+	// (if normalize_b) and copy_data_into_FPGA_memory_after_quantization (or
+	// copy_data_into_FPGA_memory if quantizationBits is 0) fused into one pipelined
+	// pass over the file, plus a pre-scan for the statistics of column-wise or b
+	// normalization. The result is the same as running them one after the other.
+	// Returns the cache lines per index, 0 on failure
+	uint32_t ingest_raw_data(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures, char rowOrColumnWise, char a_toMinus1_1, char normalize_b, char b_toMinus1_1, int quantizationBits, int _numberOfIndices, char elementType = 'd');
 	void generate_synthetic_data(uint32_t _numSamples, uint32_t _numFeatures, char binary);
 
+	// FPGA dataset files (see fpga_dataset.h): the float layout plus numberOfIndices
+	// quantized copies for each of the numWidths widths in quantizationBits[]. Only
+	// saves quantized copies if a is normalized (see a_normalize)
+	char save_fpga_dataset(char* pathToFile, const int quantizationBits[], uint32_t numWidths, int _numberOfIndices);
+	// Restores a, b, bi, column_min and column_max, copies the section for
+	// quantizationBits (0: float) into the FPGA workspace if there is one.
+	// Returns numCacheLines, 0 on failure
+	uint32_t load_fpga_dataset(char* pathToFile, int quantizationBits);
+	// Exports numClasses trained models (1: regression) for model_server
+	char save_models(char* pathToFile, float* xs[], uint32_t numClasses);
+
 	void print_samples(uint32_t num) {
+		if (require_dense("print_samples") == 0)
+			return;
 		for (uint32_t i = 0; i < num; i++) {
 			cout << "a" << i << ": " << endl;
 			for (uint32_t j = 0; j < numFeatures; j++) {
@@ -87,45 +440,121 @@ public:
 
 	// Return how many cache lines needed
 	uint32_t copy_data_into_FPGA_memory();
+	// Grows the FPGA workspace to hold numInputCacheLines and numOutputCacheLines,
+	// usedInputBytes of the input being data rather than padding. Returns 0 if
+	// the workspace cannot be made large enough
+	char reserve_workspace(uint64_t numInputCacheLines, uint64_t numOutputCacheLines, uint64_t usedInputBytes);
 	uint32_t copy_data_into_FPGA_memory_after_quantization(int quantizationBits, int _numberOfIndices, uint32_t address32offset);
 	uint32_t get_number_of_CLs_needed_for_one_index(int quantizationBits);
+	// Quantize, pack and write one index at address32, return how many 32-bit words written
+	uint32_t copy_quantized_index_into_FPGA_memory(int quantizationBits, uint32_t address32);
+	// Cache lines the FPGA writes per epoch for the model
+	uint32_t get_number_of_CLs_for_x(int quantizationBits);
+	// Pack one quantization index in the qFSGD layout, return how many 32-bit words written
+	uint32_t get_number_of_words_per_packed_row(int quantizationBits);
+	uint32_t pack_quantized_data(uint32_t packed[], int aiq1[], int aiq2[], int quantizationBits);
 
 	// Quantization function
-	void quantize_data_integer(int aiq[], uint32_t numBits);
+	// Quantization function: fills numCopies consecutive numSamples x numFeatures
+	// arrays, each with the next random stream, on numCPUThreads threads
+	// In sparse mode aiq holds numCopies*csr_nnz values, see quantize_args
+	void quantize_data_integer(int aiq[], uint32_t numBits, uint32_t numCopies = 1);
 
 	// Linear Regression
-	void float_linreg_SGD(float x_history[], uint32_t numEpochs, float stepSize);
-	void Qfixed_linreg_SGD(float x_history[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits);
+	// With loss_history[numEpochs], also return the progressive training loss of
+	// each epoch: the error of every sample against the model before its update
+	void float_linreg_SGD(float x_history[], uint32_t numEpochs, float stepSize, float loss_history[] = NULL);
+	void Qfixed_linreg_SGD(float x_history[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, uint32_t numThreads = 1, float loss_history[] = NULL);
+	// Same as Qfixed_linreg_SGD, but trains on _numberOfIndices quantizations kept in the packed FPGA layout
+	void Qpacked_linreg_SGD(float x_history[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, int _numberOfIndices, uint32_t numThreads = 1, float loss_history[] = NULL);
+	// Hogwild! SGD: numThreads (0: all cores) share x without locks. Returns samples/s
+	double float_linreg_SGD_hogwild(float x_history[], uint32_t numEpochs, float stepSize, uint32_t numThreads, char atomicUpdates);
+	// Mini-batch SGD: x -= stepSize*(sum of the batch's gradients). numThreads (0:
+	// all cores) split every batch, their gradients are tree-reduced. Returns samples/s
+	double float_linreg_SGD_minibatch(float x_history[], uint32_t numEpochs, float stepSize, uint32_t minibatchSize, uint32_t numThreads, float loss_history[] = NULL);
+	// SGD on the CSR data, O(nnz) per sample. lambda adds L2 regularization,
+	// applied lazily: x is kept as scale*v, so decaying x only changes scale
+	void float_linreg_SGD_sparse(float x_history[], uint32_t numEpochs, float stepSize, float lambda = 0, float loss_history[] = NULL);
+	// Qfixed_linreg_SGD on the CSR data: only the nonzeros are quantized
+	// (identically to the dense quantization) and touched. a_normalize cannot
+	// run on CSR data, so the values are quantized as loaded: they should
+	// already lie in [0,1] (or [-1,1] with a_normalizedToMinus1_1)
+	void Qfixed_linreg_SGD_sparse(float x_history[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, float loss_history[] = NULL);
 
 	// FPGA-based SGD (solves either linear regression of L2 SVM, depending on what is loaded)
 	void floatFSGD(float x[], uint32_t numEpochs, float stepSize, int binarize_b, float b_toBinarizeTo);
 	void qFSGD(float x[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, int binarize_b, int bi_toBinarizeTo);
+	// Asynchronous variants: start the job and return its handle, so that the
+	// host can work while the FPGA trains. FSGD_collect waits for the job (with
+	// the wait policy of interfaceFPGA) and reads the last epoch's model. The
+	// handle is 0 if the job could not be started. Submitting while a job runs
+	// first waits for it, before anything of the next job is set up
+	uint64_t floatFSGD_async(uint32_t numEpochs, float stepSize, int binarize_b, float b_toBinarizeTo);
+	uint64_t qFSGD_async(uint32_t numEpochs, int stepSizeShifter, int quantizationBits, int binarize_b, int bi_toBinarizeTo);
+	void FSGD_collect(float x[], uint64_t job, uint32_t numEpochs, int quantizationBits);
+	// Like FSGD_collect, and meanwhile evaluates the loss of every epoch's model
+	// (losses[numEpochs]) as soon as the FPGA has written it
+	void FSGD_collect_losses(float x[], float losses[], uint64_t job, uint32_t numEpochs, int quantizationBits);
+	// One-vs-all qFSGD for numClasses classes on the quantized data already in
+	// the workspace: class k separates bi == classLabels[k] (NULL: k*b_toIntegerScaler)
+	// from the rest. Each class's model is read back while the next one trains.
+	// Returns the total time, classTimes[numClasses] (optional) gets the time of each job
+	double qFSGD_multiclass(float* xs[], uint32_t numClasses, const int classLabels[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, double classTimes[] = NULL);
+	// qFSGD over a ring of ringSize quantized indices, refilled by the host while the FPGA trains
+	void qFSGD_ring(float x[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, int binarize_b, int bi_toBinarizeTo, uint32_t ringSize);
+
+	// Out-of-core variants for datasets larger than the workspace: chunks of
+	// chunkSamples rows are streamed through two workspace regions, one being
+	// filled while the FPGA trains on the other, and the model is carried over
+	// from chunk to chunk. Binarized labels are not supported. numberOfIndices
+	// and numCacheLines are kept, but the data in the workspace is overwritten:
+	// copy it in again before the next floatFSGD/qFSGD.
+	void floatFSGD_chunked(float x[], uint32_t numEpochs, float stepSize, uint32_t chunkSamples);
+	void qFSGD_chunked(float x[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, uint32_t chunkSamples);
 
 	// Calculate loss and log into file with detailed experiment information
-	void log_history(char SWorFPGA, char fileOutput, int quantizationBits, float stepSize, int numEpochs, double time, float* x_history);
-
-	// Perform inference
-	void inference(float result[], float* x);
-	void multi_classification(float* xs[], uint32_t numClasses);
+	// With loss_history (from the SW SGDs), logs those losses instead of evaluating x_history
+	void log_history(char SWorFPGA, char fileOutput, int quantizationBits, float stepSize, int numEpochs, double time, float* x_history, float* loss_history = NULL);
+
+	// Perform inference, multithreaded and cache-blocked over samples and models.
+	// With useInt8, models and samples are quantized to int8 (VNNI if available).
+	// Both return predictions/s
+	double inference(float result[], float* x, char useInt8 = 0);
+	double multi_classification(float* xs[], uint32_t numClasses, char useInt8 = 0, int predictions[] = NULL);
 };
 
 zipml_sgd::zipml_sgd(char getFPGA, uint32_t _b_toIntegerScaler, uint32_t _numValuesPerLine) {
 	srand(7);
 
 	page_size_in_cache_lines = 65536; // 65536 x 64B = 4 MB
-	pages_to_allocate = 1;
+	pages_to_allocate = 1; // Grown to fit the data by reserve_workspace
 
 	numValuesPerLine = _numValuesPerLine;
 
 	a = NULL;
 	b = NULL;
 	bi = NULL;
+	column_min = NULL;
+	column_max = NULL;
+	csr_values = NULL;
+	csr_columns = NULL;
+	csr_row_ptr = NULL;
+	csr_nnz = 0;
+
+	a_normalizedToMinus1_1 = 0;
+	b_normalizedToMinus1_1 = 0;
+	b_range = 1.0;
+	b_min = 0.0;
 
 	numFeatures = 0;
 	numSamples = 0;
 
 	b_toIntegerScaler = _b_toIntegerScaler;
 
+	numCPUThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	quantizationSeed = 7;
+	quantizationStream = 0;
+
 	if (getFPGA == 1) {
 		interfaceFPGA = new iFPGA(&runtimeClient, pages_to_allocate, page_size_in_cache_lines);
 		if(!runtimeClient.isOK()){
@@ -148,13 +577,148 @@ zipml_sgd::~zipml_sgd() {
 		free(b);
 	if (bi != NULL)
 		free(bi);
+	if (column_min != NULL)
+		free(column_min);
+	if (column_max != NULL)
+		free(column_max);
+	if (csr_row_ptr != NULL) {
+		free(csr_values);
+		free(csr_columns);
+		free(csr_row_ptr);
+	}
+}
+
+// Returns MAP_FAILED (after printing why) if pathToFile cannot be read
+const char* zipml_sgd::map_text_file(char* pathToFile, uint64_t* size) {
+	int fd = open(pathToFile, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		cout << "Unable to open file " << pathToFile << endl;
+		if (fd >= 0)
+			close(fd);
+		return (const char*)MAP_FAILED;
+	}
+	*size = st.st_size;
+	const char* file = NULL;
+	if (*size > 0) {
+		file = (const char*)mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (file == MAP_FAILED)
+			cout << "Unable to map file " << pathToFile << endl;
+		else
+			madvise((void*)file, *size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	return file;
+}
+
+// One chunk per thread, at least 64 KiB each, starting at line beginnings
+text_load_args* zipml_sgd::split_text_file(const char* file, uint64_t size, uint32_t* numThreads) {
+	*numThreads = numCPUThreads;
+	if (*numThreads > size/65536 + 1)
+		*numThreads = size/65536 + 1;
+	text_load_args* args = (text_load_args*)calloc(*numThreads, sizeof(text_load_args));
+	uint64_t* offsets = (uint64_t*)malloc((*numThreads+1)*sizeof(uint64_t));
+	text_split_lines(file, size, *numThreads, offsets);
+	for (uint32_t t = 0; t < *numThreads; t++) {
+		args[t].begin = file + offsets[t];
+		args[t].end = file + offsets[t+1];
+		args[t].b_toIntegerScaler = b_toIntegerScaler;
+	}
+	free(offsets);
+	return args;
 }
 
+static void* tsv_count_worker(void* arg) {
+	text_load_args* args = (text_load_args*)arg;
+	uint32_t maxSample = 0;
+	int32_t maxFeature = -1;
+	const char* p = args->begin;
+	while (p < args->end) {
+		uint32_t sample;
+		int32_t feature;
+		// Lines without a sample index (blank ones) are skipped by both passes
+		const char* first = parse_skip_blanks(p, args->end);
+		const char* q = parse_uint(first, args->end, &sample);
+		if (q > first) {
+			args->numLines++;
+			if (sample > maxSample)
+				maxSample = sample;
+			parse_int(parse_skip_blanks(q, args->end), args->end, &feature);
+			if (feature > maxFeature)
+				maxFeature = feature;
+		}
+		p = parse_skip_line(q, args->end);
+	}
+	args->maxSample = maxSample;
+	args->maxColumn = maxFeature+1;
+	return NULL;
+}
+
+// Triples of one sample may be anywhere in the file, so every thread scatters
+// into all of a; distinct triples never touch the same element
+static void* tsv_parse_worker(void* arg) {
+	text_load_args* args = (text_load_args*)arg;
+	const char* p = args->begin;
+	while (p < args->end) {
+		uint32_t sample;
+		int32_t feature;
+		float value;
+		const char* first = parse_skip_blanks(p, args->end);
+		const char* q = parse_uint(first, args->end, &sample);
+		if (q > first) {
+			q = parse_int(parse_skip_blanks(q, args->end), args->end, &feature);
+			q = parse_float(parse_skip_blanks(q, args->end), args->end, &value);
+			if (sample < args->numSamples) {
+				if (feature == -2) {
+					args->b[sample] = value;
+					args->bi[sample] = (int)(value*(float)args->b_toIntegerScaler);
+				}
+				else if (feature >= 0 && (uint32_t)feature+1 < args->numFeatures)
+					args->a[(uint64_t)sample*args->numFeatures + (feature+1)] = value;
+			}
+		}
+		p = parse_skip_line(q, args->end);
+	}
+	return NULL;
+}
+
+// Lines are sample<TAB>feature<TAB>value, feature -2 being the label.
+// _numSamples = 0 and _numFeatures = 0 are inferred from the largest sample and
+// feature indices. Parsed in parallel chunks of the mapped file, like libsvm.
 void zipml_sgd::load_tsv_data(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures) {
 	cout << "Reading " << pathToFile << endl;
+	double start = get_time();
+
+	uint64_t size;
+	const char* file = map_text_file(pathToFile, &size);
+	if (file == MAP_FAILED)
+		return;
+
+	uint32_t numThreads;
+	text_load_args* args = split_text_file(file, size, &numThreads);
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+
+	uint32_t numLines = 0;
+	if (_numSamples == 0 || _numFeatures == 0) {
+		// First pass: only the first two fields of each line
+		for (uint32_t t = 1; t < numThreads; t++)
+			pthread_create(&threads[t], NULL, tsv_count_worker, &args[t]);
+		tsv_count_worker(&args[0]);
+		for (uint32_t t = 1; t < numThreads; t++)
+			pthread_join(threads[t], NULL);
+	}
+	uint32_t maxSample = 0;
+	uint32_t maxColumn = 0;
+	for (uint32_t t = 0; t < numThreads; t++) {
+		numLines += args[t].numLines;
+		if (args[t].maxSample > maxSample)
+			maxSample = args[t].maxSample;
+		if (args[t].maxColumn > maxColumn)
+			maxColumn = args[t].maxColumn;
+	}
 
-	numSamples = _numSamples;
-	numFeatures = _numFeatures+1; // For the bias term
+	numSamples = (_numSamples == 0) ? ((numLines > 0) ? maxSample+1 : 0) : _numSamples;
+	numFeatures = (_numFeatures == 0) ? maxColumn+1 : _numFeatures+1; // For the bias term
 
 	accumulationCount = int(numFeatures/numValuesPerLine) + (numFeatures%numValuesPerLine > 0);
 	if (numFeatures%numValuesPerLine == 0)
@@ -172,35 +736,218 @@ void zipml_sgd::load_tsv_data(char* pathToFile, uint32_t _numSamples, uint32_t _
 		free(bi);
 	bi = (int*)calloc(numSamples, sizeof(int));
 
-	FILE* f;
-	f = fopen(pathToFile, "r");
-
-	uint32_t sample;
-	int32_t feature;
-	float value;
-	while(fscanf(f, "%d\t%d\t%f", &sample, &feature, &value) != EOF) {
-		if (feature == -2) {
-			b[sample] = value;
-			bi[sample] = (int)(value*(float)b_toIntegerScaler);
-		}
-		else
-			a[sample*numFeatures + (feature+1)] = value;
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].a = a;
+		args[t].b = b;
+		args[t].bi = bi;
+		args[t].numFeatures = numFeatures;
+		args[t].numSamples = numSamples;
 	}
-	fclose(f);
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_create(&threads[t], NULL, tsv_parse_worker, &args[t]);
+	tsv_parse_worker(&args[0]);
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_join(threads[t], NULL);
+
+	free(threads);
+	free(args);
+	if (size > 0)
+		munmap((void*)file, size);
 
 	for (uint32_t i = 0; i < numSamples; i++) { // Bias term
 		a[i*numFeatures] = 1.0;
 	}
 
+	double end = get_time();
 	cout << "numSamples: " << numSamples << endl;
 	cout << "numFeatures: " << numFeatures << endl;
+	cout << "Parsed " << size/1e6 << " MB in " << end-start << " s, " << size/1e6/(end-start) << " MB/s with " << numThreads << " threads" << endl;
+}
+
+// A line holds a sample if it has anything besides blanks and comments
+static inline char libsvm_is_sample(const char* p, const char* end) {
+	p = parse_skip_blanks(p, end);
+	return p < end && *p != '\n' && *p != '#';
+}
+
+static void* libsvm_count_worker(void* arg) {
+	text_load_args* args = (text_load_args*)arg;
+	uint32_t numLines = 0;
+	uint32_t maxColumn = 0;
+	uint64_t numValues = 0;
+	const char* p = args->begin;
+	while (p < args->end) {
+		if (libsvm_is_sample(p, args->end)) {
+			numLines++;
+			if (args->numFeatures == 0 || args->countValues == 1) {
+				numValues++; // Bias term
+				while (p < args->end && *p != '\n' && *p != '#') {
+					if (*p == ':') {
+						numValues++;
+						const char* q = p;
+						uint32_t column = 0;
+						uint32_t power = 1;
+						while (q > args->begin && q[-1] >= '0' && q[-1] <= '9') {
+							q--;
+							column += (*q - '0')*power;
+							power *= 10;
+						}
+						if (column > maxColumn)
+							maxColumn = column;
+					}
+					p++;
+				}
+			}
+		}
+		p = parse_skip_line(p, args->end);
+	}
+	args->numLines = numLines;
+	args->maxColumn = maxColumn;
+	args->numValues = numValues;
+	return NULL;
+}
+
+static void* libsvm_parse_worker(void* arg) {
+	text_load_args* args = (text_load_args*)arg;
+	uint32_t index = args->firstSample;
+	const char* p = args->begin;
+	while (p < args->end && index < args->numSamples) {
+		if (libsvm_is_sample(p, args->end)) {
+			float* row = args->a + (uint64_t)index*args->numFeatures;
+			float label;
+			p = parse_float(parse_skip_blanks(p, args->end), args->end, &label);
+			args->b[index] = label;
+			args->bi[index] = (int)(label*(float)args->b_toIntegerScaler);
+			while (1) {
+				p = parse_skip_blanks(p, args->end);
+				if (p == args->end || *p == '\n' || *p == '#')
+					break;
+				uint32_t column;
+				float value;
+				const char* q = parse_uint(p, args->end, &column);
+				if (q > p && q < args->end && *q == ':') {
+					p = parse_float(q+1, args->end, &value);
+					if (column < args->numFeatures)
+						row[column] = value;
+				}
+				else
+					p = q;
+				while (p < args->end && *p != ' ' && *p != '\t' && *p != '\n') // Skip malformed tokens
+					p++;
+			}
+			row[0] = 1.0; // Bias term
+			index++;
+		}
+		p = parse_skip_line(p, args->end);
+	}
+	return NULL;
+}
+
+// Writes the chunk's rows from firstValue on: the bias term, then the values
+// in file order. Columns 0 and >= numFeatures are dropped, and a column
+// repeated within a row keeps its last value like in the dense loader (the
+// sparse kernels scatter, they need distinct columns per row), so a chunk may
+// write fewer values than counted (numValues returns how many).
+static void* libsvm_parse_sparse_worker(void* arg) {
+	text_load_args* args = (text_load_args*)arg;
+	uint32_t index = args->firstSample;
+	uint64_t k = args->firstValue;
+	const char* p = args->begin;
+	while (p < args->end && index < args->numSamples) {
+		if (libsvm_is_sample(p, args->end)) {
+			float label;
+			p = parse_float(parse_skip_blanks(p, args->end), args->end, &label);
+			args->b[index] = label;
+			args->bi[index] = (int)(label*(float)args->b_toIntegerScaler);
+			args->row_ptr[index] = k;
+			args->values[k] = 1.0; // Bias term
+			args->columns[k] = 0;
+			k++;
+			uint32_t maxColumn = 0;
+			while (1) {
+				p = parse_skip_blanks(p, args->end);
+				if (p == args->end || *p == '\n' || *p == '#')
+					break;
+				uint32_t column;
+				float value;
+				const char* q = parse_uint(p, args->end, &column);
+				if (q > p && q < args->end && *q == ':') {
+					p = parse_float(q+1, args->end, &value);
+					if (column > 0 && column < args->numFeatures) {
+						// Increasing columns, the usual case, cannot repeat
+						uint64_t found = k;
+						if (column <= maxColumn) {
+							for (uint64_t r = args->row_ptr[index]+1; r < k; r++) {
+								if (args->columns[r] == column)
+									found = r;
+							}
+						}
+						if (found < k && value == 0) {
+							memmove(args->values + found, args->values + found+1, (k-found-1)*sizeof(float));
+							memmove(args->columns + found, args->columns + found+1, (k-found-1)*sizeof(uint32_t));
+							k--;
+						}
+						else if (found < k)
+							args->values[found] = value;
+						else if (value != 0) {
+							args->values[k] = value;
+							args->columns[k] = column;
+							k++;
+							if (column > maxColumn)
+								maxColumn = column;
+						}
+					}
+				}
+				else
+					p = q;
+				while (p < args->end && *p != ' ' && *p != '\t' && *p != '\n') // Skip malformed tokens
+					p++;
+			}
+			index++;
+		}
+		p = parse_skip_line(p, args->end);
+	}
+	args->numValues = k - args->firstValue;
+	return NULL;
 }
 
+// _numSamples = 0 and _numFeatures = 0 are inferred from the file: the number of
+// sample lines and the largest feature index. The file is mapped and split on
+// line boundaries over numCPUThreads threads, each parsing its lines in place.
 void zipml_sgd::load_libsvm_data(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures) {
 	cout << "Reading " << pathToFile << endl;
+	double start = get_time();
+
+	uint64_t size;
+	const char* file = map_text_file(pathToFile, &size);
+	if (file == MAP_FAILED)
+		return;
+
+	uint32_t numThreads;
+	text_load_args* args = split_text_file(file, size, &numThreads);
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].numFeatures = (_numFeatures == 0) ? 0 : _numFeatures+1;
+	}
 
-	numSamples = _numSamples;
-	numFeatures = _numFeatures+1; // For the bias term
+	// First pass: lines per chunk, so that each thread knows its first sample
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_create(&threads[t], NULL, libsvm_count_worker, &args[t]);
+	libsvm_count_worker(&args[0]);
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_join(threads[t], NULL);
+
+	uint32_t numLines = 0;
+	uint32_t maxColumn = 0;
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].firstSample = numLines;
+		numLines += args[t].numLines;
+		if (args[t].maxColumn > maxColumn)
+			maxColumn = args[t].maxColumn;
+	}
+
+	numSamples = (_numSamples == 0) ? numLines : _numSamples;
+	numFeatures = (_numFeatures == 0) ? maxColumn+1 : _numFeatures+1; // For the bias term
 
 	accumulationCount = int(numFeatures/numValuesPerLine) + (numFeatures%numValuesPerLine > 0);
 	if (numFeatures%numValuesPerLine == 0)
@@ -218,68 +965,93 @@ void zipml_sgd::load_libsvm_data(char* pathToFile, uint32_t _numSamples, uint32_
 		free(bi);
 	bi = (int*)calloc(numSamples, sizeof(int));
 
-	string line;
-	ifstream f(pathToFile);
-
-	uint32_t index = 0;
-	if (f.is_open()) {
-		while( index < numSamples ) {
-			getline(f, line);
-			int pos0 = 0;
-			int pos1 = 0;
-			int pos2 = 0;
-			int column = 0;
-			//while ( column < numFeatures-1 ) {
-			while ( pos2 < (int)line.length()+1 ) {
-				if (pos2 == 0) {
-					pos2 = line.find(" ", pos1);
-					float temp = stof(line.substr(pos1, pos2-pos1), NULL);
-					b[index] = temp;
-					bi[index] = (int)(temp*(float)b_toIntegerScaler);
-				}
-				else {
-					pos0 = pos2;
-					pos1 = line.find(":", pos1)+1;
-					pos2 = line.find(" ", pos1);
-					column = stof(line.substr(pos0+1, pos1-pos0-1));
-					if (pos2 == -1) {
-						pos2 = line.length()+1;
-						a[index*numFeatures + column] = stof(line.substr(pos1, pos2-pos1), NULL);
-					}
-					else
-						a[index*numFeatures + column] = stof(line.substr(pos1, pos2-pos1), NULL);
-				}
-			}
-			index++;
-		}
-		f.close();
+	// Second pass: parse in place into the rows of each chunk
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].a = a;
+		args[t].b = b;
+		args[t].bi = bi;
+		args[t].numFeatures = numFeatures;
+		args[t].numSamples = numSamples;
 	}
-	else
-		cout << "Unable to open file " << pathToFile << endl;
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_create(&threads[t], NULL, libsvm_parse_worker, &args[t]);
+	libsvm_parse_worker(&args[0]);
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_join(threads[t], NULL);
 
-	for (uint32_t i = 0; i < numSamples; i++) { // Bias term
+	for (uint32_t i = numLines; i < numSamples; i++) { // Bias term of samples missing from the file
 		a[i*numFeatures] = 1.0;
 	}
-	
+
+	free(threads);
+	free(args);
+	if (size > 0)
+		munmap((void*)file, size);
+
+	double end = get_time();
 	cout << "numSamples: " << numSamples << endl;
 	cout << "numFeatures: " << numFeatures << endl;
+	cout << "Parsed " << size/1e6 << " MB in " << end-start << " s, " << size/1e6/(end-start) << " MB/s with " << numThreads << " threads" << endl;
 }
 
-void zipml_sgd::load_raw_data(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures) {
+// Both passes as in load_libsvm_data; the first also counts the values of
+// each chunk, so that every thread writes its rows to its own CSR range.
+void zipml_sgd::load_libsvm_data_sparse(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures) {
 	cout << "Reading " << pathToFile << endl;
+	double start = get_time();
+
+	uint64_t size;
+	const char* file = map_text_file(pathToFile, &size);
+	if (file == MAP_FAILED)
+		return;
+
+	uint32_t numThreads;
+	text_load_args* args = split_text_file(file, size, &numThreads);
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].numFeatures = (_numFeatures == 0) ? 0 : _numFeatures+1;
+		args[t].countValues = 1;
+	}
 
-	numSamples = _numSamples;
-	numFeatures = _numFeatures;
+	// First pass: lines and values per chunk
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_create(&threads[t], NULL, libsvm_count_worker, &args[t]);
+	libsvm_count_worker(&args[0]);
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_join(threads[t], NULL);
+
+	uint32_t numLines = 0;
+	uint32_t maxColumn = 0;
+	uint64_t numValues = 0;
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].firstSample = numLines;
+		args[t].firstValue = numValues;
+		numLines += args[t].numLines;
+		numValues += args[t].numValues;
+		if (args[t].maxColumn > maxColumn)
+			maxColumn = args[t].maxColumn;
+	}
+
+	numSamples = (_numSamples == 0) ? numLines : _numSamples;
+	numFeatures = (_numFeatures == 0) ? maxColumn+1 : _numFeatures+1; // For the bias term
 
 	accumulationCount = int(numFeatures/numValuesPerLine) + (numFeatures%numValuesPerLine > 0);
 	if (numFeatures%numValuesPerLine == 0)
 		accumulationCount++;
 
-	cout << "accumulationCount: " << accumulationCount << endl;
-
 	if (a != NULL)
 		free(a);
-	a = (float*)calloc(numSamples*numFeatures, sizeof(float));
+	a = NULL;
+	if (csr_row_ptr != NULL) {
+		free(csr_values);
+		free(csr_columns);
+		free(csr_row_ptr);
+	}
+	// Samples missing from the file get a bias term only
+	uint64_t capacity = numValues + (numSamples > numLines ? numSamples - numLines : 0);
+	csr_values = (float*)malloc(capacity*sizeof(float));
+	csr_columns = (uint32_t*)malloc(capacity*sizeof(uint32_t));
+	csr_row_ptr = (uint64_t*)malloc(((uint64_t)numSamples+1)*sizeof(uint64_t));
 	if (b != NULL)
 		free(b);
 	b = (float*)calloc(numSamples, sizeof(float));
@@ -287,29 +1059,120 @@ void zipml_sgd::load_raw_data(char* pathToFile, uint32_t _numSamples, uint32_t _
 		free(bi);
 	bi = (int*)calloc(numSamples, sizeof(int));
 
-	FILE* f = fopen(pathToFile, "r");
-
-	double* temp;
-	temp = (double*)malloc(numSamples*(numFeatures+1)*sizeof(double));
-	size_t read_result = fread(temp, sizeof(double), numSamples*(numFeatures+1), f);
-	if (read_result == numSamples*(numFeatures+1))
-		cout << "Read is successful" << endl;
-
-	for (uint32_t i = 0; i < numSamples; i++) {
-		b[i] = (float)temp[i*(numFeatures+1)];
-		bi[i] = (int)(b[i]*b_toIntegerScaler);
-		for (uint32_t j = 0; j < numFeatures; j++) {
-			a[i*numFeatures + j] = (float)temp[i*(numFeatures+1) + j+1];
+	// Second pass: parse in place into the CSR range of each chunk
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].b = b;
+		args[t].bi = bi;
+		args[t].values = csr_values;
+		args[t].columns = csr_columns;
+		args[t].row_ptr = csr_row_ptr;
+		args[t].numFeatures = numFeatures;
+		args[t].numSamples = numSamples;
+	}
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_create(&threads[t], NULL, libsvm_parse_sparse_worker, &args[t]);
+	libsvm_parse_sparse_worker(&args[0]);
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_join(threads[t], NULL);
+
+	// Close the gaps left by dropped values (and by lines past _numSamples)
+	csr_nnz = 0;
+	for (uint32_t t = 0; t < numThreads; t++) {
+		if (args[t].firstSample >= numSamples)
+			break;
+		uint64_t shift = args[t].firstValue - csr_nnz;
+		if (shift > 0) {
+			memmove(csr_values + csr_nnz, csr_values + args[t].firstValue, args[t].numValues*sizeof(float));
+			memmove(csr_columns + csr_nnz, csr_columns + args[t].firstValue, args[t].numValues*sizeof(uint32_t));
+			uint32_t lastSample = (args[t].firstSample + args[t].numLines < numSamples) ? args[t].firstSample + args[t].numLines : numSamples;
+			for (uint32_t i = args[t].firstSample; i < lastSample; i++)
+				csr_row_ptr[i] -= shift;
 		}
+		csr_nnz += args[t].numValues;
 	}
-	free(temp);
-	fclose(f);
+	for (uint32_t i = numLines; i < numSamples; i++) {
+		csr_row_ptr[i] = csr_nnz;
+		csr_values[csr_nnz] = 1.0;
+		csr_columns[csr_nnz] = 0;
+		csr_nnz++;
+	}
+	csr_row_ptr[numSamples] = csr_nnz;
+
+	free(threads);
+	free(args);
+	if (size > 0)
+		munmap((void*)file, size);
 
+	double end = get_time();
 	cout << "numSamples: " << numSamples << endl;
 	cout << "numFeatures: " << numFeatures << endl;
+	cout << "Nonzeros: " << csr_nnz << " (" << 100.0*csr_nnz/((double)numSamples*numFeatures) << "%), CSR: " << csr_nnz*8/1e6 << " MB instead of " << (double)numSamples*numFeatures*4/1e6 << " MB dense" << endl;
+	cout << "Parsed " << size/1e6 << " MB in " << end-start << " s, " << size/1e6/(end-start) << " MB/s with " << numThreads << " threads" << endl;
 }
 
-void zipml_sgd::generate_synthetic_data(uint32_t _numSamples, uint32_t _numFeatures, char binary) {
+char zipml_sgd::require_dense(const char* caller) {
+	if (is_sparse()) {
+		cout << caller << " needs dense data, call sparse_to_dense() first" << endl;
+		return 0;
+	}
+	if (a == NULL) {
+		cout << caller << " needs data, none is loaded" << endl;
+		return 0;
+	}
+	return 1;
+}
+
+void zipml_sgd::sparse_to_dense() {
+	if (!is_sparse())
+		return;
+	a = (float*)calloc((uint64_t)numSamples*numFeatures, sizeof(float));
+	for (uint32_t i = 0; i < numSamples; i++) {
+		for (uint64_t k = csr_row_ptr[i]; k < csr_row_ptr[i+1]; k++)
+			a[(uint64_t)i*numFeatures + csr_columns[k]] = csr_values[k];
+	}
+	free(csr_values);
+	free(csr_columns);
+	free(csr_row_ptr);
+	csr_values = NULL;
+	csr_columns = NULL;
+	csr_row_ptr = NULL;
+	csr_nnz = 0;
+}
+
+// Opens a raw file for reading _numSamples rows of _numFeatures+1 values of
+// elementType ('d' double, 'f' float). Longer files are fine, the first rows
+// are read. Returns NULL (after printing why) if it cannot be read
+FILE* zipml_sgd::open_raw_file(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures, char elementType, uint32_t* elementSize) {
+	if (elementType != 'd' && elementType != 'f') {
+		cout << "Raw files hold 'd' (double) or 'f' (float) values, not '" << elementType << "'" << endl;
+		return NULL;
+	}
+	*elementSize = (elementType == 'd') ? sizeof(double) : sizeof(float);
+	FILE* f = fopen(pathToFile, "rb");
+	if (f == NULL) {
+		cout << "Unable to open file " << pathToFile << endl;
+		return NULL;
+	}
+	struct stat st;
+	fstat(fileno(f), &st);
+	uint64_t needed = (uint64_t)_numSamples*(_numFeatures+1)*(*elementSize);
+	if ((uint64_t)st.st_size < needed)
+		cout << pathToFile << " has " << st.st_size << " bytes, " << _numSamples << " rows of " << (elementType == 'd' ? "double" : "float") << " need " << needed << endl;
+	posix_fadvise(fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+	return f;
+}
+
+// The file is streamed in chunks of whole rows straight into a, b and bi, so
+// only a chunk is held besides them.
+void zipml_sgd::load_raw_data(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures, char elementType) {
+	cout << "Reading " << pathToFile << endl;
+	double start = get_time();
+
+	uint32_t elementSize;
+	FILE* f = open_raw_file(pathToFile, _numSamples, _numFeatures, elementType, &elementSize);
+	if (f == NULL)
+		return;
+
 	numSamples = _numSamples;
 	numFeatures = _numFeatures;
 
@@ -321,158 +1184,903 @@ void zipml_sgd::generate_synthetic_data(uint32_t _numSamples, uint32_t _numFeatu
 
 	if (a != NULL)
 		free(a);
-	a = (float*)calloc(numSamples*numFeatures, sizeof(float));
+	a = (float*)malloc(numSamples*numFeatures*sizeof(float));
 	if (b != NULL)
 		free(b);
-	b = (float*)calloc(numSamples, sizeof(float));
+	b = (float*)malloc(numSamples*sizeof(float));
 	if (bi != NULL)
 		free(bi);
-	bi = (int*)calloc(numSamples, sizeof(int));
-
-	srand(7);
-	float* x = (float*)malloc(numFeatures*sizeof(float));
-	for (uint32_t j = 0; j < numFeatures; j++) {
-		x[j] = ((float)rand())/RAND_MAX;
-	}
-
-	for (uint32_t i = 0; i < numSamples; i++) {
-		if (binary == 1) {
-			float temp = ((float)rand())/RAND_MAX;
-			if (temp > 0.5)
-				b[i] = (float)1.0;
-			else
-				b[i] = (float)-1.0;
+	bi = (int*)malloc(numSamples*sizeof(int));
+
+	uint32_t rowBytes = (numFeatures+1)*elementSize;
+	uint32_t rowsPerChunk = RAW_CHUNK_BYTES/rowBytes;
+	if (rowsPerChunk == 0)
+		rowsPerChunk = 1;
+	char* chunk = (char*)malloc((uint64_t)rowsPerChunk*rowBytes);
+
+	uint32_t i = 0;
+	while (i < numSamples) {
+		uint32_t numRows = (numSamples - i < rowsPerChunk) ? numSamples - i : rowsPerChunk;
+		uint32_t numRead = fread(chunk, rowBytes, numRows, f);
+		for (uint32_t r = 0; r < numRead; r++, i++) {
+			char* row = chunk + (uint64_t)r*rowBytes;
+			if (elementSize == sizeof(double)) {
+				b[i] = (float)((double*)row)[0];
+				convert_double_to_float((double*)row + 1, a + (uint64_t)i*numFeatures, numFeatures);
+			}
+			else {
+				memcpy(&b[i], row, sizeof(float));
+				memcpy(a + (uint64_t)i*numFeatures, row + sizeof(float), numFeatures*sizeof(float));
+			}
+			bi[i] = (int)(b[i]*b_toIntegerScaler);
 		}
-		else
-			b[i] = (float)rand()/RAND_MAX;
-
-		bi[i] = (int)(b[i]*b_toIntegerScaler);
-
-		for (uint32_t j = 0; j < numFeatures; j++) {
-			a[i*numFeatures + j] = b[i]*x[j] + (float)rand()/(RAND_MAX);
+		if (numRead != numRows) {
+			cout << "Read failed at sample " << i << endl;
+			break;
 		}
 	}
-	free(x);
+	if (i == numSamples)
+		cout << "Read is successful" << endl;
+	double bytesRead = (double)i*rowBytes;
+	for (; i < numSamples; i++) {
+		memset(a + (uint64_t)i*numFeatures, 0, numFeatures*sizeof(float));
+		b[i] = 0;
+		bi[i] = 0;
+	}
+	free(chunk);
+	fclose(f);
 
+	double end = get_time();
 	cout << "numSamples: " << numSamples << endl;
 	cout << "numFeatures: " << numFeatures << endl;
+	cout << "Read " << bytesRead/1e6 << " MB of " << (elementSize == sizeof(double) ? "double" : "float") << " in " << end-start << " s, " << bytesRead/1e6/(end-start) << " MB/s" << endl;
 }
 
-void zipml_sgd::a_normalize(char toMinus1_1, char rowOrColumnWise) {
-	a_normalizedToMinus1_1 = toMinus1_1;
-	if (rowOrColumnWise == 'r') {
-		for (uint32_t i = 0; i < numSamples; i++) {
-			float amin = numeric_limits<float>::max();
-			float amax = numeric_limits<float>::min();
-			for (uint32_t j = 0; j < numFeatures; j++) {
-				float a_here = a[i*numFeatures + j];
-				if (a_here > amax)
-					amax = a_here;
-				if (a_here < amin)
-					amin = a_here;
+// Processes the blocks the reader queues: converts each row, then (pre-scan)
+// folds it into the statistics, or normalizes it into a/b/bi and writes it in
+// every output layout straight into the workspace while it is in cache.
+static void* ingest_worker(void* arg) {
+	ingest_args* args = (ingest_args*)arg;
+	uint32_t numFeatures = args->numFeatures;
+	uint32_t rowBytes = (numFeatures+1)*args->elementSize;
+	uint32_t bits = args->quantizationBits;
+	float* scanRow = (float*)malloc(numFeatures*sizeof(float));
+	int* aiq1 = (int*)malloc(2*numFeatures*sizeof(int));
+	int* aiq2 = aiq1 + numFeatures;
+	uint32_t* staging = (uint32_t*)malloc(args->rowWords*sizeof(uint32_t));
+
+	while (1) {
+		uint32_t id = ingest_queue_pop(args->filled);
+		if (id == INGEST_DONE)
+			break;
+		ingest_block* block = args->blocks + id;
+		for (uint32_t r = 0; r < block->numRows; r++) {
+			uint32_t i = block->firstSample + r;
+			char* raw = block->raw + (uint64_t)r*rowBytes;
+			float* a_row = (args->scan == 1) ? scanRow : args->a + (uint64_t)i*numFeatures;
+			float label;
+			if (args->elementSize == sizeof(double)) {
+				label = (float)((double*)raw)[0];
+				convert_double_to_float((double*)raw + 1, a_row, numFeatures);
 			}
-			float arange = amax - amin;
-			if (arange > 0) {
-				if (toMinus1_1 == 1) {
-					for (uint32_t j = 0; j < numFeatures; j++) {
-						a[i*numFeatures + j] = ((a[i*numFeatures + j] - amin)/arange)*2.0-1.0;
-					}
-				}
-				else {
-					for (uint32_t j = 0; j < numFeatures; j++) {
-						a[i*numFeatures + j] = ((a[i*numFeatures + j] - amin)/arange);
-					}
-				}
+			else {
+				memcpy(&label, raw, sizeof(float));
+				memcpy(a_row, raw + sizeof(float), numFeatures*sizeof(float));
 			}
-		}
-	}
-	else {
-		for (uint32_t j = 1; j < numFeatures; j++) { // Don't normalize bias
-			float amin = numeric_limits<float>::max();
-			float amax = numeric_limits<float>::min();
-			for (uint32_t i = 0; i < numSamples; i++) {
-				float a_here = a[i*numFeatures + j];
-				if (a_here > amax)
-					amax = a_here;
-				if (a_here < amin)
-					amin = a_here;
+
+			if (args->scan == 1) {
+				minmax_columns(a_row, args->amin, args->amax, numFeatures);
+				if (label > args->bmax)
+					args->bmax = label;
+				if (label < args->bmin)
+					args->bmin = label;
+				continue;
 			}
-			float arange = amax - amin;
-			if (arange > 0) {
-				if (toMinus1_1 == 1) {
-					for (uint32_t i = 0; i < numSamples; i++) {
-						a[i*numFeatures + j] = ((a[i*numFeatures + j] - amin)/arange)*2.0-1.0;
-					}
+
+			if (args->rowOrColumnWise == 'r') {
+				float amin = numeric_limits<float>::max();
+				float amax = numeric_limits<float>::min();
+				minmax_row(a_row, numFeatures, &amin, &amax);
+				float arange = amax - amin;
+				if (arange > 0)
+					scale_row(a_row, amin, arange, (args->a_toMinus1_1 == 1) ? 2.0f : 1.0f, (args->a_toMinus1_1 == 1) ? -1.0f : 0.0f, numFeatures);
+			}
+			else if (args->rowOrColumnWise == 'c') {
+				scale_columns(a_row, args->offset, args->range, args->mul, args->add, numFeatures);
+			}
+			if (args->normalize_b == 1)
+				label = ((label - args->b_offset)/args->b_range)*args->b_mul + args->b_add;
+			args->b[i] = label;
+			args->bi[i] = (int)(label*(float)args->b_toIntegerScaler);
+
+			// Rows are whole cache lines: pack in place unless one crosses a page
+			for (uint32_t index = 0; index < ((bits == 0) ? 1 : args->numberOfIndices); index++) {
+				uint32_t address32 = ((uint64_t)index*args->numSamples + i)*args->rowWords;
+				uint32_t* row;
+				if (args->fpga->getSpan('i', address32, &row) < args->rowWords)
+					row = staging;
+				memset(row, 0, args->rowWords*sizeof(uint32_t));
+				if (bits == 0) {
+					memcpy(row, a_row, numFeatures*sizeof(float));
+					memcpy(row + args->rowWords-1, &label, sizeof(float));
 				}
 				else {
-					for (uint32_t i = 0; i < numSamples; i++) {
-						a[i*numFeatures + j] = ((a[i*numFeatures + j] - amin)/arange);
+					uint32_t elementsPerWord = 16/bits;
+					uint32_t mask = (1 << bits)-1;
+					quantize_row(a_row, aiq1, numFeatures, args->scale, args->a_toMinus1_1, counter_rng(args->streamKeys[2*index], i));
+					quantize_row(a_row, aiq2, numFeatures, args->scale, args->a_toMinus1_1, counter_rng(args->streamKeys[2*index+1], i));
+					for (uint32_t j = 0; j < numFeatures; j++) {
+						uint32_t q1 = aiq1[j] & mask;
+						uint32_t q2 = aiq2[j] & mask;
+						row[j/elementsPerWord] |= (q2 << bits | q1) << (2*bits*(j%elementsPerWord));
 					}
+					row[args->rowWords-1] = args->bi[i];
 				}
+				if (row == staging)
+					args->fpga->writeToMemory('i', staging, address32, args->rowWords);
 			}
 		}
+		ingest_queue_push(args->emptied, id);
 	}
+	free(scanRow);
+	free(aiq1);
+	free(staging);
+	return NULL;
 }
 
-void zipml_sgd::b_normalize(char toMinus1_1, char binarize_b, float b_toBinarizeTo) {
-	b_normalizedToMinus1_1 = toMinus1_1;
-	if (binarize_b == 0) {
-		float bmin = numeric_limits<float>::max();
-		float bmax = numeric_limits<float>::min();
-		for (uint32_t i = 0; i < numSamples; i++) {
-			if (b[i] > bmax)
-				bmax = b[i];
-			if (b[i] < bmin)
-				bmin = b[i];
-		}
-		cout << "bmax: " << bmax << ", bmin: " << bmin << endl;
-		float brange = bmax - bmin;
-		if (brange > 0) {
-			if (toMinus1_1 == 1) {
-				for (uint32_t i = 0; i < numSamples; i++) {
-					b[i] = ((b[i]-bmin)/brange)*2.0 - 1.0;
-					bi[i] = (int)(b[i]*(float)b_toIntegerScaler);
-				}
-			}
-			else {
-				for (uint32_t i = 0; i < numSamples; i++) {
-					b[i] = (b[i]-bmin)/brange;
-					bi[i] = (int)(b[i]*(float)b_toIntegerScaler);
-				}
-			}
-		}
-		b_min = bmin;
-		b_range = brange;
+uint32_t zipml_sgd::ingest_raw_data(char* pathToFile, uint32_t _numSamples, uint32_t _numFeatures, char rowOrColumnWise, char a_toMinus1_1, char normalize_b, char b_toMinus1_1, int quantizationBits, int _numberOfIndices, char elementType) {
+	if (quantizationBits != 0 && quantizationBits != 1 && quantizationBits != 2 && quantizationBits != 4 && quantizationBits != 8) {
+		cout << "FPGA can only handle 1, 2, 4, 8 bit quantization." << endl;
+		return 0;
 	}
-	else {
-		for (uint32_t i = 0; i < numSamples; i++) {
+	if (gotFPGA == 0) {
+		cout << "ingest_raw_data writes into the FPGA workspace, there is none" << endl;
+		return 0;
+	}
+	cout << "Ingesting " << pathToFile << endl;
+	double start = get_time();
+
+	uint32_t elementSize;
+	FILE* f = open_raw_file(pathToFile, _numSamples, _numFeatures, elementType, &elementSize);
+	if (f == NULL)
+		return 0;
+
+	numSamples = _numSamples;
+	numFeatures = _numFeatures;
+	numberOfIndices = (quantizationBits == 0) ? 1 : _numberOfIndices;
+	if (rowOrColumnWise == 'r' || rowOrColumnWise == 'c')
+		a_normalizedToMinus1_1 = a_toMinus1_1;
+
+	accumulationCount = int(numFeatures/numValuesPerLine) + (numFeatures%numValuesPerLine > 0);
+	if (numFeatures%numValuesPerLine == 0)
+		accumulationCount++;
+
+	uint32_t rowWords;
+	uint64_t indexCacheLines;
+	if (quantizationBits == 0) {
+		rowWords = accumulationCount*numValuesPerLine;
+		indexCacheLines = (uint64_t)numSamples*accumulationCount;
+		if (reserve_workspace(indexCacheLines, 0, (uint64_t)numSamples*(numFeatures+1)*sizeof(float)) == 0) {
+			fclose(f);
+			return 0;
+		}
+	}
+	else {
+		uint32_t elementsPerWord = 16/quantizationBits;
+		rowWords = get_number_of_words_per_packed_row(quantizationBits);
+		indexCacheLines = (uint64_t)numSamples*rowWords/16;
+		uint64_t usedIndexBytes = (uint64_t)numSamples*((numFeatures + elementsPerWord-1)/elementsPerWord + 1)*sizeof(uint32_t);
+		if (reserve_workspace(numberOfIndices*indexCacheLines, 0, numberOfIndices*usedIndexBytes) == 0) {
+			fclose(f);
+			return 0;
+		}
+	}
+
+	if (a != NULL)
+		free(a);
+	a = (float*)calloc((uint64_t)numSamples*numFeatures, sizeof(float));
+	if (b != NULL)
+		free(b);
+	b = (float*)calloc(numSamples, sizeof(float));
+	if (bi != NULL)
+		free(bi);
+	bi = (int*)calloc(numSamples, sizeof(int));
+
+	// The reader runs on this thread, the workers get a few blocks each in flight
+	uint32_t rowBytes = (numFeatures+1)*elementSize;
+	uint32_t rowsPerBlock = INGEST_BLOCK_BYTES/rowBytes;
+	if (rowsPerBlock == 0)
+		rowsPerBlock = 1;
+	uint32_t numThreads = numCPUThreads;
+	if (numThreads > numSamples/rowsPerBlock + 1)
+		numThreads = numSamples/rowsPerBlock + 1;
+	uint32_t numBlocks = 2*numThreads + 2;
+	ingest_block* blocks = (ingest_block*)malloc(numBlocks*sizeof(ingest_block));
+	ingest_queue filled, emptied;
+	ingest_queue_init(&filled, numBlocks + numThreads);
+	ingest_queue_init(&emptied, numBlocks);
+	for (uint32_t k = 0; k < numBlocks; k++) {
+		blocks[k].raw = (char*)malloc((uint64_t)rowsPerBlock*rowBytes);
+		ingest_queue_push(&emptied, k);
+	}
+
+	uint32_t* streamKeys = (uint32_t*)malloc(2*numberOfIndices*sizeof(uint32_t));
+	for (uint32_t c = 0; c < 2*numberOfIndices; c++) {
+		streamKeys[c] = counter_rng(quantizationSeed, quantizationStream + c);
+	}
+	int numLevels = (quantizationBits == 0) ? 1 : (1 << (quantizationBits-1)) + 1;
+	float* partials = (float*)malloc(2*(uint64_t)numThreads*numFeatures*sizeof(float));
+	float* factors = (float*)malloc(4*numFeatures*sizeof(float));
+
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+	ingest_args* args = (ingest_args*)malloc(numThreads*sizeof(ingest_args));
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].blocks = blocks;
+		args[t].filled = &filled;
+		args[t].emptied = &emptied;
+		args[t].elementSize = elementSize;
+		args[t].numFeatures = numFeatures;
+		args[t].numSamples = numSamples;
+		args[t].a = a;
+		args[t].b = b;
+		args[t].bi = bi;
+		args[t].b_toIntegerScaler = b_toIntegerScaler;
+		args[t].rowOrColumnWise = rowOrColumnWise;
+		args[t].a_toMinus1_1 = a_normalizedToMinus1_1;
+		args[t].offset = factors;
+		args[t].range = factors + numFeatures;
+		args[t].mul = factors + 2*numFeatures;
+		args[t].add = factors + 3*numFeatures;
+		args[t].normalize_b = 0;
+		args[t].amin = partials + (uint64_t)t*numFeatures;
+		args[t].amax = partials + (uint64_t)(numThreads + t)*numFeatures;
+		args[t].bmin = numeric_limits<float>::max();
+		args[t].bmax = numeric_limits<float>::min();
+		for (uint32_t j = 0; j < numFeatures; j++) {
+			args[t].amin[j] = numeric_limits<float>::max();
+			args[t].amax[j] = numeric_limits<float>::min();
+		}
+		args[t].quantizationBits = quantizationBits;
+		args[t].numberOfIndices = numberOfIndices;
+		args[t].streamKeys = streamKeys;
+		args[t].scale = (a_normalizedToMinus1_1 == 0) ? numLevels-1 : (numLevels-1)/2;
+		args[t].rowWords = rowWords;
+		args[t].fpga = interfaceFPGA;
+	}
+
+	char success = 1;
+	double scanTime = 0;
+	char needsScan = (rowOrColumnWise == 'c' || normalize_b == 1);
+	for (uint32_t pass = (needsScan == 1) ? 0 : 1; pass < 2 && success == 1; pass++) {
+		for (uint32_t t = 0; t < numThreads; t++) {
+			args[t].scan = (pass == 0);
+			pthread_create(&threads[t], NULL, ingest_worker, &args[t]);
+		}
+		fseek(f, 0, SEEK_SET);
+		for (uint32_t firstSample = 0; firstSample < numSamples; firstSample += rowsPerBlock) {
+			uint32_t id = ingest_queue_pop(&emptied);
+			ingest_block* block = blocks + id;
+			block->firstSample = firstSample;
+			block->numRows = (numSamples - firstSample < rowsPerBlock) ? numSamples - firstSample : rowsPerBlock;
+			if (fread(block->raw, rowBytes, block->numRows, f) != block->numRows) {
+				cout << "Read failed at sample " << firstSample << endl;
+				ingest_queue_push(&emptied, id);
+				success = 0;
+				break;
+			}
+			ingest_queue_push(&filled, id);
+		}
+		for (uint32_t t = 0; t < numThreads; t++)
+			ingest_queue_push(&filled, INGEST_DONE);
+		for (uint32_t t = 0; t < numThreads; t++)
+			pthread_join(threads[t], NULL);
+		if (pass == 1)
+			break;
+
+		// Merge the statistics into the factors of the main pass, as a_normalize and b_normalize would
+		scanTime = get_time() - start;
+		for (uint32_t j = 0; j < numFeatures; j++) {
+			float amin = args[0].amin[j];
+			float amax = args[0].amax[j];
+			for (uint32_t t = 1; t < numThreads; t++) {
+				amin = args[t].amin[j] < amin ? args[t].amin[j] : amin;
+				amax = args[t].amax[j] > amax ? args[t].amax[j] : amax;
+			}
+			float arange = amax - amin;
+			char scaled = (rowOrColumnWise == 'c' && j > 0 && arange > 0); // Don't normalize bias
+			factors[j] = scaled ? amin : 0.0f;
+			factors[numFeatures + j] = scaled ? arange : 1.0f;
+			factors[2*numFeatures + j] = (scaled && a_toMinus1_1 == 1) ? 2.0f : 1.0f;
+			factors[3*numFeatures + j] = (scaled && a_toMinus1_1 == 1) ? -1.0f : 0.0f;
+		}
+		if (normalize_b == 1) {
+			float bmin = args[0].bmin;
+			float bmax = args[0].bmax;
+			for (uint32_t t = 1; t < numThreads; t++) {
+				bmin = args[t].bmin < bmin ? args[t].bmin : bmin;
+				bmax = args[t].bmax > bmax ? args[t].bmax : bmax;
+			}
+			cout << "bmax: " << bmax << ", bmin: " << bmin << endl;
+			float brange = bmax - bmin;
+			for (uint32_t t = 0; t < numThreads; t++) {
+				args[t].normalize_b = (brange > 0);
+				args[t].b_offset = bmin;
+				args[t].b_range = brange;
+				args[t].b_mul = (b_toMinus1_1 == 1) ? 2.0f : 1.0f;
+				args[t].b_add = (b_toMinus1_1 == 1) ? -1.0f : 0.0f;
+			}
+			b_min = bmin;
+			b_range = brange;
+			b_normalizedToMinus1_1 = b_toMinus1_1;
+		}
+	}
+	if (quantizationBits != 0)
+		quantizationStream += 2*numberOfIndices;
+
+	for (uint32_t k = 0; k < numBlocks; k++) {
+		free(blocks[k].raw);
+	}
+	free(blocks);
+	ingest_queue_destroy(&filled);
+	ingest_queue_destroy(&emptied);
+	free(streamKeys);
+	free(partials);
+	free(factors);
+	free(threads);
+	free(args);
+	fclose(f);
+	if (success == 0)
+		return 0;
+
+	double end = get_time();
+	cout << "numSamples: " << numSamples << endl;
+	cout << "numFeatures: " << numFeatures << endl;
+	double bytesRead = (double)numSamples*(numFeatures+1)*elementSize;
+	cout << "Ingested " << bytesRead/1e6 << " MB of " << (elementSize == sizeof(double) ? "double" : "float") << " in " << end-start << " s (pre-scan " << scanTime << " s), " << bytesRead/1e6/(end-start) << " MB/s with " << numThreads << " workers" << endl;
+	return indexCacheLines;
+}
+
+void zipml_sgd::generate_synthetic_data(uint32_t _numSamples, uint32_t _numFeatures, char binary) {
+	numSamples = _numSamples;
+	numFeatures = _numFeatures;
+
+	accumulationCount = int(numFeatures/numValuesPerLine) + (numFeatures%numValuesPerLine > 0);
+	if (numFeatures%numValuesPerLine == 0)
+		accumulationCount++;
+
+	cout << "accumulationCount: " << accumulationCount << endl;
+
+	if (a != NULL)
+		free(a);
+	a = (float*)calloc(numSamples*numFeatures, sizeof(float));
+	if (b != NULL)
+		free(b);
+	b = (float*)calloc(numSamples, sizeof(float));
+	if (bi != NULL)
+		free(bi);
+	bi = (int*)calloc(numSamples, sizeof(int));
+
+	srand(7);
+	float* x = (float*)malloc(numFeatures*sizeof(float));
+	for (uint32_t j = 0; j < numFeatures; j++) {
+		x[j] = ((float)rand())/RAND_MAX;
+	}
+
+	for (uint32_t i = 0; i < numSamples; i++) {
+		if (binary == 1) {
+			float temp = ((float)rand())/RAND_MAX;
+			if (temp > 0.5)
+				b[i] = (float)1.0;
+			else
+				b[i] = (float)-1.0;
+		}
+		else
+			b[i] = (float)rand()/RAND_MAX;
+
+		bi[i] = (int)(b[i]*b_toIntegerScaler);
+
+		for (uint32_t j = 0; j < numFeatures; j++) {
+			a[i*numFeatures + j] = b[i]*x[j] + (float)rand()/(RAND_MAX);
+		}
+	}
+	free(x);
+
+	cout << "numSamples: " << numSamples << endl;
+	cout << "numFeatures: " << numFeatures << endl;
+}
+
+// Whether every column lies in the input range of the quantizer, except the
+// bias in column 0 which a_normalize leaves alone
+static char columns_in_quantizer_range(const float* amin, const float* amax, uint32_t numFeatures, char toMinus1_1) {
+	float low = (toMinus1_1 == 1) ? -1.0f : 0.0f;
+	for (uint32_t j = 1; j < numFeatures; j++) {
+		if (!(amin[j] >= low && amax[j] <= 1.0f))
+			return 0;
+	}
+	return 1;
+}
+
+// Size in bytes the header's dimensions give a section (as save_fpga_dataset
+// lays it out), 0 if the section's own geometry does not match them
+static uint64_t fpga_dataset_section_size(const fpga_dataset_header* header, const fpga_dataset_section* section) {
+	uint32_t numFeatures = header->numFeatures;
+	uint32_t numValuesPerLine = header->numValuesPerLine;
+	uint32_t accumulationCount = numFeatures/numValuesPerLine + (numFeatures%numValuesPerLine > 0);
+	if (numFeatures%numValuesPerLine == 0)
+		accumulationCount++;
+	if (header->accumulationCount != accumulationCount || section->numberOfIndices == 0)
+		return 0;
+
+	uint64_t rowBytes;
+	uint32_t bits = section->quantizationBits;
+	if (bits == 0) {
+		if (section->numberOfIndices != 1)
+			return 0;
+		rowBytes = (uint64_t)accumulationCount*numValuesPerLine*sizeof(float);
+	}
+	else if (bits == 1 || bits == 2 || bits == 4 || bits == 8) {
+		uint32_t elementsPerWord = 16/bits;
+		uint32_t dataWords = (numFeatures + elementsPerWord-1)/elementsPerWord;
+		rowBytes = (uint64_t)(dataWords/16 + 1)*16*sizeof(uint32_t);
+	}
+	else
+		return 0;
+	if ((uint64_t)section->cacheLinesPerIndex*CL(1) != header->numSamples*rowBytes)
+		return 0;
+	return section->numberOfIndices*header->numSamples*rowBytes;
+}
+
+char zipml_sgd::save_fpga_dataset(char* pathToFile, const int quantizationBits[], uint32_t numWidths, int _numberOfIndices) {
+	if (require_dense("save_fpga_dataset") == 0)
+		return -1;
+	cout << "Writing " << pathToFile << endl;
+
+	if (numWidths+1 > FPGA_DATASET_MAX_SECTIONS) {
+		cout << "At most " << FPGA_DATASET_MAX_SECTIONS-1 << " quantization widths per file." << endl;
+		return -1;
+	}
+
+	float* stats = (float*)malloc(2*numFeatures*sizeof(float));
+	for (uint32_t j = 0; j < numFeatures; j++) {
+		stats[j] = numeric_limits<float>::max();
+		stats[numFeatures + j] = -numeric_limits<float>::max();
+	}
+	for (uint32_t i = 0; i < numSamples; i++) {
+		for (uint32_t j = 0; j < numFeatures; j++) {
+			float a_here = a[i*numFeatures + j];
+			if (a_here < stats[j])
+				stats[j] = a_here;
+			if (a_here > stats[numFeatures + j])
+				stats[numFeatures + j] = a_here;
+		}
+	}
+	char normalized = columns_in_quantizer_range(stats, stats + numFeatures, numFeatures, a_normalizedToMinus1_1);
+	if (numWidths > 0 && normalized == 0) {
+		cout << "Quantized copies need a in [" << (a_normalizedToMinus1_1 ? -1 : 0) << ",1], call a_normalize first." << endl;
+		free(stats);
+		return -1;
+	}
+
+	fpga_dataset_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = FPGA_DATASET_MAGIC;
+	header.version = FPGA_DATASET_VERSION;
+	header.numSamples = numSamples;
+	header.numFeatures = numFeatures;
+	header.numValuesPerLine = numValuesPerLine;
+	header.accumulationCount = accumulationCount;
+	header.b_toIntegerScaler = b_toIntegerScaler;
+	header.a_normalizedToMinus1_1 = a_normalizedToMinus1_1;
+	header.b_normalizedToMinus1_1 = b_normalizedToMinus1_1;
+	header.a_normalized = normalized;
+	header.b_range = b_range;
+	header.b_min = b_min;
+	header.numSections = numWidths+1;
+	header.columnStatsOffset = sizeof(header);
+
+	uint64_t offset = fpga_dataset_align(header.columnStatsOffset + 2*numFeatures*sizeof(float));
+	uint32_t rowWords = accumulationCount*numValuesPerLine;
+	header.sections[0].quantizationBits = 0;
+	header.sections[0].numberOfIndices = 1;
+	header.sections[0].cacheLinesPerIndex = numSamples*accumulationCount;
+	header.sections[0].offset = offset;
+	header.sections[0].size = (uint64_t)numSamples*rowWords*sizeof(float);
+	offset = fpga_dataset_align(offset + header.sections[0].size);
+	for (uint32_t w = 0; w < numWidths; w++) {
+		int bits = quantizationBits[w];
+		if (bits != 1 && bits != 2 && bits != 4 && bits != 8) {
+			cout << "FPGA can only handle 1, 2, 4, 8 bit quantization." << endl;
+			free(stats);
+			return -1;
+		}
+		fpga_dataset_section* section = &header.sections[w+1];
+		section->quantizationBits = bits;
+		section->numberOfIndices = _numberOfIndices;
+		section->cacheLinesPerIndex = numSamples*get_number_of_words_per_packed_row(bits)/16;
+		section->offset = offset;
+		section->size = (uint64_t)_numberOfIndices*section->cacheLinesPerIndex*CL(1);
+		offset = fpga_dataset_align(offset + section->size);
+	}
+
+	FILE* f = fopen(pathToFile, "wb");
+	if (f == NULL) {
+		cout << "Could not open " << pathToFile << endl;
+		free(stats);
+		return -1;
+	}
+	char success = 1;
+	success &= (fwrite(&header, sizeof(header), 1, f) == 1);
+
+	success &= (fwrite(stats, sizeof(float), 2*numFeatures, f) == 2*numFeatures);
+	free(stats);
+
+	float* row = (float*)calloc(rowWords, sizeof(float));
+	fseek(f, header.sections[0].offset, SEEK_SET);
+	for (uint32_t i = 0; i < numSamples; i++) {
+		memcpy(row, a + i*numFeatures, numFeatures*sizeof(float));
+		row[rowWords-1] = b[i];
+		success &= (fwrite(row, sizeof(float), rowWords, f) == rowWords);
+	}
+	free(row);
+
+	int* aiq1 = (int*)malloc(2*numSamples*numFeatures*sizeof(int));
+	int* aiq2 = aiq1 + numSamples*numFeatures;
+	for (uint32_t w = 0; w < numWidths; w++) {
+		fpga_dataset_section* section = &header.sections[w+1];
+		uint32_t indexWords = section->cacheLinesPerIndex*16;
+		uint32_t* packed = (uint32_t*)malloc(indexWords*sizeof(uint32_t));
+		fseek(f, section->offset, SEEK_SET);
+		for (int index = 0; index < _numberOfIndices; index++) {
+			quantize_data_integer(aiq1, section->quantizationBits, 2);
+			pack_quantized_data(packed, aiq1, aiq2, section->quantizationBits);
+			success &= (fwrite(packed, sizeof(uint32_t), indexWords, f) == indexWords);
+		}
+		free(packed);
+	}
+	free(aiq1);
+
+	// Pad the file to the end of the last section so that it can be mapped whole
+	success &= (fseek(f, offset-1, SEEK_SET) == 0);
+	success &= (fputc(0, f) != EOF);
+	fclose(f);
+
+	if (!success) {
+		cout << "Write to " << pathToFile << " failed" << endl;
+		return -1;
+	}
+	cout << "Wrote " << offset << " bytes" << endl;
+	return 0;
+}
+
+uint32_t zipml_sgd::load_fpga_dataset(char* pathToFile, int quantizationBits) {
+	cout << "Mapping " << pathToFile << endl;
+
+	int fd = open(pathToFile, O_RDONLY);
+	if (fd < 0) {
+		cout << "Could not open " << pathToFile << endl;
+		return 0;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(fpga_dataset_header)) {
+		cout << pathToFile << " is not an FPGA dataset" << endl;
+		close(fd);
+		return 0;
+	}
+	uint8_t* file = (uint8_t*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (file == MAP_FAILED) {
+		cout << "Could not map " << pathToFile << endl;
+		return 0;
+	}
+
+	fpga_dataset_header* header = (fpga_dataset_header*)file;
+	fpga_dataset_section* section = NULL;
+	// Sections must have the size the dimensions give them and lie in the file,
+	// a truncated or corrupted file would leave garbage in the workspace
+	char valid = 0;
+	if (header->magic == FPGA_DATASET_MAGIC && header->version == FPGA_DATASET_VERSION && header->numValuesPerLine == numValuesPerLine && header->numSections > 0) {
+		valid = 1;
+		for (uint32_t s = 0; s < header->numSections && s < FPGA_DATASET_MAX_SECTIONS; s++) {
+			fpga_dataset_section* here = &header->sections[s];
+			uint64_t size = fpga_dataset_section_size(header, here);
+			if (size == 0 || here->size != size || (s == 0) != (here->quantizationBits == 0) || here->offset > (uint64_t)st.st_size || here->size > (uint64_t)st.st_size - here->offset) {
+				if (s == 0)
+					valid = 0;
+				continue;
+			}
+			if ((int)here->quantizationBits == quantizationBits)
+				section = here;
+		}
+	}
+	if (valid == 0 || section == NULL) {
+		cout << pathToFile << " has no valid section for " << quantizationBits << " bits" << endl;
+		munmap(file, st.st_size);
+		return 0;
+	}
+	if (section->size/sizeof(uint32_t) > 0xFFFFFFFF) { // Workspace addresses are 32-bit words
+		cout << pathToFile << ": the " << quantizationBits << " bit section is too large for the FPGA workspace" << endl;
+		munmap(file, st.st_size);
+		return 0;
+	}
+	float* stats = (float*)(file + header->columnStatsOffset);
+	if (header->columnStatsOffset + 2*(uint64_t)header->numFeatures*sizeof(float) > (uint64_t)st.st_size
+		|| columns_in_quantizer_range(stats, stats + header->numFeatures, header->numFeatures, header->a_normalizedToMinus1_1) != header->a_normalized) {
+		cout << pathToFile << ": the column ranges do not match the normalization in the header" << endl;
+		munmap(file, st.st_size);
+		return 0;
+	}
+	if (header->a_normalized == 0)
+		cout << "a is not normalized, call a_normalize before quantizing it" << endl;
+	madvise(file + section->offset, section->size, MADV_SEQUENTIAL);
+
+	numSamples = header->numSamples;
+	numFeatures = header->numFeatures;
+	accumulationCount = header->accumulationCount;
+	b_toIntegerScaler = header->b_toIntegerScaler;
+	a_normalizedToMinus1_1 = header->a_normalizedToMinus1_1;
+	b_normalizedToMinus1_1 = header->b_normalizedToMinus1_1;
+	b_range = header->b_range;
+	b_min = header->b_min;
+	cout << "accumulationCount: " << accumulationCount << endl;
+
+	if (column_min != NULL)
+		free(column_min);
+	if (column_max != NULL)
+		free(column_max);
+	column_min = (float*)malloc(numFeatures*sizeof(float));
+	column_max = (float*)malloc(numFeatures*sizeof(float));
+	memcpy(column_min, stats, numFeatures*sizeof(float));
+	memcpy(column_max, stats + numFeatures, numFeatures*sizeof(float));
+
+	if (a != NULL)
+		free(a);
+	a = (float*)malloc(numSamples*numFeatures*sizeof(float));
+	if (b != NULL)
+		free(b);
+	b = (float*)malloc(numSamples*sizeof(float));
+	if (bi != NULL)
+		free(bi);
+	bi = (int*)malloc(numSamples*sizeof(int));
+
+	uint32_t rowWords = accumulationCount*numValuesPerLine;
+	float* rows = (float*)(file + header->sections[0].offset);
+	for (uint32_t i = 0; i < numSamples; i++) {
+		memcpy(a + i*numFeatures, rows + (uint64_t)i*rowWords, numFeatures*sizeof(float));
+		b[i] = rows[(uint64_t)i*rowWords + rowWords-1];
+		bi[i] = (int)(b[i]*(float)b_toIntegerScaler);
+	}
+
+	numberOfIndices = section->numberOfIndices;
+	numCacheLines = section->cacheLinesPerIndex;
+	if (gotFPGA == 1) {
+		if (reserve_workspace(section->size/CL(1), 0, 0) == 0) {
+			munmap(file, st.st_size);
+			return 0;
+		}
+		uint32_t numWords = section->size/sizeof(uint32_t);
+		uint32_t copied = interfaceFPGA->writeToMemory('i', file + section->offset, 0, numWords, numCPUThreads);
+		if (copied != numWords)
+			cout << "FPGA workspace holds only " << copied << " of " << numWords << " words" << endl;
+	}
+	munmap(file, st.st_size);
+
+	cout << "numSamples: " << numSamples << endl;
+	cout << "numFeatures: " << numFeatures << endl;
+	cout << "numberOfIndices: " << numberOfIndices << endl;
+	return numCacheLines;
+}
+
+char zipml_sgd::save_models(char* pathToFile, float* xs[], uint32_t numClasses) {
+	model_file_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = MODEL_FILE_MAGIC;
+	header.version = MODEL_FILE_VERSION;
+	header.numClasses = numClasses;
+	header.numFeatures = numFeatures;
+	header.b_normalizedToMinus1_1 = b_normalizedToMinus1_1;
+	header.b_range = b_range;
+	header.b_min = b_min;
+
+	FILE* f = fopen(pathToFile, "wb");
+	if (f == NULL) {
+		cout << "Could not open " << pathToFile << endl;
+		return -1;
+	}
+	char success = 1;
+	success &= (fwrite(&header, sizeof(header), 1, f) == 1);
+	for (uint32_t c = 0; c < numClasses; c++) {
+		success &= (fwrite(xs[c], sizeof(float), numFeatures, f) == numFeatures);
+	}
+	fclose(f);
+
+	if (!success) {
+		cout << "Write to " << pathToFile << " failed" << endl;
+		return -1;
+	}
+	cout << "Wrote " << numClasses << " models to " << pathToFile << endl;
+	return 0;
+}
+
+// Row mode: each row is scanned and scaled while it is in cache. Column mode:
+// one row-major pass collects per-column partials, a second one scales.
+static void* normalize_worker(void* arg) {
+	normalize_args* args = (normalize_args*)arg;
+	uint32_t numFeatures = args->numFeatures;
+	for (uint32_t i = args->firstSample; i < args->lastSample; i++) {
+		float* row = args->a + (uint64_t)i*numFeatures;
+		if (args->rowOrColumnWise == 'r') {
+			float amin = numeric_limits<float>::max();
+			float amax = numeric_limits<float>::min();
+			minmax_row(row, numFeatures, &amin, &amax);
+			float arange = amax - amin;
+			if (arange > 0)
+				scale_row(row, amin, arange, (args->toMinus1_1 == 1) ? 2.0f : 1.0f, (args->toMinus1_1 == 1) ? -1.0f : 0.0f, numFeatures);
+		}
+		else if (args->scale == 0) {
+			minmax_columns(row, args->amin, args->amax, numFeatures);
+		}
+		else {
+			scale_columns(row, args->offset, args->range, args->mul, args->add, numFeatures);
+		}
+	}
+	return NULL;
+}
+
+void zipml_sgd::a_normalize(char toMinus1_1, char rowOrColumnWise) {
+	if (require_dense("a_normalize") == 0)
+		return;
+	a_normalizedToMinus1_1 = toMinus1_1;
+
+	uint32_t numThreads = numCPUThreads;
+	if (numThreads > numSamples/64 + 1) // At least 64 samples per thread
+		numThreads = numSamples/64 + 1;
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+	normalize_args* args = (normalize_args*)malloc(numThreads*sizeof(normalize_args));
+	float* partials = NULL;
+	float* factors = NULL;
+	if (rowOrColumnWise != 'r') {
+		partials = (float*)malloc(2*(uint64_t)numThreads*numFeatures*sizeof(float));
+		factors = (float*)malloc(4*numFeatures*sizeof(float));
+		for (uint64_t j = 0; j < (uint64_t)numThreads*numFeatures; j++) {
+			partials[j] = numeric_limits<float>::max();
+			partials[(uint64_t)numThreads*numFeatures + j] = numeric_limits<float>::min();
+		}
+	}
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].a = a;
+		args[t].numFeatures = numFeatures;
+		args[t].firstSample = (uint64_t)numSamples*t/numThreads;
+		args[t].lastSample = (uint64_t)numSamples*(t+1)/numThreads;
+		args[t].rowOrColumnWise = rowOrColumnWise;
+		args[t].toMinus1_1 = toMinus1_1;
+		args[t].scale = 0;
+		if (partials != NULL) {
+			args[t].amin = partials + (uint64_t)t*numFeatures;
+			args[t].amax = partials + (uint64_t)(numThreads + t)*numFeatures;
+			args[t].offset = factors;
+			args[t].range = factors + numFeatures;
+			args[t].mul = factors + 2*numFeatures;
+			args[t].add = factors + 3*numFeatures;
+		}
+	}
+
+	for (uint32_t pass = 0; pass < ((rowOrColumnWise == 'r') ? 1 : 2); pass++) {
+		for (uint32_t t = 1; t < numThreads; t++)
+			pthread_create(&threads[t], NULL, normalize_worker, &args[t]);
+		normalize_worker(&args[0]);
+		for (uint32_t t = 1; t < numThreads; t++)
+			pthread_join(threads[t], NULL);
+		if (pass == 1)
+			break;
+
+		if (partials != NULL) {
+			// Merge the partials into the factors of the second pass
+			float* offset = factors;
+			float* range = factors + numFeatures;
+			float* mul = factors + 2*numFeatures;
+			float* add = factors + 3*numFeatures;
+			for (uint32_t j = 0; j < numFeatures; j++) {
+				float amin = args[0].amin[j];
+				float amax = args[0].amax[j];
+				for (uint32_t t = 1; t < numThreads; t++) {
+					amin = args[t].amin[j] < amin ? args[t].amin[j] : amin;
+					amax = args[t].amax[j] > amax ? args[t].amax[j] : amax;
+				}
+				float arange = amax - amin;
+				if (j > 0 && arange > 0) { // Don't normalize bias
+					offset[j] = amin;
+					range[j] = arange;
+					mul[j] = (toMinus1_1 == 1) ? 2.0f : 1.0f;
+					add[j] = (toMinus1_1 == 1) ? -1.0f : 0.0f;
+				}
+				else {
+					offset[j] = 0.0f;
+					range[j] = 1.0f;
+					mul[j] = 1.0f;
+					add[j] = 0.0f;
+				}
+			}
+			for (uint32_t t = 0; t < numThreads; t++)
+				args[t].scale = 1;
+		}
+	}
+
+	if (partials != NULL) {
+		free(partials);
+		free(factors);
+	}
+	free(threads);
+	free(args);
+}
+
+void zipml_sgd::b_normalize(char toMinus1_1, char binarize_b, float b_toBinarizeTo) {
+	b_normalizedToMinus1_1 = toMinus1_1;
+	if (binarize_b == 0) {
+		float bmin = numeric_limits<float>::max();
+		float bmax = numeric_limits<float>::min();
+		minmax_row(b, numSamples, &bmin, &bmax);
+		cout << "bmax: " << bmax << ", bmin: " << bmin << endl;
+		float brange = bmax - bmin;
+		if (brange > 0) {
+			scale_row(b, bmin, brange, (toMinus1_1 == 1) ? 2.0f : 1.0f, (toMinus1_1 == 1) ? -1.0f : 0.0f, numSamples);
+			convert_float_to_integer(b, bi, (float)b_toIntegerScaler, numSamples);
+		}
+		b_min = bmin;
+		b_range = brange;
+	}
+	else {
+		for (uint32_t i = 0; i < numSamples; i++) {
 			if(b[i] == b_toBinarizeTo)
 				b[i] = 1.0;
 			else
 				b[i] = -1.0;
-
-			bi[i] = (int)(b[i]*(float)b_toIntegerScaler);
 		}
+		convert_float_to_integer(b, bi, (float)b_toIntegerScaler, numSamples);
 		b_min = -1.0;
 		b_range = 2.0;
 	}
 }
 
+char zipml_sgd::reserve_workspace(uint64_t numInputCacheLines, uint64_t numOutputCacheLines, uint64_t usedInputBytes) {
+	// Growing reprograms the page tables, and the callers go on to write the
+	// workspace: neither may happen under a running job
+	interfaceFPGA->waitIdle();
+	uint64_t numCacheLinesNeeded = (numInputCacheLines > numOutputCacheLines) ? numInputCacheLines : numOutputCacheLines;
+	uint64_t pagesNeeded = (numCacheLinesNeeded + page_size_in_cache_lines-1)/page_size_in_cache_lines;
+	if (pagesNeeded == 0)
+		pagesNeeded = 1;
+	if (pagesNeeded > pages_to_allocate) {
+		pages_to_allocate = interfaceFPGA->growWorkspace(pagesNeeded > MAX_page_count ? MAX_page_count : pagesNeeded);
+		cout << "Workspace grown to " << pages_to_allocate << " pages, " << CL((uint64_t)pages_to_allocate*page_size_in_cache_lines)/1e6 << " MB each for input and output" << endl;
+	}
+	if (usedInputBytes > 0) {
+		uint64_t inputBytes = CL(numInputCacheLines);
+		uint64_t reservedBytes = CL((uint64_t)pages_to_allocate*page_size_in_cache_lines);
+		cout << "Input: " << inputBytes << " bytes, of which padding: " << inputBytes-usedInputBytes << " (" << 100.0*(inputBytes-usedInputBytes)/inputBytes << "%), unused workspace: " << (reservedBytes > inputBytes ? reservedBytes-inputBytes : 0) << " bytes" << endl;
+	}
+	if (pagesNeeded > pages_to_allocate) {
+		cout << "Data needs " << pagesNeeded << " pages, the workspace has only " << pages_to_allocate << endl;
+		return 0;
+	}
+	return 1;
+}
+
 uint32_t zipml_sgd::copy_data_into_FPGA_memory() {
+	if (require_dense("copy_data_into_FPGA_memory") == 0)
+		return 0;
 	uint32_t address32 = 0;
-	// Copy data to FPGA shared memory
+	uint32_t rowWords = accumulationCount*numValuesPerLine;
+	if (reserve_workspace((uint64_t)numSamples*accumulationCount, 0, (uint64_t)numSamples*(numFeatures+1)*sizeof(float)) == 0)
+		return 0;
+	float* row = (float*)calloc(rowWords, sizeof(float));
+	// Copy data to FPGA shared memory, one padded row at a time
 	for (uint32_t i = 0; i < numSamples; i++) {
-		for (uint32_t j = 0; j < numFeatures; j++) {
-			interfaceFPGA->writeToMemoryFloat('i', a[i*numFeatures + j], address32);
-			address32++;
-		}
-		for (uint32_t k = 0; k < (numValuesPerLine-1)-numFeatures%numValuesPerLine; k++) {
-			interfaceFPGA->writeToMemoryFloat('i', 0, address32);
-			address32++;
-		}
-		interfaceFPGA->writeToMemoryFloat('i', b[i], address32);
-		address32++;
+		memcpy(row, a + i*numFeatures, numFeatures*sizeof(float));
+		row[rowWords-1] = b[i];
+		interfaceFPGA->writeToMemory('i', row, address32, rowWords);
+		address32 += rowWords;
 	}
+	free(row);
 	cout << "address32: " << address32 << endl;
 	uint32_t cacheLines = address32/numValuesPerLine;
 	numCacheLines = cacheLines;
@@ -480,124 +2088,83 @@ uint32_t zipml_sgd::copy_data_into_FPGA_memory() {
 }
 
 uint32_t zipml_sgd::copy_data_into_FPGA_memory_after_quantization(int quantizationBits, int _numberOfIndices, uint32_t address32offset) {
+	if (require_dense("copy_data_into_FPGA_memory_after_quantization") == 0)
+		return 0;
 	numberOfIndices = _numberOfIndices;
 
+	if (quantizationBits != 1 && quantizationBits != 2 && quantizationBits != 4 && quantizationBits != 8) {
+		cout << "FPGA can only handle 1, 2, 4, 8 bit quantization." << endl;
+		return 0;
+	}
+
+	uint32_t elementsPerWord = 16/quantizationBits;
+	uint64_t indexCacheLines = (uint64_t)numSamples*get_number_of_words_per_packed_row(quantizationBits)/16;
+	uint64_t usedIndexBytes = (uint64_t)numSamples*((numFeatures + elementsPerWord-1)/elementsPerWord + 1)*sizeof(uint32_t);
+	if (reserve_workspace(address32offset/16 + _numberOfIndices*indexCacheLines, 0, _numberOfIndices*usedIndexBytes) == 0)
+		return 0;
+
 	uint32_t address32 = address32offset;
-	uint32_t address16 = 0;
-	uint32_t address8 = 0;
-	uint32_t address4 = 0;
-	uint32_t address2 = 0;
-	int aiq1[numSamples*numFeatures];
-	int aiq2[numSamples*numFeatures];
 	for (int i = 0; i < _numberOfIndices; i++) {
-		quantize_data_integer(aiq1, quantizationBits);
-		quantize_data_integer(aiq2, quantizationBits);
-
-		for (uint32_t i = 0; i < numSamples; i++) {
-			uint32_t temp = 0;
-			for (uint32_t j = 0; j < numFeatures; j++) {
-				int q1 = aiq1[i*numFeatures + j];
-				int q2 = aiq2[i*numFeatures + j];
-				
-				if (quantizationBits == 1) {
-					temp = temp | ( (((q2&0x1)<<1 | (q1&0x1))&0x3) << (2*(address2%16)) ) ;
-					address2++;
-					if (address2%16 == 0) {
-						interfaceFPGA->writeToMemory32('i', temp, address32);
-						address32++;
-						temp = 0;
-					}
-				}
-				else if (quantizationBits == 2) {
-					temp = temp | ( (((q2&0x3)<<2 | (q1&0x3))&0xF) << (4*(address4%8)) ) ;
-					address4++;
-					if (address4%8 == 0) {
-						interfaceFPGA->writeToMemory32('i', temp, address32);
-						address32++;
-						temp = 0;
-					}
-				}
-				else if (quantizationBits == 4) {
-					temp = temp | ( (((q2&0xF)<<4 | (q1&0xF))&0xFF) << (8*(address8%4)) ) ;
-					address8++;
-					if (address8%4 == 0) {
-						interfaceFPGA->writeToMemory32('i', temp, address32);
-						address32++;
-						temp = 0;
-					}
-				}
-				else if (quantizationBits == 8) {
-					temp = temp | ( (((q2&0xFF)<<8 | (q1&0xFF))&0xFFFF) << (16*(address16%2)) ) ;
-					address16++;
-					if (address16%2 == 0) {
-						interfaceFPGA->writeToMemory32('i', temp, address32);
-						address32++;
-						temp = 0;
-					}
-				}
-				else {
-					cout << "FPGA can only handle 1, 2, 4, 8 bit quantization." << endl;
-					return 0;
-				}
-			}
-			if (quantizationBits == 1) {
-				if (address2%16 != 0) {
-					interfaceFPGA->writeToMemory32('i', temp, address32);
-					address32++;
-					address2 += 16-address2%16;
-					temp = 0;
-				}
-			}
-			else if (quantizationBits == 2) {
-				if (address4%8 != 0) {
-					interfaceFPGA->writeToMemory32('i', temp, address32);
-					address32++;
-					address4 += 8-address4%8;
-					temp = 0;
-				}
-			}
-			else if (quantizationBits == 4) {
-				if (address8%4 != 0) {
-					interfaceFPGA->writeToMemory32('i', temp, address32);
-					address32++;
-					address8 += 4-address8%4;
-					temp = 0;
-				}
-			}
-			else if (quantizationBits == 8) {
-				if (address16%2 != 0) {
-					interfaceFPGA->writeToMemory32('i', temp, address32);
-					address32++;
-					address16 += 2-address16%2;
-					temp = 0;
-				}
-			}
-			uint32_t address32untilNow = address32;
-			for (uint32_t k = 0; k < 15-address32untilNow%16; k++) {
-				//interfaceFPGA->writeToMemory32('i', 0, address32);
-				address32++;
-				address2 += 16;
-				address4 += 8;
-				address8 += 4;
-				address16 += 2;
-			}
-			interfaceFPGA->writeToMemory32('i', bi[i], address32);
-			address32++;
-			address2 += 16;
-			address4 += 8;
-			address8 += 4;
-			address16 += 2;	
-		}
+		address32 += copy_quantized_index_into_FPGA_memory(quantizationBits, address32);
 	}
-	/*cout << "address32: " << address32 << endl;
-	cout << "address2: " << address2 << endl;
-	cout << "address4: " << address4 << endl;
-	cout << "address8: " << address8 << endl;
-	cout << "address16: " << address16 << endl;*/
+
 	uint32_t cacheLines = address32/16;
 	return cacheLines/numberOfIndices;
 }
 
+uint32_t zipml_sgd::copy_quantized_index_into_FPGA_memory(int quantizationBits, uint32_t address32) {
+	int* aiq1 = (int*)malloc(2*numSamples*numFeatures*sizeof(int));
+	int* aiq2 = aiq1 + numSamples*numFeatures;
+	uint32_t* packed = (uint32_t*)malloc(numSamples*get_number_of_words_per_packed_row(quantizationBits)*sizeof(uint32_t));
+
+	quantize_data_integer(aiq1, quantizationBits, 2);
+	uint32_t numWords = pack_quantized_data(packed, aiq1, aiq2, quantizationBits);
+	interfaceFPGA->writeToMemory('i', packed, address32, numWords, numCPUThreads);
+
+	free(aiq1);
+	free(packed);
+	return numWords;
+}
+
+uint32_t zipml_sgd::get_number_of_CLs_for_x(int quantizationBits) {
+	uint32_t numCLsForX = accumulationCount;
+	if (quantizationBits == 1 && numCLsForX%16 != 0)
+		numCLsForX = numCLsForX + (16-numCLsForX%16);
+	else if (quantizationBits == 2 && numCLsForX%8 != 0)
+		numCLsForX = numCLsForX + (8-numCLsForX%8);
+	else if (quantizationBits == 4 && numCLsForX%4 != 0)
+		numCLsForX = numCLsForX + (4-numCLsForX%4);
+	else if (quantizationBits == 8 && numCLsForX%2 != 0)
+		numCLsForX = numCLsForX + 1;
+	return numCLsForX;
+}
+
+// Every row: numFeatures elements of 2*quantizationBits bits (q1 low, q2 high)
+// packed from bit 0 on, padded to whole cache lines, label in the last 32-bit slot
+uint32_t zipml_sgd::get_number_of_words_per_packed_row(int quantizationBits) {
+	uint32_t elementsPerWord = 16/quantizationBits;
+	uint32_t dataWords = (numFeatures + elementsPerWord-1)/elementsPerWord;
+	return (dataWords/16 + 1)*16;
+}
+
+uint32_t zipml_sgd::pack_quantized_data(uint32_t packed[], int aiq1[], int aiq2[], int quantizationBits) {
+	uint32_t rowWords = get_number_of_words_per_packed_row(quantizationBits);
+	uint32_t elementsPerWord = 16/quantizationBits;
+	uint32_t mask = (1 << quantizationBits)-1;
+
+	memset(packed, 0, numSamples*rowWords*sizeof(uint32_t));
+	for (uint32_t i = 0; i < numSamples; i++) {
+		uint32_t* row = packed + i*rowWords;
+		for (uint32_t j = 0; j < numFeatures; j++) {
+			uint32_t q1 = aiq1[i*numFeatures + j] & mask;
+			uint32_t q2 = aiq2[i*numFeatures + j] & mask;
+			row[j/elementsPerWord] |= (q2 << quantizationBits | q1) << (2*quantizationBits*(j%elementsPerWord));
+		}
+		row[rowWords-1] = bi[i];
+	}
+	return numSamples*rowWords;
+}
+
 uint32_t zipml_sgd::get_number_of_CLs_needed_for_one_index(int quantizationBits) {
 	uint32_t address32 = 0;
 	uint32_t address16 = 0;
@@ -678,129 +2245,561 @@ uint32_t zipml_sgd::get_number_of_CLs_needed_for_one_index(int quantizationBits)
 	return cacheLines;
 }
 
-// Provide: int aiq[numSamples*numFeatures]
-void zipml_sgd::quantize_data_integer(int aiq[], uint32_t numBits) {
-	int numLevels = (1 << (numBits-1)) + 1;
+// Provide: int aiq[numSamples*numFeatures]
+// Row r of copy c only depends on (seed, stream + c, r), so the result does not
+// depend on how rows are distributed over threads
+static void* quantize_worker(void* arg) {
+	quantize_args* args = (quantize_args*)arg;
+	for (uint64_t r = args->firstRow; r < args->lastRow; r++) {
+		uint32_t copy = r/args->numSamples;
+		uint32_t i = r%args->numSamples;
+		uint32_t streamKey = counter_rng(args->seed, args->firstStream + copy);
+		if (args->row_ptr != NULL) {
+			uint64_t begin = args->row_ptr[i];
+			quantize_sparse_row(args->a + begin, args->columns + begin, args->aiq + copy*args->nnz + begin, args->row_ptr[i+1] - begin, args->scale, args->toMinus1_1, counter_rng(streamKey, i));
+			continue;
+		}
+		quantize_row(args->a + (uint64_t)i*args->numFeatures, args->aiq + r*args->numFeatures, args->numFeatures, args->scale, args->toMinus1_1, counter_rng(streamKey, i));
+	}
+	return NULL;
+}
+
+void zipml_sgd::quantize_data_integer(int aiq[], uint32_t numBits, uint32_t numCopies) {
+	int numLevels = (1 << (numBits-1)) + 1;
+
+	uint64_t numRows = (uint64_t)numCopies*numSamples;
+	uint32_t numThreads = numCPUThreads;
+	if (numThreads > numRows)
+		numThreads = numRows;
+	if (numThreads == 0)
+		numThreads = 1;
+
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+	quantize_args* args = (quantize_args*)malloc(numThreads*sizeof(quantize_args));
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].a = is_sparse() ? csr_values : a;
+		args[t].columns = csr_columns;
+		args[t].row_ptr = is_sparse() ? csr_row_ptr : NULL;
+		args[t].nnz = csr_nnz;
+		args[t].aiq = aiq;
+		args[t].numFeatures = numFeatures;
+		args[t].numSamples = numSamples;
+		if (a_normalizedToMinus1_1 == 0)
+			args[t].scale = numLevels-1;
+		else
+			args[t].scale = (numLevels-1)/2;
+		args[t].toMinus1_1 = a_normalizedToMinus1_1;
+		args[t].seed = quantizationSeed;
+		args[t].firstStream = quantizationStream;
+		args[t].firstRow = numRows*t/numThreads;
+		args[t].lastRow = numRows*(t+1)/numThreads;
+	}
+	if (numThreads == 1) {
+		quantize_worker(&args[0]);
+	}
+	else {
+		for (uint32_t t = 0; t < numThreads; t++) {
+			pthread_create(&threads[t], NULL, quantize_worker, &args[t]);
+		}
+		for (uint32_t t = 0; t < numThreads; t++) {
+			pthread_join(threads[t], NULL);
+		}
+	}
+	quantizationStream += numCopies;
+
+	free(threads);
+	free(args);
+}
+
+// Provide: float x_history[numEpochs*numFeatures]
+void zipml_sgd::float_linreg_SGD(float x_history[], uint32_t numEpochs, float stepSize, float loss_history[]) {
+	if (require_dense("float_linreg_SGD") == 0)
+		return;
+	// float x[numFeatures];
+	// for (uint32_t j = 0; j < numFeatures; j++) {
+	// 	x[j] = 0.0;
+	// }
+
+	// for(uint32_t epoch = 0; epoch < numEpochs; epoch++) {
+	// 	for (uint32_t i = 0; i < numSamples; i++) {
+	// 		float dot = 0;
+	// 		for (uint32_t j = 0; j < numFeatures; j++) {
+	// 			dot += x[j]*a[i*numFeatures + j];
+	// 		}
+	// 		for (uint32_t j = 0; j < numFeatures; j++) {
+	// 			x[j] -= stepSize*(dot - b[i])*a[i*numFeatures + j];
+	// 		}
+	// 	}
+	// 	for (uint32_t j = 0; j < numFeatures; j++) {
+	// 		x_history[epoch*numFeatures + j] = x[j];
+	// 	}
+	// 	cout << epoch << endl;
+	// }
+
+	// Mini-batches: float_linreg_SGD_minibatch
+	float* x = (float*)malloc(numFeatures*sizeof(float));
+	for (uint32_t j = 0; j < numFeatures; j++) {
+		x[j] = 0.0;
+	}
+
+	const float_kernels& kernels = get_float_kernels();
+
+	for(uint32_t epoch = 0; epoch < numEpochs; epoch++) {
+		// Progressive loss: each error is already computed for the update
+		double loss = 0;
+
+		// The update for sample i and the dot product for sample i+1 share one pass over x
+		float dot = kernels.dot(x, a, numFeatures);
+		for (uint32_t i = 0; i < numSamples; i++) {
+			float* ai = a + i*numFeatures;
+			float error = dot - b[i];
+			loss += (double)error*error;
+			float alpha = -stepSize*error;
+			if (i+1 < numSamples)
+				dot = kernels.axpy_dot(x, ai, alpha, ai + numFeatures, numFeatures);
+			else
+				kernels.axpy(x, ai, alpha, numFeatures);
+		}
+		for (uint32_t j = 0; j < numFeatures; j++) {
+			x_history[epoch*numFeatures + j] = x[j];
+			
+		}
+		if (loss_history != NULL)
+			loss_history[epoch] = (float)(loss/(2.0*numSamples));
+		cout << epoch << endl;
+	}
+	free(x);
+}
+
+// Each thread walks its own sample range and updates the shared x without locks.
+// With atomicUpdates, x is accessed with relaxed atomic loads and CAS-based adds,
+// otherwise with plain (racy) vector loads and stores.
+static void* hogwild_worker(void* arg) {
+	hogwild_args* args = (hogwild_args*)arg;
+	const float_kernels& kernels = get_float_kernels();
+	uint32_t numFeatures = args->numFeatures;
+	float* x = args->x;
+
+	for(uint32_t epoch = 0; epoch < args->numEpochs; epoch++) {
+		for (uint32_t i = args->firstSample; i < args->lastSample; i++) {
+			float* ai = args->a + i*numFeatures;
+			if (args->atomicUpdates == 1) {
+				float dot = 0;
+				for (uint32_t j = 0; j < numFeatures; j++) {
+					float xj;
+					__atomic_load(x + j, &xj, __ATOMIC_RELAXED);
+					dot += xj*ai[j];
+				}
+				float alpha = -args->stepSize*(dot - args->b[i]);
+				for (uint32_t j = 0; j < numFeatures; j++) {
+					float expected, desired;
+					__atomic_load(x + j, &expected, __ATOMIC_RELAXED);
+					do {
+						desired = expected + alpha*ai[j];
+					} while (!__atomic_compare_exchange(x + j, &expected, &desired, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+				}
+			}
+			else {
+				float dot = kernels.dot(x, ai, numFeatures);
+				kernels.axpy(x, ai, -args->stepSize*(dot - args->b[i]), numFeatures);
+			}
+		}
+
+		if (pthread_barrier_wait(args->barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+			for (uint32_t j = 0; j < numFeatures; j++) {
+				args->x_history[epoch*numFeatures + j] = x[j];
+			}
+		}
+		pthread_barrier_wait(args->barrier);
+	}
+	return NULL;
+}
+
+// Provide: float x_history[numEpochs*numFeatures]
+double zipml_sgd::float_linreg_SGD_hogwild(float x_history[], uint32_t numEpochs, float stepSize, uint32_t numThreads, char atomicUpdates) {
+	if (require_dense("float_linreg_SGD_hogwild") == 0)
+		return 0;
+	if (numThreads == 0)
+		numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numThreads > numSamples)
+		numThreads = numSamples;
+	if (numThreads == 0) // No samples, one thread still writes the epoch models
+		numThreads = 1;
+
+	float* x = (float*)malloc(numFeatures*sizeof(float));
+	for (uint32_t j = 0; j < numFeatures; j++) {
+		x[j] = 0.0;
+	}
+
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, NULL, numThreads);
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+	hogwild_args* args = (hogwild_args*)malloc(numThreads*sizeof(hogwild_args));
+
+	double start = get_time();
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].a = a;
+		args[t].b = b;
+		args[t].x = x;
+		args[t].x_history = x_history;
+		args[t].numFeatures = numFeatures;
+		args[t].numEpochs = numEpochs;
+		args[t].firstSample = (uint64_t)numSamples*t/numThreads;
+		args[t].lastSample = (uint64_t)numSamples*(t+1)/numThreads;
+		args[t].stepSize = stepSize;
+		args[t].atomicUpdates = atomicUpdates;
+		args[t].barrier = &barrier;
+		pthread_create(&threads[t], NULL, hogwild_worker, &args[t]);
+	}
+	for (uint32_t t = 0; t < numThreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	double end = get_time();
+
+	double samplesPerSecond = (double)numSamples*numEpochs/(end-start);
+	cout << "Hogwild! threads: " << numThreads << (atomicUpdates == 1 ? " (atomic)" : " (racy)") << ", samples/s: " << samplesPerSecond << endl;
+
+	pthread_barrier_destroy(&barrier);
+	free(threads);
+	free(args);
+	free(x);
+
+	return samplesPerSecond;
+}
+
+// Every thread computes the gradient of its share of the batch into its own
+// buffer. The buffers are then summed pairwise in log2(numThreads) rounds, each
+// pair on its own thread, and thread 0 applies the update.
+static void* minibatch_worker(void* arg) {
+	minibatch_args* args = (minibatch_args*)arg;
+	const float_kernels& kernels = get_float_kernels();
+	uint32_t numFeatures = args->numFeatures;
+	uint32_t numThreads = args->numThreads;
+	uint32_t id = args->id;
+	float* gradient = args->gradients + (uint64_t)id*args->gradientStride;
+
+	for (uint32_t epoch = 0; epoch < args->numEpochs; epoch++) {
+		// Summed locally, args sit next to each other and thread 0 reads them
+		double epochLoss = 0;
+		for (uint32_t first = 0; first < args->numSamples; first += args->minibatchSize) {
+			uint32_t count = (args->numSamples - first < args->minibatchSize) ? args->numSamples - first : args->minibatchSize;
+			uint32_t firstSample = first + (uint64_t)count*id/numThreads;
+			uint32_t lastSample = first + (uint64_t)count*(id+1)/numThreads;
+
+			memset(gradient, 0, numFeatures*sizeof(float));
+			for (uint32_t i = firstSample; i < lastSample; i++) {
+				float* ai = args->a + (uint64_t)i*numFeatures;
+				float error = kernels.dot(args->x, ai, numFeatures) - args->b[i];
+				epochLoss += (double)error*error;
+				kernels.axpy(gradient, ai, error, numFeatures);
+			}
+			args->loss = epochLoss;
+			spin_barrier_wait(args->barrier);
+
+			for (uint32_t distance = 1; distance < numThreads; distance *= 2) {
+				if (id%(2*distance) == 0 && id + distance < numThreads)
+					kernels.axpy(gradient, gradient + (uint64_t)distance*args->gradientStride, 1.0f, numFeatures);
+				spin_barrier_wait(args->barrier);
+			}
+
+			if (id == 0)
+				kernels.axpy(args->x, gradient, -args->stepSize, numFeatures);
+			spin_barrier_wait(args->barrier);
+		}
+
+		if (id == 0) {
+			memcpy(args->x_history + (uint64_t)epoch*numFeatures, args->x, numFeatures*sizeof(float));
+			if (args->loss_history != NULL) {
+				double loss = 0;
+				for (uint32_t t = 0; t < numThreads; t++)
+					loss += args->all[t].loss;
+				args->loss_history[epoch] = (float)(loss/(2.0*args->numSamples));
+			}
+		}
+		spin_barrier_wait(args->barrier);
+	}
+	return NULL;
+}
+
+// Provide: float x_history[numEpochs*numFeatures]
+double zipml_sgd::float_linreg_SGD_minibatch(float x_history[], uint32_t numEpochs, float stepSize, uint32_t minibatchSize, uint32_t numThreads, float loss_history[]) {
+	if (require_dense("float_linreg_SGD_minibatch") == 0)
+		return 0;
+	if (minibatchSize == 0)
+		minibatchSize = 1;
+	if (numThreads == 0)
+		numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numThreads > minibatchSize)
+		numThreads = minibatchSize;
+
+	float* x = (float*)calloc(numFeatures, sizeof(float));
+	uint32_t gradientStride = (numFeatures + MINIBATCH_GRADIENT_STRIDE-1)/MINIBATCH_GRADIENT_STRIDE*MINIBATCH_GRADIENT_STRIDE;
+	float* gradients = (float*)aligned_alloc(64, (uint64_t)numThreads*gradientStride*sizeof(float));
+
+	spin_barrier barrier;
+	barrier.count = 0;
+	barrier.generation = 0;
+	barrier.numThreads = numThreads;
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+	minibatch_args* args = (minibatch_args*)malloc(numThreads*sizeof(minibatch_args));
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].a = a;
+		args[t].b = b;
+		args[t].x = x;
+		args[t].x_history = x_history;
+		args[t].loss_history = loss_history;
+		args[t].gradients = gradients;
+		args[t].gradientStride = gradientStride;
+		args[t].numFeatures = numFeatures;
+		args[t].numSamples = numSamples;
+		args[t].numEpochs = numEpochs;
+		args[t].minibatchSize = minibatchSize;
+		args[t].id = t;
+		args[t].numThreads = numThreads;
+		args[t].stepSize = stepSize;
+		args[t].loss = 0;
+		args[t].all = args;
+		args[t].barrier = &barrier;
+	}
 
-	if (a_normalizedToMinus1_1 == 0) {
-		for (uint32_t j = 0; j < numFeatures; j++) { // For every feature
-			for (uint32_t i = 0; i < numSamples; i++) { // For every sample
+	double start = get_time();
+	for (uint32_t t = 1; t < numThreads; t++) {
+		pthread_create(&threads[t], NULL, minibatch_worker, &args[t]);
+	}
+	minibatch_worker(&args[0]);
+	for (uint32_t t = 1; t < numThreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	double end = get_time();
 
-				float scaledElement = a[i*numFeatures+j]*(numLevels-1);
-				int baseLevel = (int)scaledElement;
-				
-				float toBaseLevelProbability = 1.0 - (scaledElement - (float)baseLevel);
+	double samplesPerSecond = (double)numSamples*numEpochs/(end-start);
+	cout << "Mini-batch SGD, batch: " << minibatchSize << ", threads: " << numThreads << ", samples/s: " << samplesPerSecond << endl;
 
-				float probability = ((float)rand())/RAND_MAX; //0 to 1
-				//float probability = 0.5;
-				if (toBaseLevelProbability > probability)
-					aiq[i*numFeatures + j] = (int)(baseLevel);
-				else
-					aiq[i*numFeatures + j] = (int)(baseLevel+1);
-			}
+	free(threads);
+	free(args);
+	free(gradients);
+	free(x);
+	return samplesPerSecond;
+}
+
+// Provide: float x_history[numEpochs*numFeatures]
+// The model is split across threads by features: every thread computes the dot
+// product over its own range, all partial sums are exchanged through a double
+// buffer with one barrier per sample, and every thread updates its own range.
+static void* qfixed_worker(void* arg) {
+	qfixed_args* args = (qfixed_args*)arg;
+	const fixed_kernels& kernels = get_fixed_kernels();
+	const packed_kernels& pkernels = get_packed_kernels();
+	uint32_t first = args->firstFeature;
+	uint32_t length = args->lastFeature - args->firstFeature;
+
+	for (uint32_t i = 0; i < args->numSamples; i++) {
+		uint32_t* row = NULL;
+		int32_t partial;
+		if (args->packed != NULL) {
+			row = args->packed + i*args->rowWords;
+			partial = pkernels.dot(args->xi, row, first, length, args->quantizationBits, args->numBitsToShift);
+		}
+		else {
+			partial = kernels.dot(args->xi + first, args->aiq1 + i*args->numFeatures + first, args->numBitsToShift, length);
+		}
+
+		int32_t* partials = args->partial_dot + (i&1)*args->numThreads*QFIXED_PARTIAL_STRIDE;
+		partials[args->id*QFIXED_PARTIAL_STRIDE] = partial;
+		spin_barrier_wait(args->barrier);
+		uint32_t dot = 0;
+		for (uint32_t t = 0; t < args->numThreads; t++) {
+			dot += (uint32_t)partials[t*QFIXED_PARTIAL_STRIDE];
 		}
+
+		int32_t error = (int32_t)dot - ((args->packed != NULL) ? (int32_t)row[args->rowWords-1] : args->bi[i]);
+		if (args->id == 0)
+			args->loss += (double)error*error;
+
+		if (args->packed != NULL)
+			pkernels.update(args->xi, row, first, length, args->quantizationBits, error, args->stepSizeShifter + args->numBitsToShift);
+		else
+			kernels.update(args->xi + first, args->aiq2 + i*args->numFeatures + first, error, args->stepSizeShifter + args->numBitsToShift, length);
 	}
-	else {
-		for (uint32_t j = 0; j < numFeatures; j++) { // For every feature
-			for (uint32_t i = 0; i < numSamples; i++) { // For every sample
-
-				float a_here = a[i*numFeatures + j];
-				if (a_here > 0) {
-					float scaledElement = a_here*((numLevels-1)/2);
-					int baseLevel = (int)scaledElement;
-					
-					float toBaseLevelProbability = 1.0 - (scaledElement - (float)baseLevel);
-
-					float probability = ((float)rand())/RAND_MAX; //0 to 1
-					//float probability = 0.5;
-					if (toBaseLevelProbability > probability)
-						aiq[i*numFeatures + j] = (int)(baseLevel);
-					else
-						aiq[i*numFeatures + j] = (int)(baseLevel+1);
-				}
-				else {
-					float temp = -a_here;
+	return NULL;
+}
 
-					float scaledElement = temp*((numLevels-1)/2);
-					int baseLevel = (int)scaledElement;
+void zipml_sgd::Qfixed_train(float x_history[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, uint32_t numThreads, uint32_t* packed, uint32_t numberOfPackedIndices, float loss_history[]) {
+	int32_t* xi = (int32_t*)malloc(numFeatures*sizeof(int32_t));
+	for (uint32_t j = 0; j < numFeatures; j++) {
+		xi[j] = 0;
+	}
 
-					float toBaseLevelProbability = 1.0 - (scaledElement - (float)baseLevel);
+	int numBitsToShift;
+	if (a_normalizedToMinus1_1 == 0)
+		numBitsToShift = quantizationBits-1;
+	else
+		numBitsToShift = quantizationBits-2;
 
-					float probability = ((float)rand())/RAND_MAX; //0 to 1
-					//float probability = 0.5;
-					if (toBaseLevelProbability > probability)
-						aiq[i*numFeatures + j] = (int)(-(baseLevel));
-					else
-						aiq[i*numFeatures + j] = (int)(-(baseLevel+1));
-				}
+	// Threads get whole cache lines of the model
+	uint32_t numFeatureLines = (numFeatures + QFIXED_PARTIAL_STRIDE-1)/QFIXED_PARTIAL_STRIDE;
+	if (numThreads == 0)
+		numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (numThreads > numFeatureLines)
+		numThreads = numFeatureLines;
+
+	uint32_t rowWords = get_number_of_words_per_packed_row(quantizationBits);
+
+	spin_barrier barrier;
+	barrier.count = 0;
+	barrier.generation = 0;
+	barrier.numThreads = numThreads;
+	int32_t* partial_dot = (int32_t*)calloc(2*numThreads*QFIXED_PARTIAL_STRIDE, sizeof(int32_t));
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+	qfixed_args* args = (qfixed_args*)malloc(numThreads*sizeof(qfixed_args));
+
+	int* aiq1 = NULL;
+	int* aiq2 = NULL;
+	if (packed == NULL) {
+		aiq1 = (int*)malloc(2*numSamples*numFeatures*sizeof(int));
+		aiq2 = aiq1 + numSamples*numFeatures;
+	}
+	for(uint32_t epoch = 0; epoch < numEpochs; epoch++) {
+		if (packed == NULL)
+			quantize_data_integer(aiq1, quantizationBits, 2);
+
+		for (uint32_t t = 0; t < numThreads; t++) {
+			args[t].xi = xi;
+			args[t].aiq1 = aiq1;
+			args[t].aiq2 = aiq2;
+			args[t].bi = bi;
+			args[t].numFeatures = numFeatures;
+			args[t].numSamples = numSamples;
+			args[t].firstFeature = (numFeatureLines*t/numThreads)*QFIXED_PARTIAL_STRIDE;
+			args[t].lastFeature = (numFeatureLines*(t+1)/numThreads)*QFIXED_PARTIAL_STRIDE;
+			if (args[t].lastFeature > numFeatures)
+				args[t].lastFeature = numFeatures;
+			args[t].id = t;
+			args[t].numThreads = numThreads;
+			args[t].numBitsToShift = numBitsToShift;
+			args[t].stepSizeShifter = stepSizeShifter;
+			args[t].partial_dot = partial_dot;
+			args[t].barrier = &barrier;
+			args[t].packed = (packed == NULL) ? NULL : packed + (epoch%numberOfPackedIndices)*numSamples*rowWords;
+			args[t].rowWords = rowWords;
+			args[t].quantizationBits = quantizationBits;
+			args[t].loss = 0;
+		}
+		if (numThreads == 1) {
+			qfixed_worker(&args[0]);
+		}
+		else {
+			for (uint32_t t = 0; t < numThreads; t++) {
+				pthread_create(&threads[t], NULL, qfixed_worker, &args[t]);
 			}
+			for (uint32_t t = 0; t < numThreads; t++) {
+				pthread_join(threads[t], NULL);
+			}
+		}
+
+		for (uint32_t j = 0; j < numFeatures; j++) {
+			x_history[epoch*numFeatures + j] = ((float)xi[j]/(float)b_toIntegerScaler);
 		}
+		// On the quantized samples the epoch trained on
+		if (loss_history != NULL)
+			loss_history[epoch] = (float)(args[0].loss/((double)b_toIntegerScaler*b_toIntegerScaler*2.0*numSamples));
+		cout << epoch << endl;
 	}
+	if (aiq1 != NULL)
+		free(aiq1);
+	free(xi);
+	free(partial_dot);
+	free(threads);
+	free(args);
 }
 
 // Provide: float x_history[numEpochs*numFeatures]
-void zipml_sgd::float_linreg_SGD(float x_history[], uint32_t numEpochs, float stepSize) {
-	// float x[numFeatures];
-	// for (uint32_t j = 0; j < numFeatures; j++) {
-	// 	x[j] = 0.0;
-	// }
+void zipml_sgd::Qfixed_linreg_SGD(float x_history[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, uint32_t numThreads, float loss_history[]) {
+	if (require_dense("Qfixed_linreg_SGD") == 0)
+		return;
+	Qfixed_train(x_history, numEpochs, stepSizeShifter, quantizationBits, numThreads, NULL, 0, loss_history);
+}
 
-	// for(uint32_t epoch = 0; epoch < numEpochs; epoch++) {
-	// 	for (uint32_t i = 0; i < numSamples; i++) {
-	// 		float dot = 0;
-	// 		for (uint32_t j = 0; j < numFeatures; j++) {
-	// 			dot += x[j]*a[i*numFeatures + j];
-	// 		}
-	// 		for (uint32_t j = 0; j < numFeatures; j++) {
-	// 			x[j] -= stepSize*(dot - b[i])*a[i*numFeatures + j];
-	// 		}
-	// 	}
-	// 	for (uint32_t j = 0; j < numFeatures; j++) {
-	// 		x_history[epoch*numFeatures + j] = x[j];
-	// 	}
-	// 	cout << epoch << endl;
-	// }
+// Provide: float x_history[numEpochs*numFeatures]
+// Epoch e uses quantization index e%_numberOfIndices, like qFSGD
+void zipml_sgd::Qpacked_linreg_SGD(float x_history[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, int _numberOfIndices, uint32_t numThreads, float loss_history[]) {
+	if (require_dense("Qpacked_linreg_SGD") == 0)
+		return;
+	if (quantizationBits != 1 && quantizationBits != 2 && quantizationBits != 4 && quantizationBits != 8) {
+		cout << "Packed layout can only handle 1, 2, 4, 8 bit quantization." << endl;
+		return;
+	}
+	uint32_t indexWords = numSamples*get_number_of_words_per_packed_row(quantizationBits);
+
+	int* aiq1 = (int*)malloc(2*numSamples*numFeatures*sizeof(int));
+	int* aiq2 = aiq1 + numSamples*numFeatures;
+	// One spare cache line, the kernels may read past the last row
+	uint32_t* packed = (uint32_t*)malloc((_numberOfIndices*indexWords + 16)*sizeof(uint32_t));
+	for (int index = 0; index < _numberOfIndices; index++) {
+		quantize_data_integer(aiq1, quantizationBits, 2);
+		pack_quantized_data(packed + index*indexWords, aiq1, aiq2, quantizationBits);
+	}
+	free(aiq1);
+	memset(packed + _numberOfIndices*indexWords, 0, 16*sizeof(uint32_t));
 
-	uint32_t minibatchSize = 1;
-	float* x = (float*)malloc(numFeatures*sizeof(float));
-	float* gradient = (float*)malloc(numFeatures*sizeof(float));
+	Qfixed_train(x_history, numEpochs, stepSizeShifter, quantizationBits, numThreads, packed, _numberOfIndices, loss_history);
+	free(packed);
+}
+
+// Provide: float x_history[numEpochs*numFeatures]
+// The model is kept as x = scale*v, so the L2 shrink of every epoch step is one
+// multiply of scale and each update only touches the nonzeros of the sample.
+void zipml_sgd::float_linreg_SGD_sparse(float x_history[], uint32_t numEpochs, float stepSize, float lambda, float loss_history[]) {
+	if (!is_sparse()) {
+		cout << "float_linreg_SGD_sparse needs data from load_libsvm_data_sparse" << endl;
+		return;
+	}
+	float* v = (float*)malloc(numFeatures*sizeof(float));
 	for (uint32_t j = 0; j < numFeatures; j++) {
-		x[j] = 0.0;
-		gradient[j] = 0.0;
+		v[j] = 0.0;
 	}
+	float scale = 1.0;
 
-	for(uint32_t epoch = 0; epoch < numEpochs; epoch++) {
+	const sparse_kernels& kernels = get_sparse_kernels();
 
+	for(uint32_t epoch = 0; epoch < numEpochs; epoch++) {
+		double loss = 0;
 		for (uint32_t i = 0; i < numSamples; i++) {
-			float dot = 0;
-			for (uint32_t j = 0; j < numFeatures; j++) {
-				dot += x[j]*a[i*numFeatures + j];
-			}
-			
-			for (uint32_t j = 0; j < numFeatures; j++) {
-				gradient[j] += (dot - b[i])*a[i*numFeatures + j];
-			}
-		
-			if ((i+1)%minibatchSize == 0) {
+			uint64_t begin = csr_row_ptr[i];
+			uint32_t nnz = csr_row_ptr[i+1] - begin;
+			float error = scale*kernels.dot(v, csr_values + begin, csr_columns + begin, nnz) - b[i];
+			loss += (double)error*error;
+
+			scale *= 1.0f - stepSize*lambda;
+			if (scale < 1e-6f) {
 				for (uint32_t j = 0; j < numFeatures; j++) {
-					x[j] -= stepSize*gradient[j];
-					gradient[j] = 0.0;
+					v[j] *= scale;
 				}
+				scale = 1.0;
 			}
+			kernels.axpy(v, csr_values + begin, csr_columns + begin, -stepSize*error/scale, nnz);
 		}
 		for (uint32_t j = 0; j < numFeatures; j++) {
-			x_history[epoch*numFeatures + j] = x[j];
-			
+			x_history[epoch*numFeatures + j] = scale*v[j];
 		}
+		if (loss_history != NULL)
+			loss_history[epoch] = (float)(loss/(2.0*numSamples));
 		cout << epoch << endl;
 	}
-	free(x);
-	free(gradient);
+	free(v);
 }
 
 // Provide: float x_history[numEpochs*numFeatures]
-void zipml_sgd::Qfixed_linreg_SGD(float x_history[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits) {
-	int xi[numFeatures];
+void zipml_sgd::Qfixed_linreg_SGD_sparse(float x_history[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, float loss_history[]) {
+	if (!is_sparse()) {
+		cout << "Qfixed_linreg_SGD_sparse needs data from load_libsvm_data_sparse" << endl;
+		return;
+	}
+	if (quantizationBits < 1 || quantizationBits > 8) {
+		cout << "Qfixed_linreg_SGD_sparse can only handle 1 to 8 bit quantization." << endl;
+		return;
+	}
+	int32_t* xi = (int32_t*)malloc(numFeatures*sizeof(int32_t));
 	for (uint32_t j = 0; j < numFeatures; j++) {
 		xi[j] = 0;
 	}
@@ -811,36 +2810,60 @@ void zipml_sgd::Qfixed_linreg_SGD(float x_history[], uint32_t numEpochs, int ste
 	else
 		numBitsToShift = quantizationBits-2;
 
-	int* aiq1 = (int*)malloc(numSamples*numFeatures*sizeof(int));
-	int* aiq2 = (int*)malloc(numSamples*numFeatures*sizeof(int));
+	const sparse_kernels& kernels = get_sparse_kernels();
+
+	// Two quantized copies of the nonzeros, laid out like csr_values
+	int* aiq1 = (int*)malloc(2*csr_nnz*sizeof(int));
+	int* aiq2 = aiq1 + csr_nnz;
 	for(uint32_t epoch = 0; epoch < numEpochs; epoch++) {
-		quantize_data_integer(aiq1, quantizationBits);
-		quantize_data_integer(aiq2, quantizationBits);
+		quantize_data_integer(aiq1, quantizationBits, 2);
 
+		double loss = 0;
 		for (uint32_t i = 0; i < numSamples; i++) {
-			int dot = 0;
-			for (uint32_t j = 0; j < numFeatures; j++) {
-				dot += (xi[j]*aiq1[i*numFeatures + j]) >> numBitsToShift;
-			}
-			for (uint32_t j = 0; j < numFeatures; j++) {
-				xi[j] -= ( ((dot - bi[i])*aiq2[i*numFeatures + j]) >> (stepSizeShifter + numBitsToShift) );
-			}
+			uint64_t begin = csr_row_ptr[i];
+			uint32_t nnz = csr_row_ptr[i+1] - begin;
+			int32_t dot = kernels.fixed_dot(xi, aiq1 + begin, csr_columns + begin, numBitsToShift, nnz);
+			int32_t error = dot - bi[i];
+			loss += (double)error*error;
+			kernels.fixed_update(xi, aiq2 + begin, csr_columns + begin, error, stepSizeShifter + numBitsToShift, nnz);
 		}
+
 		for (uint32_t j = 0; j < numFeatures; j++) {
 			x_history[epoch*numFeatures + j] = ((float)xi[j]/(float)b_toIntegerScaler);
 		}
+		if (loss_history != NULL)
+			loss_history[epoch] = (float)(loss/((double)b_toIntegerScaler*b_toIntegerScaler*2.0*numSamples));
 		cout << epoch << endl;
 	}
 	free(aiq1);
-	free(aiq2);
+	free(xi);
 }
 
 // Provide: float x[numFeatures]
 void zipml_sgd::floatFSGD(float x[], uint32_t numEpochs, float stepSize, int binarize_b, float b_toBinarizeTo) {
+	if (require_dense("floatFSGD") == 0)
+		return;
+	uint64_t job = floatFSGD_async(numEpochs, stepSize, binarize_b, b_toBinarizeTo);
+	if (job == 0)
+		return;
+	FSGD_collect(x, job, numEpochs, 0);
+}
+
+uint64_t zipml_sgd::floatFSGD_async(uint32_t numEpochs, float stepSize, int binarize_b, float b_toBinarizeTo) {
+	if (require_dense("floatFSGD_async") == 0)
+		return 0;
+	interfaceFPGA->waitIdle(); // The CSRs, workspace and sentinels below belong to the running job
 	cout << "numCacheLines: " << numCacheLines << endl;
 
 	int minibatch_size = 0;
 
+	if (reserve_workspace(numCacheLines, (uint64_t)numEpochs*accumulationCount, 0) == 0)
+		return 0;
+
+#ifdef SWAFU
+	interfaceFPGA->m_AFUService->loadDesign(AFU_DESIGN_FLOATFSGD, 0);
+#endif
+
 	interfaceFPGA->m_AFUService->CSRWrite(CSR_READ_OFFSET, 0);
 	interfaceFPGA->m_AFUService->CSRWrite(CSR_WRITE_OFFSET, 0);
 	interfaceFPGA->m_AFUService->CSRWrite(CSR_NUM_LINES, numCacheLines);
@@ -852,27 +2875,43 @@ void zipml_sgd::floatFSGD(float x[], uint32_t numEpochs, float stepSize, int bin
 	uint32_t* stepSizeAddr = (uint32_t*) &stepSize;
 	interfaceFPGA->m_AFUService->CSRWrite(CSR_MY_CONFIG1, *stepSizeAddr);
 
-	interfaceFPGA->doTransaction();
+	mark_epoch_models(numEpochs, 0);
+	return interfaceFPGA->submitTransaction();
+}
+
+// Provide: float x[numFeatures]
+void zipml_sgd::FSGD_collect(float x[], uint64_t job, uint32_t numEpochs, int quantizationBits) {
+	interfaceFPGA->waitTransaction(job);
 
-	int numCLsForX = accumulationCount;
-	cout << "numCLsForX: " << accumulationCount << endl;
+	int numCLsForX = (quantizationBits == 0) ? accumulationCount : get_number_of_CLs_for_x(quantizationBits);
+	cout << "numCLsForX: " << numCLsForX << endl;
 
-	uint32_t offset = (numEpochs-1)*numCLsForX*numValuesPerLine;
+	uint32_t offset = (numEpochs-1)*numCLsForX*16;
+	interfaceFPGA->readFromMemory('o', x, offset, numFeatures);
 	for (uint32_t j = 0; j < numFeatures; j++) {
-		int32_t temp = interfaceFPGA->readFromMemory32('o', j + offset);
+		int32_t temp;
+		memcpy(&temp, &x[j], sizeof(temp));
 		x[j] = (float)temp;
 		x[j] = x[j]/b_toIntegerScaler;
 	}
 }
 
 // Provide: float x[numFeatures]
-void zipml_sgd::qFSGD(float x[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, int binarize_b, int bi_toBinarizeTo) {
-	cout << "numCacheLines: " << numCacheLines << endl;
-	cout << "numberOfIndices: " << numberOfIndices << endl;
-
+char zipml_sgd::configure_qFSGD(uint32_t numEpochs, int stepSizeShifter, int quantizationBits, int binarize_b, int bi_toBinarizeTo) {
 	int minibatch_size = 1;
 	int stepSizeDeclineInterval = 128-1;
 
+	interfaceFPGA->waitIdle(); // The CSRs, workspace and sentinels below belong to the running job
+	if (reserve_workspace((uint64_t)numberOfIndices*numCacheLines, (uint64_t)numEpochs*get_number_of_CLs_for_x(quantizationBits), 0) == 0)
+		return 0;
+
+#ifdef SWAFU
+	if (quantizationBits == 1)
+		interfaceFPGA->m_AFUService->loadDesign(AFU_DESIGN_QFSGD_Q1, 1);
+	else
+		interfaceFPGA->m_AFUService->loadDesign(AFU_DESIGN_QFSGD, quantizationBits);
+#endif
+
 	interfaceFPGA->m_AFUService->CSRWrite(CSR_READ_OFFSET, 0);
 	interfaceFPGA->m_AFUService->CSRWrite(CSR_WRITE_OFFSET, 0);
 	interfaceFPGA->m_AFUService->CSRWrite(CSR_NUM_LINES, numCacheLines);
@@ -881,44 +2920,487 @@ void zipml_sgd::qFSGD(float x[], uint32_t numEpochs, int stepSizeShifter, int qu
 	interfaceFPGA->m_AFUService->CSRWrite(CSR_MY_CONFIG3, numEpochs << 18 | numFeatures); // Samples
 	interfaceFPGA->m_AFUService->CSRWrite(CSR_MY_CONFIG2, ((minibatch_size&0xFFFF) << 10) | ((numberOfIndices&0xFF) << 2) | (binarize_b << 1) | a_normalizedToMinus1_1);
 	interfaceFPGA->m_AFUService->CSRWrite(CSR_MY_CONFIG1, ((stepSizeDeclineInterval&0x3FFF) << 6) | (stepSizeShifter&0x3F));
+	return 1;
+}
 
-	interfaceFPGA->doTransaction();
+void zipml_sgd::qFSGD(float x[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, int binarize_b, int bi_toBinarizeTo) {
+	if (require_dense("qFSGD") == 0)
+		return;
+	uint64_t job = qFSGD_async(numEpochs, stepSizeShifter, quantizationBits, binarize_b, bi_toBinarizeTo);
+	if (job == 0)
+		return;
+	FSGD_collect(x, job, numEpochs, quantizationBits);
+}
 
-	int numCLsForX = accumulationCount;
-	if (quantizationBits == 1 && numCLsForX%16 != 0)
-		numCLsForX = numCLsForX + (16-numCLsForX%16);
-	else if (quantizationBits == 2 && numCLsForX%8 != 0)
-		numCLsForX = numCLsForX + (8-numCLsForX%8);
-	else if (quantizationBits == 4 && numCLsForX%4 != 0)
-		numCLsForX = numCLsForX + (4-numCLsForX%4);
-	else if (quantizationBits == 8 && numCLsForX%2 != 0)
-		numCLsForX = numCLsForX + 1;
+uint64_t zipml_sgd::qFSGD_async(uint32_t numEpochs, int stepSizeShifter, int quantizationBits, int binarize_b, int bi_toBinarizeTo) {
+	if (require_dense("qFSGD_async") == 0)
+		return 0;
+	cout << "numCacheLines: " << numCacheLines << endl;
+	cout << "numberOfIndices: " << numberOfIndices << endl;
 
-	uint32_t offset = (numEpochs-1)*numCLsForX*16;
-	for (uint32_t j = 0; j < numFeatures; j++) {
-		int32_t temp = interfaceFPGA->readFromMemory32('o', j + offset);
-		x[j] = (float)temp;
-		x[j] = x[j]/b_toIntegerScaler;
+	if (configure_qFSGD(numEpochs, stepSizeShifter, quantizationBits, binarize_b, bi_toBinarizeTo) == 0)
+		return 0;
+
+	mark_epoch_models(numEpochs, quantizationBits);
+	return interfaceFPGA->submitTransaction();
+}
+
+// Provide: float* xs[numClasses], each float[numFeatures]
+// The design is loaded and configured once; between jobs only the label and
+// the output offset change. Class k writes its models to output region k%2,
+// so the model of class k-1 is read back while class k trains.
+double zipml_sgd::qFSGD_multiclass(float* xs[], uint32_t numClasses, const int classLabels[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, double classTimes[]) {
+	if (require_dense("qFSGD_multiclass") == 0)
+		return 0;
+	if (quantizationBits != 1 && quantizationBits != 2 && quantizationBits != 4 && quantizationBits != 8) {
+		cout << "FPGA can only handle 1, 2, 4, 8 bit quantization." << endl;
+		return 0;
+	}
+	if (numClasses == 0)
+		return 0;
+	cout << "numCacheLines: " << numCacheLines << endl;
+	cout << "numberOfIndices: " << numberOfIndices << endl;
+	cout << "numClasses: " << numClasses << endl;
+
+	uint32_t regionCacheLines = numEpochs*get_number_of_CLs_for_x(quantizationBits);
+	if (reserve_workspace((uint64_t)numberOfIndices*numCacheLines, 2*(uint64_t)regionCacheLines, 0) == 0)
+		return 0;
+
+	double start = get_time();
+	int label = (classLabels == NULL) ? 0 : classLabels[0];
+	if (configure_qFSGD(numEpochs, stepSizeShifter, quantizationBits, 1, label) == 0)
+		return 0;
+
+	double submitted = 0;
+	double readbackTime = 0;
+	uint64_t previous = 0;
+	for (uint32_t k = 0; k <= numClasses; k++) {
+		if (k > 0) {
+			interfaceFPGA->waitTransaction(previous);
+			double done = get_time();
+			if (classTimes != NULL)
+				classTimes[k-1] = done - submitted;
+			cout << "Class " << k-1 << ": " << done - submitted << endl;
+		}
+		if (k < numClasses) {
+			label = (classLabels == NULL) ? k*b_toIntegerScaler : classLabels[k];
+			interfaceFPGA->m_AFUService->CSRWrite(CSR_MY_CONFIG5, label);
+			interfaceFPGA->m_AFUService->CSRWrite(CSR_WRITE_OFFSET, (k%2)*regionCacheLines);
+			submitted = get_time();
+			previous = interfaceFPGA->submitTransaction();
+		}
+		if (k > 0) {
+			double readbackStart = get_time();
+			read_epoch_models(xs[k-1], ((k-1)%2)*numEpochs + numEpochs-1, 1, quantizationBits);
+			readbackTime += get_time() - readbackStart;
+		}
 	}
+	double total = get_time() - start;
+	interfaceFPGA->m_AFUService->CSRWrite(CSR_WRITE_OFFSET, 0);
+
+	cout << "Multi-class training time: " << total << ", per class: " << total/numClasses << ", readback: " << readbackTime << endl;
+	return total;
 }
 
-float zipml_sgd::calculate_loss(float x[]) {
-	float loss = 0;
-	for(uint32_t i = 0; i < numSamples; i++) {
-		float dot = 0.0;
+// The FPGA reads index e%ringSize in epoch e. Every epoch's last model line is
+// preset to a sentinel; once the model of epoch e has been written, epoch e-1
+// has surely finished reading its index, so that slot is refilled with a fresh
+// quantization for epoch e-1+ringSize. Hence ringSize >= 3. The AFU moves on
+// to epoch t only after writing the model of epoch t-1, so a slot is not
+// refilled once that model is there: the FPGA then reuses the previous, whole
+// quantization. There is no handshake though, the FPGA may reach epoch t while
+// the slot is being rewritten and read a mix of old and new rows (each element
+// still an unbiased quantization). Such refills are counted as racing.
+void zipml_sgd::qFSGD_ring(float x[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, int binarize_b, int bi_toBinarizeTo, uint32_t ringSize) {
+	if (require_dense("qFSGD_ring") == 0)
+		return;
+	if (ringSize < 3)
+		ringSize = 3;
+	if (ringSize > 255)
+		ringSize = 255;
+	if (ringSize > numEpochs)
+		ringSize = numEpochs;
+
+	numCacheLines = copy_data_into_FPGA_memory_after_quantization(quantizationBits, ringSize, 0);
+	if (numCacheLines == 0)
+		return;
+	cout << "numCacheLines: " << numCacheLines << endl;
+	cout << "ringSize: " << ringSize << endl;
+
+	if (configure_qFSGD(numEpochs, stepSizeShifter, quantizationBits, binarize_b, bi_toBinarizeTo) == 0)
+		return;
+
+	mark_epoch_models(numEpochs, quantizationBits);
+
+	double refillTime = 0;
+	uint32_t refills = 0;
+	uint32_t skipped = 0;
+	uint32_t racing = 0;
+	uint32_t epochToWatch = 1;
+	uint64_t job = interfaceFPGA->submitTransaction();
+	while (interfaceFPGA->testTransaction(job) == 0) {
+		if (epochToWatch + ringSize - 1 >= numEpochs) { // No more refills
+			interfaceFPGA->waitTransaction(job);
+			break;
+		}
+		if (epoch_model_written(epochToWatch, quantizationBits) == 0) {
+			SleepNano(100);
+			continue;
+		}
+
+		// The slot is read again in epoch target
+		uint32_t target = epochToWatch-1 + ringSize;
+		if (epoch_model_written(target-1, quantizationBits) == 1) {
+			skipped++;
+		}
+		else {
+			double start = get_time();
+			uint32_t slot = (epochToWatch-1)%ringSize;
+			copy_quantized_index_into_FPGA_memory(quantizationBits, slot*numCacheLines*16);
+			refillTime += get_time() - start;
+			refills++;
+			if (epoch_model_written(target-1, quantizationBits) == 1)
+				racing++;
+		}
+		epochToWatch++;
+	}
+	cout << "Ring refills: " << refills << " (racing the FPGA: " << racing << ", too late: " << skipped << "), host time spent refilling: " << refillTime << endl;
+
+	FSGD_collect(x, job, numEpochs, quantizationBits);
+}
+
+// Writes rows [firstSample, firstSample+count) in the float or packed layout at
+// address32, labels left as they are in b/bi. Quantized rows use the streams
+// quantizationStream and quantizationStream+1, like quantize_data_integer(aiq, bits, 2)
+void zipml_sgd::prepare_chunk(uint32_t staging[], int quantizationBits, uint32_t firstSample, uint32_t count, uint32_t address32) {
+	if (quantizationBits == 0) {
+		uint32_t rowWords = accumulationCount*numValuesPerLine;
+		memset(staging, 0, count*rowWords*sizeof(uint32_t));
+		for (uint32_t i = 0; i < count; i++) {
+			memcpy(staging + i*rowWords, a + (uint64_t)(firstSample+i)*numFeatures, numFeatures*sizeof(float));
+			memcpy(staging + i*rowWords + rowWords-1, &b[firstSample+i], sizeof(float));
+		}
+		interfaceFPGA->writeToMemory('i', staging, address32, count*rowWords, numCPUThreads);
+		return;
+	}
+
+	uint32_t rowWords = get_number_of_words_per_packed_row(quantizationBits);
+	uint32_t elementsPerWord = 16/quantizationBits;
+	uint32_t mask = (1 << quantizationBits)-1;
+	int numLevels = (1 << (quantizationBits-1)) + 1;
+	float scale = (a_normalizedToMinus1_1 == 0) ? numLevels-1 : (numLevels-1)/2;
+	uint32_t streamKey1 = counter_rng(quantizationSeed, quantizationStream);
+	uint32_t streamKey2 = counter_rng(quantizationSeed, quantizationStream+1);
+	int* aiq1 = (int*)malloc(2*numFeatures*sizeof(int));
+	int* aiq2 = aiq1 + numFeatures;
+
+	memset(staging, 0, count*rowWords*sizeof(uint32_t));
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t sample = firstSample+i;
+		const float* a_row = a + (uint64_t)sample*numFeatures;
+		quantize_row(a_row, aiq1, numFeatures, scale, a_normalizedToMinus1_1, counter_rng(streamKey1, sample));
+		quantize_row(a_row, aiq2, numFeatures, scale, a_normalizedToMinus1_1, counter_rng(streamKey2, sample));
+		uint32_t* row = staging + i*rowWords;
+		for (uint32_t j = 0; j < numFeatures; j++) {
+			uint32_t q1 = aiq1[j] & mask;
+			uint32_t q2 = aiq2[j] & mask;
+			row[j/elementsPerWord] |= (q2 << quantizationBits | q1) << (2*quantizationBits*(j%elementsPerWord));
+		}
+		row[rowWords-1] = bi[sample];
+	}
+	free(aiq1);
+	interfaceFPGA->writeToMemory('i', staging, address32, count*rowWords, numCPUThreads);
+}
+
+// The FPGA always starts from a zero model. Training d from zero on the labels
+// b - a*x takes the steps that x + d would take on b (up to rounding), so the
+// model is carried by rewriting the labels of the next chunk once x is known.
+// Quantized, this is only approximate: the FPGA computes the dot products on
+// the quantized rows, the residual here on the float ones.
+void zipml_sgd::patch_chunk_labels(float x[], int quantizationBits, uint32_t firstSample, uint32_t count, uint32_t address32) {
+	const float_kernels& kernels = get_float_kernels();
+	uint32_t rowWords = (quantizationBits == 0) ? accumulationCount*numValuesPerLine : get_number_of_words_per_packed_row(quantizationBits);
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t sample = firstSample+i;
+		float dot = kernels.dot(x, a + (uint64_t)sample*numFeatures, numFeatures);
+		uint32_t label;
+		if (quantizationBits == 0) {
+			float residual = b[sample] - dot;
+			memcpy(&label, &residual, sizeof(label));
+		}
+		else
+			label = (uint32_t)(bi[sample] - (int)(dot*(float)b_toIntegerScaler));
+		interfaceFPGA->writeToMemory32('i', label, address32 + i*rowWords + rowWords-1);
+	}
+}
+
+void zipml_sgd::run_chunks(float x[], uint32_t numEpochs, float stepSize, int stepSizeShifter, int quantizationBits, uint32_t chunkSamples) {
+	if (require_dense("run_chunks") == 0)
+		return;
+	if (quantizationBits != 0 && quantizationBits != 1 && quantizationBits != 2 && quantizationBits != 4 && quantizationBits != 8) {
+		cout << "FPGA can only handle 1, 2, 4, 8 bit quantization." << endl;
+		return;
+	}
+	if (chunkSamples == 0 || chunkSamples > numSamples)
+		chunkSamples = numSamples;
+	uint32_t numChunks = (numSamples + chunkSamples-1)/chunkSamples;
+
+	uint32_t rowWords = (quantizationBits == 0) ? accumulationCount*numValuesPerLine : get_number_of_words_per_packed_row(quantizationBits);
+	uint32_t linesPerRow = rowWords/16;
+	uint32_t regionCacheLines = chunkSamples*linesPerRow;
+	uint32_t numCLsForX = (quantizationBits == 0) ? accumulationCount : get_number_of_CLs_for_x(quantizationBits);
+	// Output: the carried model after every epoch (as floatFSGD/qFSGD leave it,
+	// for log_history), then the lines the jobs write to
+	uint32_t jobOutput = numEpochs*numCLsForX;
+	if (reserve_workspace(2*(uint64_t)regionCacheLines, jobOutput + numCLsForX, 0) == 0)
+		return;
+	// The jobs set them for one chunk, the data in the workspace keeps its layout
+	uint32_t savedNumberOfIndices = numberOfIndices;
+	uint32_t savedNumCacheLines = numCacheLines;
+	cout << "numChunks: " << numChunks << ", chunkSamples: " << chunkSamples << ", regionCacheLines: " << regionCacheLines << endl;
+
+	uint32_t* staging = (uint32_t*)malloc(chunkSamples*rowWords*sizeof(uint32_t));
+	int32_t* d = (int32_t*)malloc(numCLsForX*16*sizeof(int32_t));
+	int32_t* xi = (int32_t*)malloc(numCLsForX*16*sizeof(int32_t));
+	memset(xi, 0, numCLsForX*16*sizeof(int32_t));
+	for (uint32_t j = 0; j < numFeatures; j++)
+		x[j] = 0;
+
+	double prepareTime = 0;
+	double waitTime = 0;
+	uint64_t numJobs = (uint64_t)numEpochs*numChunks;
+	prepare_chunk(staging, quantizationBits, 0, (chunkSamples < numSamples) ? chunkSamples : numSamples, 0);
+	for (uint64_t job = 0; job < numJobs; job++) {
+		uint32_t epoch = job/numChunks;
+		uint32_t firstSample = (job%numChunks)*chunkSamples;
+		uint32_t count = (numSamples - firstSample < chunkSamples) ? numSamples - firstSample : chunkSamples;
+		uint32_t region = job%2;
+
+		double start = get_time();
+		if (job > 0)
+			patch_chunk_labels(x, quantizationBits, firstSample, count, region*regionCacheLines*16);
+
+		if (quantizationBits == 0) {
+			int minibatch_size = 0;
+#ifdef SWAFU
+			interfaceFPGA->m_AFUService->loadDesign(AFU_DESIGN_FLOATFSGD, 0);
+#endif
+			interfaceFPGA->m_AFUService->CSRWrite(CSR_MY_CONFIG3, 1 << 18 | accumulationCount);
+			interfaceFPGA->m_AFUService->CSRWrite(CSR_MY_CONFIG2, ((minibatch_size&0xFFFF) << 10));
+			uint32_t* stepSizeAddr = (uint32_t*) &stepSize;
+			interfaceFPGA->m_AFUService->CSRWrite(CSR_MY_CONFIG1, *stepSizeAddr);
+		}
+		else {
+			numberOfIndices = 1;
+			numCacheLines = count*linesPerRow;
+			if (configure_qFSGD(1, stepSizeShifter, quantizationBits, 0, 0) == 0)
+				break;
+		}
+		interfaceFPGA->m_AFUService->CSRWrite(CSR_READ_OFFSET, region*regionCacheLines);
+		interfaceFPGA->m_AFUService->CSRWrite(CSR_WRITE_OFFSET, jobOutput);
+		interfaceFPGA->m_AFUService->CSRWrite(CSR_NUM_LINES, count*linesPerRow);
+		interfaceFPGA->m_AFUService->CSRWrite(CSR_MY_CONFIG4, count);
+		uint64_t handle = interfaceFPGA->submitTransaction();
+
+		// Fill the other region while the FPGA trains on this one
+		if (job+1 < numJobs) {
+			uint32_t nextFirstSample = ((job+1)%numChunks)*chunkSamples;
+			uint32_t nextCount = (numSamples - nextFirstSample < chunkSamples) ? numSamples - nextFirstSample : chunkSamples;
+			if (quantizationBits != 0 && nextFirstSample == 0)
+				quantizationStream += 2; // Fresh quantization every epoch
+			prepare_chunk(staging, quantizationBits, nextFirstSample, nextCount, (1-region)*regionCacheLines*16);
+		}
+		double prepared = get_time();
+		prepareTime += prepared - start;
+
+		interfaceFPGA->waitTransaction(handle);
+		waitTime += get_time() - prepared;
+
+		interfaceFPGA->readFromMemory('o', d, jobOutput*16, numFeatures);
 		for (uint32_t j = 0; j < numFeatures; j++) {
-			dot += x[j]*a[i*numFeatures + j];
+			xi[j] += d[j];
+			x[j] = (float)xi[j]/b_toIntegerScaler;
 		}
-		loss += (dot - b[i])*(dot - b[i]);
+		if ((job+1)%numChunks == 0)
+			interfaceFPGA->writeToMemory('o', xi, epoch*numCLsForX*16, numCLsForX*16);
+	}
+	if (quantizationBits != 0)
+		quantizationStream += 2;
+
+	numberOfIndices = savedNumberOfIndices;
+	numCacheLines = savedNumCacheLines;
+	cout << "Chunked jobs: " << numJobs << ", host time preparing: " << prepareTime << ", waiting for the FPGA: " << waitTime << endl;
+
+	free(staging);
+	free(d);
+	free(xi);
+}
+
+// Provide: float x[numFeatures]
+void zipml_sgd::floatFSGD_chunked(float x[], uint32_t numEpochs, float stepSize, uint32_t chunkSamples) {
+	run_chunks(x, numEpochs, stepSize, 0, 0, chunkSamples);
+}
+
+// Provide: float x[numFeatures]
+void zipml_sgd::qFSGD_chunked(float x[], uint32_t numEpochs, int stepSizeShifter, int quantizationBits, uint32_t chunkSamples) {
+	if (quantizationBits == 0) {
+		cout << "FPGA can only handle 1, 2, 4, 8 bit quantization." << endl;
+		return;
 	}
+	run_chunks(x, numEpochs, 0, stepSizeShifter, quantizationBits, chunkSamples);
+}
 
-	loss /= (float)(2*numSamples);
+float zipml_sgd::calculate_loss(float x[]) {
+	float loss;
+	calculate_losses(&loss, x, 1);
 	return loss;
 }
 
-void zipml_sgd::log_history(char SWorFPGA, char fileOutput, int quantizationBits, float stepSize, int numEpochs, double time, float* x_history) {
+#define LOSS_MODEL_BLOCK_BYTES 131072 // Models evaluated per row stay in L2
+
+static void* loss_worker(void* arg) {
+	loss_args* args = (loss_args*)arg;
+	const float_kernels& kernels = get_float_kernels();
+	const sparse_kernels& sparse = get_sparse_kernels();
+	uint32_t modelsPerBlock = LOSS_MODEL_BLOCK_BYTES/(args->numFeatures*sizeof(float));
+	if (modelsPerBlock == 0)
+		modelsPerBlock = 1;
+	for (uint32_t m = 0; m < args->numModels; m++)
+		args->partial_loss[m] = 0;
+	for (uint32_t firstModel = 0; firstModel < args->numModels; firstModel += modelsPerBlock) {
+		uint32_t lastModel = (firstModel + modelsPerBlock < args->numModels) ? firstModel + modelsPerBlock : args->numModels;
+		for (uint32_t i = args->firstSample; i < args->lastSample; i++) {
+			if (args->row_ptr != NULL) {
+				uint64_t begin = args->row_ptr[i];
+				uint32_t nnz = args->row_ptr[i+1] - begin;
+				for (uint32_t m = firstModel; m < lastModel; m++) {
+					float error = sparse.dot(args->xs + (uint64_t)m*args->numFeatures, args->values + begin, args->columns + begin, nnz) - args->b[i];
+					args->partial_loss[m] += error*error;
+				}
+				continue;
+			}
+			const float* a_row = args->a + (uint64_t)i*args->numFeatures;
+			for (uint32_t m = firstModel; m < lastModel; m++) {
+				float error = kernels.dot(args->xs + (uint64_t)m*args->numFeatures, a_row, args->numFeatures) - args->b[i];
+				args->partial_loss[m] += error*error;
+			}
+		}
+	}
+	return NULL;
+}
+
+void zipml_sgd::calculate_losses(float losses[], const float* xs, uint32_t numModels) {
+	uint32_t numThreads = numCPUThreads;
+	if (numThreads > numSamples/64 + 1) // At least 64 samples per thread
+		numThreads = numSamples/64 + 1;
+
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+	loss_args* args = (loss_args*)malloc(numThreads*sizeof(loss_args));
+	double* partial_loss = (double*)malloc(numThreads*numModels*sizeof(double));
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].a = a;
+		args[t].b = b;
+		args[t].xs = xs;
+		args[t].numFeatures = numFeatures;
+		args[t].numModels = numModels;
+		args[t].firstSample = (uint64_t)numSamples*t/numThreads;
+		args[t].lastSample = (uint64_t)numSamples*(t+1)/numThreads;
+		args[t].partial_loss = partial_loss + t*numModels;
+		args[t].values = csr_values;
+		args[t].columns = csr_columns;
+		args[t].row_ptr = is_sparse() ? csr_row_ptr : NULL;
+	}
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_create(&threads[t], NULL, loss_worker, &args[t]);
+	loss_worker(&args[0]);
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_join(threads[t], NULL);
+
+	for (uint32_t m = 0; m < numModels; m++) {
+		double loss = 0;
+		for (uint32_t t = 0; t < numThreads; t++)
+			loss += partial_loss[t*numModels + m];
+		losses[m] = (float)(loss/(2.0*numSamples));
+	}
+	free(threads);
+	free(args);
+	free(partial_loss);
+}
+
+void zipml_sgd::mark_epoch_models(uint32_t numEpochs, int quantizationBits) {
+	uint32_t numCLsForX = get_number_of_CLs_for_x(quantizationBits);
+	uint32_t sentinel[16];
+	memset(sentinel, 0xFF, sizeof(sentinel));
+	for (uint32_t epoch = 0; epoch < numEpochs; epoch++) {
+		interfaceFPGA->writeToMemory('o', sentinel, ((epoch+1)*numCLsForX - 1)*16, 16);
+	}
+}
+
+char zipml_sgd::epoch_model_written(uint32_t epoch, int quantizationBits) {
+	uint32_t numCLsForX = get_number_of_CLs_for_x(quantizationBits);
+	uint32_t sentinel[16];
+	uint32_t lastLine[16];
+	memset(sentinel, 0xFF, sizeof(sentinel));
+	interfaceFPGA->readFromMemory('o', lastLine, ((epoch+1)*numCLsForX - 1)*16, 16);
+	return memcmp(lastLine, sentinel, sizeof(sentinel)) != 0;
+}
+
+// Reads numModels epoch models, from firstEpoch on, from the FPGA output
+void zipml_sgd::read_epoch_models(float xs[], uint32_t firstEpoch, uint32_t numModels, int quantizationBits) {
+	uint32_t numCLsForX = get_number_of_CLs_for_x(quantizationBits);
+	for (uint32_t m = 0; m < numModels; m++) {
+		float* x = xs + (uint64_t)m*numFeatures;
+		interfaceFPGA->readFromMemory('o', x, (firstEpoch+m)*numCLsForX*16, numFeatures);
+		for (uint32_t j = 0; j < numFeatures; j++) {
+			int32_t temp;
+			memcpy(&temp, &x[j], sizeof(temp));
+			x[j] = (float)temp/b_toIntegerScaler;
+		}
+	}
+}
+
+// Provide: float x[numFeatures], float losses[numEpochs]
+// Epoch e's model is complete once the last line of epoch e+1 has replaced its
+// sentinel (set by floatFSGD_async/qFSGD_async): every unit writes its lines
+// of epoch e before the AFU moves on to the samples of epoch e+1
+void zipml_sgd::FSGD_collect_losses(float x[], float losses[], uint64_t job, uint32_t numEpochs, int quantizationBits) {
+	uint32_t numCLsForX = get_number_of_CLs_for_x(quantizationBits);
+	float* xs = (float*)malloc((uint64_t)numEpochs*numFeatures*sizeof(float));
+	uint32_t sentinel[16];
+	memset(sentinel, 0xFF, sizeof(sentinel));
+
+	uint32_t numEvaluated = 0;
+	while (numEvaluated < numEpochs) {
+		uint32_t numComplete = numEvaluated;
+		if (interfaceFPGA->testTransaction(job) == 1)
+			numComplete = numEpochs;
+		else {
+			while (numComplete+1 < numEpochs) {
+				uint32_t lastLine[16];
+				interfaceFPGA->readFromMemory('o', lastLine, ((numComplete+2)*numCLsForX - 1)*16, 16);
+				if (memcmp(lastLine, sentinel, sizeof(sentinel)) == 0)
+					break;
+				numComplete++;
+			}
+		}
+		if (numComplete == numEvaluated) {
+			if (numComplete+1 == numEpochs) // Only the last epoch is left
+				interfaceFPGA->waitTransaction(job);
+			else
+				SleepNano(1000);
+			continue;
+		}
+		read_epoch_models(xs + (uint64_t)numEvaluated*numFeatures, numEvaluated, numComplete-numEvaluated, quantizationBits);
+		calculate_losses(losses + numEvaluated, xs + (uint64_t)numEvaluated*numFeatures, numComplete-numEvaluated);
+		numEvaluated = numComplete;
+	}
+	memcpy(x, xs + (uint64_t)(numEpochs-1)*numFeatures, numFeatures*sizeof(float));
+	free(xs);
+}
+
+void zipml_sgd::log_history(char SWorFPGA, char fileOutput, int quantizationBits, float stepSize, int numEpochs, double time, float* x_history, float* loss_history) {
 	char* fileName = (char*)malloc(200);
-	FILE* f;
+	FILE* f = NULL;
 
 	cout << "Time: " << time << endl;
 
@@ -927,6 +3409,10 @@ void zipml_sgd::log_history(char SWorFPGA, char fileOutput, int quantizationBits
 			sprintf(fileName, "logs/SW_SGDhistory_%d_%d_%.6f_%d.log", numSamples, numFeatures, stepSize, numEpochs);
 			cout << "fileName:" << fileName << endl;
 			f = fopen(fileName, "w");
+			if (f == NULL)
+				cout << "Could not open " << fileName << ", not logging to a file" << endl;
+		}
+		if (f != NULL) {
 			fprintf(f, "a_normalizedToMinus1_1\t%d\n", a_normalizedToMinus1_1);
 			fprintf(f, "b_normalizedToMinus1_1\t%d\n", b_normalizedToMinus1_1);
 			fprintf(f, "b_toIntegerScaler\t%x\n", b_toIntegerScaler);
@@ -937,32 +3423,47 @@ void zipml_sgd::log_history(char SWorFPGA, char fileOutput, int quantizationBits
 			fprintf(f, "time\t%.10f\n", time);
 		}
 		
-		// Calculate initial loss
-		float x_zero[numFeatures];
-		for (uint32_t j = 0; j < numFeatures; j++) {
-			x_zero[j] = 0.0;
+		// Initial loss, then all epochs in one pass
+		float* xs = (float*)malloc((uint64_t)(numEpochs+1)*numFeatures*sizeof(float));
+		float* J = (float*)malloc((numEpochs+1)*sizeof(float));
+		memset(xs, 0, numFeatures*sizeof(float));
+		if (loss_history == NULL) {
+			memcpy(xs + numFeatures, x_history, (uint64_t)numEpochs*numFeatures*sizeof(float));
+			calculate_losses(J, xs, numEpochs+1);
+		}
+		else {
+			// The initial model is 0, its loss only needs b
+			double loss = 0;
+			for (uint32_t i = 0; i < numSamples; i++)
+				loss += (double)b[i]*b[i];
+			J[0] = (float)(loss/(2.0*numSamples));
+			memcpy(J + 1, loss_history, numEpochs*sizeof(float));
 		}
-		float J0 = calculate_loss(x_zero);
-		cout << J0 << endl;
-		if (fileOutput == 1)
-			fprintf(f, "J\t%d\t%d\t%.10f\n", -1, 0, J0);
+		cout << J[0] << endl;
+		if (f != NULL)
+			fprintf(f, "J\t%d\t%d\t%.10f\n", -1, 0, J[0]);
 
 		double epoch_time = time/numEpochs;
 
 		for(int epoch = 0; epoch < numEpochs; epoch++) {
-			float J = calculate_loss(x_history + epoch*numFeatures);
-			cout << J << endl;
-			if (fileOutput == 1)
-				fprintf(f, "J\t%d\t%.10f\t%.10f\n", epoch, epoch_time*(epoch+1), J);
+			cout << J[epoch+1] << endl;
+			if (f != NULL)
+				fprintf(f, "J\t%d\t%.10f\t%.10f\n", epoch, epoch_time*(epoch+1), J[epoch+1]);
 		}
-		if (fileOutput == 1)
+		if (f != NULL)
 			fclose(f);
+		free(xs);
+		free(J);
 	}
 	else if (SWorFPGA == 'h') {
 		if (fileOutput == 1) {
 			sprintf(fileName, "logs/Q%dfixedSGDhistory_%d_%d_%.6f_%d.log", quantizationBits, numSamples, numFeatures, stepSize, numEpochs);
 			cout << "fileName:" << fileName << endl;
 			f = fopen(fileName, "w");
+			if (f == NULL)
+				cout << "Could not open " << fileName << ", not logging to a file" << endl;
+		}
+		if (f != NULL) {
 			fprintf(f, "numberOfIndices\t%d\n", numberOfIndices);
 			fprintf(f, "a_normalizedToMinus1_1\t%d\n", a_normalizedToMinus1_1);
 			fprintf(f, "b_normalizedToMinus1_1\t%d\n", b_normalizedToMinus1_1);
@@ -976,60 +3477,223 @@ void zipml_sgd::log_history(char SWorFPGA, char fileOutput, int quantizationBits
 			fprintf(f, "time\t%.10f\n", time);
 		}
 
-		int numCLsForX = accumulationCount;
-		if (quantizationBits == 1 && numCLsForX%16 != 0)
-			numCLsForX = numCLsForX + (16-numCLsForX%16);
-		else if (quantizationBits == 2 && numCLsForX%8 != 0)
-			numCLsForX = numCLsForX + (8-numCLsForX%8);
-		else if (quantizationBits == 4 && numCLsForX%4 != 0)
-			numCLsForX = numCLsForX + (4-numCLsForX%4);
-		else if (quantizationBits == 8 && numCLsForX%2 != 0)
-			numCLsForX = numCLsForX + 1;
+		int numCLsForX = get_number_of_CLs_for_x(quantizationBits);
 
 		cout << "numCLsForX: " << numCLsForX << endl;
 
-		// Calculate initial loss
-		float x_zero[numFeatures];
-		for (uint32_t j = 0; j < numFeatures; j++) {
-			x_zero[j] = 0.0;
-		}
-		float J0 = calculate_loss(x_zero);
-		cout << J0 << endl;
-		if (fileOutput == 1)
-			fprintf(f, "J\t%d\t%d\t%.10f\n", -1, 0, J0);
+		// Initial loss, then all epochs in one pass
+		float* xs = (float*)malloc((uint64_t)(numEpochs+1)*numFeatures*sizeof(float));
+		float* J = (float*)malloc((numEpochs+1)*sizeof(float));
+		memset(xs, 0, numFeatures*sizeof(float));
+		read_epoch_models(xs + numFeatures, 0, numEpochs, quantizationBits);
+		calculate_losses(J, xs, numEpochs+1);
+		cout << J[0] << endl;
+		if (f != NULL)
+			fprintf(f, "J\t%d\t%d\t%.10f\n", -1, 0, J[0]);
 
 		double epoch_time = time/numEpochs;
 
 		for(int epoch = 0; epoch < numEpochs; epoch++) {
-			float x[numFeatures];
-			uint32_t offset = epoch*numCLsForX*16;
-			for (uint32_t j = 0; j < numFeatures; j++) {
-				int32_t temp = interfaceFPGA->readFromMemory32('o', offset + j);
-				x[j] = (float)temp;
-				x[j] = x[j]/b_toIntegerScaler;
-			}
-
-			float J = calculate_loss(x);
-			cout << J << endl;
-			if (fileOutput == 1)
-				fprintf(f, "J\t%d\t%.10f\t%.10f\n", epoch, epoch_time*(epoch+1), J);
+			cout << J[epoch+1] << endl;
+			if (f != NULL)
+				fprintf(f, "J\t%d\t%.10f\t%.10f\n", epoch, epoch_time*(epoch+1), J[epoch+1]);
 		}
-		if (fileOutput == 1)
+		if (f != NULL)
 			fclose(f);
+		free(xs);
+		free(J);
 	}
 
 	free(fileName);
 }
 
-void zipml_sgd::inference(float result[], float* x) {
+#define CLASSIFY_TILE_SAMPLES 64			// Samples scored together, stay in L1/L2
+#define CLASSIFY_MODEL_BLOCK_BYTES 131072	// Models scored per tile, stay in L2
+
+// Scores a tile of samples against a block of models at a time, 2 samples x 4
+// models per kernel call. In int8 mode the samples of the tile are quantized
+// first, each with its own scale.
+static void* classify_worker(void* arg) {
+	classify_args* args = (classify_args*)arg;
+	const block_kernels& kernels = get_block_kernels();
+	uint32_t numFeatures = args->numFeatures;
+	uint32_t numModels = args->numModels;
+	uint32_t ldw = args->ldw;
+	uint32_t elementBytes = (args->w8 != NULL) ? 1 : sizeof(float);
+	uint32_t modelsPerBlock = CLASSIFY_MODEL_BLOCK_BYTES/(ldw*elementBytes)/4*4;
+	if (modelsPerBlock == 0)
+		modelsPerBlock = 4;
+
+	float* scores = (float*)malloc(CLASSIFY_TILE_SAMPLES*numModels*sizeof(float));
+	uint8_t* tile8 = NULL;
+	float* tileScale = NULL;
+	if (args->w8 != NULL) {
+		tile8 = (uint8_t*)malloc(CLASSIFY_TILE_SAMPLES*ldw);
+		tileScale = (float*)malloc(CLASSIFY_TILE_SAMPLES*sizeof(float));
+	}
+
+	for (uint32_t first = args->firstSample; first < args->lastSample; first += CLASSIFY_TILE_SAMPLES) {
+		uint32_t count = (args->lastSample - first < CLASSIFY_TILE_SAMPLES) ? args->lastSample - first : CLASSIFY_TILE_SAMPLES;
+		const float* tile = args->a + (uint64_t)first*numFeatures;
+
+		if (args->row_ptr != NULL) {
+			// Sparse rows: gathers from every model, no blocking needed
+			const sparse_kernels& sparse = get_sparse_kernels();
+			for (uint32_t r = 0; r < count; r++) {
+				uint64_t begin = args->row_ptr[first + r];
+				uint32_t nnz = args->row_ptr[first + r + 1] - begin;
+				for (uint32_t m = 0; m < args->numClasses; m++)
+					scores[r*numModels + m] = sparse.dot(args->w + (uint64_t)m*ldw, args->values + begin, args->columns + begin, nnz);
+			}
+		}
+		else if (args->w8 != NULL) {
+			for (uint32_t r = 0; r < count; r++) {
+				tileScale[r] = quantize_row_int8(tile + r*numFeatures, tile8 + r*ldw, numFeatures);
+				memset(tile8 + r*ldw + numFeatures, 128, ldw - numFeatures);
+			}
+		}
+
+		for (uint32_t firstModel = 0; firstModel < numModels && args->row_ptr == NULL; firstModel += modelsPerBlock) {
+			uint32_t lastModel = (firstModel + modelsPerBlock < numModels) ? firstModel + modelsPerBlock : numModels;
+			for (uint32_t r = 0; r < count; r += 2) {
+				uint32_t rows = (r+1 < count) ? 2 : 1;
+				for (uint32_t m = firstModel; m < lastModel; m += 4) {
+					if (args->w8 != NULL) {
+						int32_t dots[8];
+						kernels.dot_u8s8(tile8 + r*ldw, (rows == 2) ? ldw : 0, args->w8 + (uint64_t)m*ldw, ldw, ldw, dots);
+						for (uint32_t k = 0; k < rows; k++) {
+							for (uint32_t l = 0; l < 4; l++)
+								scores[(r+k)*numModels + m+l] = (float)(dots[k*4 + l] - 128*args->w8_sum[m+l])*tileScale[r+k]*args->w8_scale[m+l];
+						}
+					}
+					else {
+						float dots[8];
+						kernels.dot(tile + r*numFeatures, (rows == 2) ? numFeatures : 0, args->w + (uint64_t)m*ldw, ldw, numFeatures, dots);
+						for (uint32_t k = 0; k < rows; k++)
+							memcpy(scores + (r+k)*numModels + m, dots + k*4, 4*sizeof(float));
+					}
+				}
+			}
+		}
+
+		for (uint32_t r = 0; r < count; r++) {
+			const float* sampleScores = scores + r*numModels;
+			if (args->predictions != NULL) {
+				float max = 0.0;
+				int matched_class = -1;
+				for (uint32_t c = 0; c < args->numClasses; c++) {
+					if (sampleScores[c] > max) {
+						max = sampleScores[c];
+						matched_class = c;
+					}
+				}
+				args->predictions[first + r] = matched_class;
+			}
+			else
+				args->result[first + r] = sampleScores[0];
+		}
+	}
+	free(scores);
+	if (tile8 != NULL) {
+		free(tile8);
+		free(tileScale);
+	}
+	return NULL;
+}
+
+double zipml_sgd::classify(float* xs[], uint32_t numClasses, char useInt8, int predictions[], float result[]) {
+	if (is_sparse() && useInt8 == 1) {
+		cout << "int8 inference needs dense data, using float" << endl;
+		useInt8 = 0;
+	}
+	// Models packed contiguously, padded with zero models to a multiple of 4 and
+	// with zeros to whole cache lines
+	uint32_t numModels = (numClasses + 3)/4*4;
+	uint32_t ldw = (useInt8 == 1) ? (numFeatures + 63)/64*64 : (numFeatures + 15)/16*16;
+	float* w = NULL;
+	int8_t* w8 = NULL;
+	float* w8_scale = NULL;
+	int32_t* w8_sum = NULL;
+	if (useInt8 == 1) {
+		w8 = (int8_t*)calloc((uint64_t)numModels*ldw, 1);
+		w8_scale = (float*)malloc(numModels*sizeof(float));
+		w8_sum = (int32_t*)calloc(numModels, sizeof(int32_t));
+		for (uint32_t c = 0; c < numModels; c++) {
+			w8_scale[c] = 1.0f;
+			if (c >= numClasses)
+				continue;
+			float max = 0;
+			for (uint32_t j = 0; j < numFeatures; j++)
+				max = (xs[c][j] > max) ? xs[c][j] : ((-xs[c][j] > max) ? -xs[c][j] : max);
+			if (max > 0)
+				w8_scale[c] = max/127.0f;
+			for (uint32_t j = 0; j < numFeatures; j++) {
+				w8[(uint64_t)c*ldw + j] = (int8_t)lrintf(xs[c][j]/w8_scale[c]);
+				w8_sum[c] += w8[(uint64_t)c*ldw + j];
+			}
+		}
+	}
+	else {
+		w = (float*)calloc((uint64_t)numModels*ldw, sizeof(float));
+		for (uint32_t c = 0; c < numClasses; c++)
+			memcpy(w + (uint64_t)c*ldw, xs[c], numFeatures*sizeof(float));
+	}
+
+	uint32_t numThreads = numCPUThreads;
+	uint32_t numTiles = (numSamples + CLASSIFY_TILE_SAMPLES-1)/CLASSIFY_TILE_SAMPLES;
+	if (numThreads > numTiles)
+		numThreads = (numTiles > 0) ? numTiles : 1;
+	pthread_t* threads = (pthread_t*)malloc(numThreads*sizeof(pthread_t));
+	classify_args* args = (classify_args*)malloc(numThreads*sizeof(classify_args));
+	for (uint32_t t = 0; t < numThreads; t++) {
+		args[t].a = a;
+		args[t].numFeatures = numFeatures;
+		args[t].firstSample = ((uint64_t)numTiles*t/numThreads)*CLASSIFY_TILE_SAMPLES;
+		args[t].lastSample = ((uint64_t)numTiles*(t+1)/numThreads)*CLASSIFY_TILE_SAMPLES;
+		if (args[t].lastSample > numSamples)
+			args[t].lastSample = numSamples;
+		args[t].numClasses = numClasses;
+		args[t].numModels = numModels;
+		args[t].ldw = ldw;
+		args[t].w = w;
+		args[t].w8 = w8;
+		args[t].w8_scale = w8_scale;
+		args[t].w8_sum = w8_sum;
+		args[t].predictions = predictions;
+		args[t].result = result;
+		args[t].values = csr_values;
+		args[t].columns = csr_columns;
+		args[t].row_ptr = is_sparse() ? csr_row_ptr : NULL;
+	}
+
+	double start = get_time();
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_create(&threads[t], NULL, classify_worker, &args[t]);
+	classify_worker(&args[0]);
+	for (uint32_t t = 1; t < numThreads; t++)
+		pthread_join(threads[t], NULL);
+	double predictionsPerSecond = numSamples/(get_time() - start);
+	cout << "Predictions/s: " << predictionsPerSecond << " (" << ((useInt8 == 1) ? "int8" : "float") << ", threads: " << numThreads << ")" << endl;
+
+	if (w != NULL)
+		free(w);
+	if (w8 != NULL) {
+		free(w8);
+		free(w8_scale);
+		free(w8_sum);
+	}
+	free(threads);
+	free(args);
+	return predictionsPerSecond;
+}
+
+double zipml_sgd::inference(float result[], float* x, char useInt8) {
 	//float result[numSamples];
+	double predictionsPerSecond = classify(&x, 1, useInt8, NULL, result);
 
 	int count_trues = 0;
 	for (uint32_t i = 0; i < numSamples; i++) {
-		float dot = 0;
-		for (uint32_t j = 0; j < numFeatures; j++) {
-			dot += x[j]*a[i*numFeatures + j];
-		}
+		float dot = result[i];
 		if (b_normalizedToMinus1_1 == 0) {
 			dot = dot*b_range + b_min;
 		}
@@ -1042,28 +3706,23 @@ void zipml_sgd::inference(float result[], float* x) {
 			count_trues++;
 	}
 	cout << "True predictions: " << count_trues << " out of " << numSamples << " samples." << endl;
+	return predictionsPerSecond;
 }
 
-void zipml_sgd::multi_classification(float* xs[], uint32_t numClasses) {
+double zipml_sgd::multi_classification(float* xs[], uint32_t numClasses, char useInt8, int predictions[]) {
+	int* matched_classes = (predictions != NULL) ? predictions : (int*)malloc(numSamples*sizeof(int));
+	double predictionsPerSecond = classify(xs, numClasses, useInt8, matched_classes, NULL);
+
 	int count_trues = 0;
 	for (uint32_t i = 0; i < numSamples; i++) {
-		float max = 0.0;
-		int matched_class = -1;
-		for (uint32_t c = 0; c < numClasses; c++) {
-			float dot = 0;
-			for (uint32_t j = 0; j < numFeatures; j++) {
-				dot += xs[c][j]*a[i*numFeatures + j];
-			}
-			if (dot > max) {
-				max = dot;
-				matched_class = c;
-			}
-		}
-		if ((int)b[i] == matched_class)
+		if ((int)b[i] == matched_classes[i])
 			count_trues++;
 	}
 	cout << "True predictions: " << count_trues << " out of " << numSamples << " samples." << endl;
+	if (predictions == NULL)
+		free(matched_classes);
+	return predictionsPerSecond;
 }
 
 
-#endif
\ No newline at end of file
+#endif